@@ -242,6 +242,22 @@ checkSegment( uint8_t* ptr, size_t sz, size_t reincarnation )
     }
 }
 
+// Allocators that can use the size at deallocation (like C++14 sized delete) provide deallocate( ptr, sz ).
+template <class AllocatorUnderTest>
+FORCE_INLINE auto
+deallocateWithSize( AllocatorUnderTest& allocatorUnderTest, void* ptr, size_t sz, int )
+    -> decltype( allocatorUnderTest.deallocate( ptr, sz ), void() )
+{
+    allocatorUnderTest.deallocate( ptr, sz );
+}
+
+template <class AllocatorUnderTest>
+FORCE_INLINE void
+deallocateWithSize( AllocatorUnderTest& allocatorUnderTest, void* ptr, size_t, long )
+{
+    allocatorUnderTest.deallocate( ptr );
+}
+
 template <class AllocatorUnderTest, MEM_ACCESS_TYPE mat>
 void
 randomPos_RandomSize( AllocatorUnderTest& allocatorUnderTest, size_t iterCount, size_t maxItems, size_t maxItemSizeExp,
@@ -370,7 +386,7 @@ randomPos_RandomSize( AllocatorUnderTest& allocatorUnderTest, size_t iterCount,
 #ifdef COLLECT_USER_MAX_ALLOCATED
                 allocatedSz -= baseBuff[idx].sz;
 #endif
-                allocatorUnderTest.deallocate( baseBuff[idx].ptr );
+                deallocateWithSize( allocatorUnderTest, baseBuff[idx].ptr, baseBuff[idx].sz, 0 );
                 baseBuff[idx].ptr = 0;
             }
             else
@@ -432,7 +448,7 @@ randomPos_RandomSize( AllocatorUnderTest& allocatorUnderTest, size_t iterCount,
                     }
                 }
             }
-            allocatorUnderTest.deallocate( baseBuff[idx].ptr );
+            deallocateWithSize( allocatorUnderTest, baseBuff[idx].ptr, baseBuff[idx].sz, 0 );
         }
 
     if constexpr( !allocatorUnderTest.isFake() )
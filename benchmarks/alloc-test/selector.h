@@ -43,6 +43,10 @@
 //typedef NewDeleteAllocatorForTest MyAllocatorT;
 
 #include "sm_allocator.h"
+#ifdef SM_SIZED_FREE
+typedef SuperMallocSizedAllocatorForTest MyAllocatorT;
+#else
 typedef SuperMallocAllocatorForTest MyAllocatorT;
+#endif
 
 #endif    // SELECTOR_H
@@ -63,4 +63,16 @@ class SuperMallocAllocatorForTest
     ThreadTestRes* getTestRes() { return testRes; }
 };
 
+// Same, but frees with the size, the way C++14 sized delete does.
+class SuperMallocSizedAllocatorForTest : public SuperMallocAllocatorForTest
+{
+   public:
+    SuperMallocSizedAllocatorForTest( ThreadTestRes* testRes_ ) : SuperMallocAllocatorForTest( testRes_ ) {}
+
+    static constexpr const char* name() { return "SuperMalloc allocator (sized free)"; }
+
+    void deallocate( void* ptr ) { sm_free( ptr ); }
+    void deallocate( void* ptr, size_t sz ) { sm_free_sized( ptr, sz ); }
+};
+
 #endif    // NEW_DELETE_ALLOCATOR_H
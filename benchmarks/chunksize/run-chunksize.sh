@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+# Chunk size benchmark: build larson and threadtest against supermalloc
+# once per chunk size (premake --chunksize=...), and run each at 1, 2,
+# 4, ... max_threads threads, recording the peak resident set size.
+#
+# usage: benchmarks/chunksize/run-chunksize.sh [max_threads] [sizes...]
+#   e.g. benchmarks/chunksize/run-chunksize.sh 16 1M 2M 4M 8M
+#
+# Prints one line per run: chunk size, benchmark, threads, the
+# benchmark's own figure (larson: operations per second, higher is
+# better; threadtest: elapsed seconds, lower is better), and the peak
+# RSS in KiB (lower is better).
+set -euo pipefail
+
+root="$(cd "$(dirname "$0")/../.." && pwd)"
+cd "$root"
+
+max_threads="${1:-16}"
+shift || true
+sizes=("$@")
+if [[ ${#sizes[@]} -eq 0 ]]; then sizes=(1M 2M 4M 8M); fi
+
+premake="${PREMAKE:-tools/premake5}"
+bin="bin/linux64"
+out="$(mktemp)"
+trap 'rm -f "$out"' EXIT
+
+# Run "$@" with its output in $out, and print its peak RSS (VmHWM) in KiB.
+peak_rss() {
+    "$@" >"$out" 2>/dev/null &
+    local pid=$! hwm=0 kb
+    while kill -0 "$pid" 2>/dev/null; do
+        kb=$(awk '/^VmHWM:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || true)
+        if [[ -n "$kb" ]]; then hwm=$kb; fi
+        sleep 0.05
+    done
+    wait "$pid"
+    echo "$hwm"
+}
+
+for size in "${sizes[@]}"; do
+    "$premake" gmake --chunksize="$size" >/dev/null
+    make clean >/dev/null
+    make config=release_linux64 -j"$(nproc)" larson threadtest >/dev/null
+
+    for ((threads = 1; threads <= max_threads; threads *= 2)); do
+        # sleep=5s, sizes 8..1000, 5000 blocks per thread, 100 rounds, seed 4141
+        rss=$(peak_rss "$bin/larson" 5 8 1000 5000 100 4141 "$threads")
+        ops=$(awk '/Throughput/ { print $3 }' "$out")
+        printf "%-3s larson     %3d threads %14s ops/s %10s KiB\n" "$size" "$threads" "$ops" "$rss"
+
+        # 50 iterations of 30000 objects of 8 bytes, split among the threads
+        rss=$(peak_rss "$bin/threadtest" "$threads" 50 30000 0 8)
+        secs=$(awk '/Time elapsed/ { print $4 }' "$out")
+        printf "%-3s threadtest %3d threads %14s s     %10s KiB\n" "$size" "$threads" "$secs" "$rss"
+    done
+done
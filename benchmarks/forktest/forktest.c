@@ -0,0 +1,175 @@
+// Prefork-server benchmark: warm up a heap, fork workers from it, and
+// measure what each worker costs in copy-on-write faults and private
+// memory.
+//
+// usage: forktest [inherit|fresh] [n_children] [n_warm_objects] [n_worker_ops]
+//
+// The parent allocates n_warm_objects objects of assorted sizes and
+// frees every third one, so that the worker's allocations can land in
+// partially-full folios.  Each worker then does n_worker_ops random
+// allocations and frees, and also frees a tenth of the objects it
+// inherited.  For each worker we report the minor faults it took
+// (getrusage) and its RSS and Private_Dirty (/proc/self/smaps_rollup).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "supermalloc.h"
+
+typedef struct worker_report
+{
+    long minflt;
+    long rss_kb;
+    long private_dirty_kb;
+} worker_report;
+
+static unsigned long rng_state = 88172645463325252ul;
+
+static unsigned long
+next_random( void )
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t
+random_size( void )
+{
+    // Mostly small objects, with the occasional large one.
+    unsigned long r = next_random();
+    if( r % 100 == 0 ) return 16384 + r % 200000;
+    return 8 + ( r >> 8 ) % 1024;
+}
+
+static long
+smaps_rollup_kb( const char* field )
+{
+    FILE* f = fopen( "/proc/self/smaps_rollup", "r" );
+    if( f == NULL ) return -1;
+    char   line[256];
+    long   kb  = -1;
+    size_t len = strlen( field );
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        if( strncmp( line, field, len ) == 0 && line[len] == ':' )
+        {
+            kb = strtol( line + len + 1, NULL, 10 );
+            break;
+        }
+    }
+    fclose( f );
+    return kb;
+}
+
+static void
+run_worker( void** warm, long n_warm, long n_ops, int fd )
+{
+    struct rusage before, after;
+    getrusage( RUSAGE_SELF, &before );
+
+    enum
+    {
+        n_live = 4096
+    };
+    static void* live[n_live];
+    for( long i = 0; i < n_ops; i++ )
+    {
+        long k = next_random() % n_live;
+        if( live[k] ) sm_free( live[k] );
+        live[k] = sm_malloc( random_size() );
+        memset( live[k], 1, 8 );
+    }
+    for( long i = 0; i < n_warm; i += 10 )
+    {
+        sm_free( warm[i] );
+        warm[i] = NULL;
+    }
+
+    getrusage( RUSAGE_SELF, &after );
+    worker_report r;
+    r.minflt           = after.ru_minflt - before.ru_minflt;
+    r.rss_kb           = smaps_rollup_kb( "Rss" );
+    r.private_dirty_kb = smaps_rollup_kb( "Private_Dirty" );
+    if( write( fd, &r, sizeof( r ) ) != sizeof( r ) ) _exit( 1 );
+    _exit( 0 );
+}
+
+int
+main( int argc, char** argv )
+{
+    const char* mode       = argc > 1 ? argv[1] : "inherit";
+    int         n_children = argc > 2 ? atoi( argv[2] ) : 16;
+    long        n_warm     = argc > 3 ? atol( argv[3] ) : 1000000;
+    long        n_ops      = argc > 4 ? atol( argv[4] ) : 200000;
+
+    if( strcmp( mode, "fresh" ) == 0 ) sm_set_fork_mode( SM_FORK_FRESH_HEAP );
+    else if( strcmp( mode, "inherit" ) == 0 )
+        sm_set_fork_mode( SM_FORK_INHERIT_HEAP );
+    else
+    {
+        fprintf( stderr, "usage: %s [inherit|fresh] [n_children] [n_warm_objects] [n_worker_ops]\n", argv[0] );
+        return 1;
+    }
+
+    void** warm = sm_malloc( n_warm * sizeof( void* ) );
+    for( long i = 0; i < n_warm; i++ )
+    {
+        size_t s = random_size();
+        warm[i]  = sm_malloc( s );
+        memset( warm[i], 0, s );
+    }
+    for( long i = 0; i < n_warm; i += 3 )
+    {
+        sm_free( warm[i] );
+        warm[i] = sm_malloc( 8 );
+    }
+
+    int fds[2];
+    if( pipe( fds ) != 0 )
+    {
+        perror( "pipe" );
+        return 1;
+    }
+    for( int c = 0; c < n_children; c++ )
+    {
+        pid_t pid = fork();
+        if( pid < 0 )
+        {
+            perror( "fork" );
+            return 1;
+        }
+        if( pid == 0 )
+        {
+            close( fds[0] );
+            rng_state += c;
+            run_worker( warm, n_warm, n_ops, fds[1] );
+        }
+    }
+    close( fds[1] );
+
+    worker_report total = { 0, 0, 0 };
+    int           n     = 0;
+    worker_report r;
+    while( read( fds[0], &r, sizeof( r ) ) == sizeof( r ) )
+    {
+        total.minflt += r.minflt;
+        total.rss_kb += r.rss_kb;
+        total.private_dirty_kb += r.private_dirty_kb;
+        n++;
+    }
+    while( wait( NULL ) > 0 )
+    {
+    }
+    if( n == 0 ) return 1;
+    printf( "mode=%s children=%d warm_objects=%ld worker_ops=%ld\n", mode, n, n_warm, n_ops );
+    printf( "per child: %ld minor faults, %ld KiB RSS, %ld KiB Private_Dirty\n", total.minflt / n, total.rss_kb / n,
+            total.private_dirty_kb / n );
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+# Lock contention benchmark: build larson and threadtest against
+# supermalloc once per lock backend (premake --lock=...), and run each
+# at 1, 2, 4, ... max_threads threads.
+#
+# usage: benchmarks/locks/run-locks.sh [max_threads] [backends...]
+#   e.g. benchmarks/locks/run-locks.sh 64 mutex ttas ticket mcs
+#
+# Prints one line per run: backend, benchmark, threads, and the
+# benchmark's own figure (larson: operations per second, higher is
+# better; threadtest: elapsed seconds, lower is better).
+set -euo pipefail
+
+root="$(cd "$(dirname "$0")/../.." && pwd)"
+cd "$root"
+
+max_threads="${1:-64}"
+shift || true
+backends=("$@")
+if [[ ${#backends[@]} -eq 0 ]]; then backends=(mutex ttas ticket mcs); fi
+
+premake="${PREMAKE:-tools/premake5}"
+bin="bin/linux64"
+
+for backend in "${backends[@]}"; do
+    "$premake" gmake --lock="$backend" >/dev/null
+    make clean >/dev/null
+    make config=release_linux64 -j"$(nproc)" larson threadtest >/dev/null
+
+    for ((threads = 1; threads <= max_threads; threads *= 2)); do
+        # sleep=5s, sizes 8..1000, 5000 blocks per thread, 100 rounds, seed 4141
+        ops=$("$bin/larson" 5 8 1000 5000 100 4141 "$threads" 2>/dev/null | awk '/Throughput/ { print $3 }')
+        printf "%-7s larson     %3d threads %14s ops/s\n" "$backend" "$threads" "$ops"
+
+        # 50 iterations of 30000 objects of 8 bytes, split among the threads
+        secs=$("$bin/threadtest" "$threads" 50 30000 0 8 | awk '/Time elapsed/ { print $4 }')
+        printf "%-7s threadtest %3d threads %14s s\n" "$backend" "$threads" "$secs"
+    done
+done
@@ -0,0 +1,28 @@
+#pragma once
+
+// Stand-in for Hoard's HL::Fred (a thin wrapper around a thread) so that
+// threadtest.cpp builds without the Hoard sources.
+
+#include <pthread.h>
+
+namespace HL
+{
+class Fred
+{
+  public:
+    void
+    create( void* ( *fn )( void* ), void* arg )
+    {
+        pthread_create( &t_, nullptr, fn, arg );
+    }
+
+    void
+    join()
+    {
+        pthread_join( t_, nullptr );
+    }
+
+  private:
+    pthread_t t_;
+};
+}    // namespace HL
@@ -0,0 +1,43 @@
+// Route threadtest's new and delete to supermalloc.
+
+#include <new>
+
+#include "supermalloc.h"
+
+void*
+operator new( std::size_t size )
+{
+    void* p = sm_malloc( size );
+    if( p == nullptr ) throw std::bad_alloc();
+    return p;
+}
+
+void*
+operator new[]( std::size_t size )
+{
+    return operator new( size );
+}
+
+void
+operator delete( void* p ) noexcept
+{
+    sm_free( p );
+}
+
+void
+operator delete[]( void* p ) noexcept
+{
+    sm_free( p );
+}
+
+void
+operator delete( void* p, std::size_t ) noexcept
+{
+    sm_free( p );
+}
+
+void
+operator delete[]( void* p, std::size_t ) noexcept
+{
+    sm_free( p );
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Stand-in for Hoard's HL::Timer: a stopwatch that converts to the elapsed seconds.
+
+#include <chrono>
+
+namespace HL
+{
+class Timer
+{
+  public:
+    void
+    start()
+    {
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    void
+    stop()
+    {
+        stop_ = std::chrono::steady_clock::now();
+    }
+
+    operator double() const { return std::chrono::duration<double>( stop_ - start_ ).count(); }
+
+  private:
+    std::chrono::steady_clock::time_point start_, stop_;
+};
+}    // namespace HL
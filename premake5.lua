@@ -30,6 +30,30 @@ newoption {
     description = "Create code coverage report."
 }
 
+newoption {
+    trigger = "lock",
+    value = "BACKEND",
+    description = "Lock around the allocator's critical sections (see src/atomically.h).",
+    allowed = {
+        { "mutex", "pthread mutex / CRITICAL_SECTION (default)" },
+        { "ttas", "Test-and-test-and-set spin lock with backoff" },
+        { "ticket", "Ticket spin lock" },
+        { "mcs", "MCS queue lock" }
+    }
+}
+
+newoption {
+    trigger = "chunksize",
+    value = "SIZE",
+    description = "Size of the chunks the allocator maps and carves into objects (see SM_LOG_CHUNKSIZE in src/sm_config.h).",
+    allowed = {
+        { "1M", "1 MiB" },
+        { "2M", "2 MiB (default)" },
+        { "4M", "4 MiB" },
+        { "8M", "8 MiB" }
+    }
+}
+
 workspace "SuperMalloc"
     configurations { "Debug", "Release" }
 
@@ -63,6 +87,15 @@ filter {}
     targetdir "bin/%{cfg.platform}"
     objdir "__build/%{cfg.platform}/%{cfg.buildcfg}"
 
+if _OPTIONS["lock"] then
+    defines { "SM_LOCK_BACKEND=SM_LOCK_" .. string.upper(_OPTIONS["lock"]) }
+end
+
+if _OPTIONS["chunksize"] then
+    local log_chunksize = { ["1M"] = 20, ["2M"] = 21, ["4M"] = 22, ["8M"] = 23 }
+    defines { "SM_LOG_CHUNKSIZE=" .. log_chunksize[_OPTIONS["chunksize"]] }
+end
+
 group "SuperMalloc"
 
 project "objsizes"
@@ -111,6 +144,15 @@ project "alloc-test"
     includedirs { "src" }
     links { "supermalloc" }
 
+project "alloc-test-sized"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++17"
+    files { "benchmarks/alloc-test/*.cpp", "benchmarks/alloc-test/*.h" }
+    includedirs { "src" }
+    defines { "SM_SIZED_FREE" }
+    links { "supermalloc" }
+
 project "larson"
     kind "ConsoleApp"
     language "C"
@@ -118,7 +160,7 @@ project "larson"
     --buildoptions { "/Zc:preprocessor", "/volatile:iso", "/std:c11", "/TC", "/EHc" }
     files { "benchmarks/larson/larson.c" }
     includedirs {"src" }
-    links { "supermalloc" }
+    links { "supermalloc", "m" }
 
 project "xmalloc-test"
     kind "ConsoleApp"
@@ -129,6 +171,24 @@ project "xmalloc-test"
     includedirs {"src" }
     links { "supermalloc" }
 
+if os.istarget( "linux" ) then
+project "forktest"
+    kind "ConsoleApp"
+    language "C"
+    cdialect "C11"
+    files { "benchmarks/forktest/forktest.c" }
+    includedirs {"src" }
+    links { "supermalloc" }
+
+project "threadtest"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++17"
+    files { "benchmarks/threadtest/*.cpp", "benchmarks/threadtest/*.h" }
+    includedirs {"src" }
+    links { "supermalloc" }
+end
+
 if _ACTION == "clean" then
     os.rmdir("bin")
     os.rmdir("__build")
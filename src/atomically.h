@@ -5,8 +5,9 @@
 #include <sched.h>
 #endif
 
-#ifdef _WIN64
 #include <immintrin.h>
+
+#ifdef _WIN64
 #include "_windows.h"
 #endif
 
@@ -19,11 +20,64 @@
 #include "sm_bitops.h"
 #include "sm_platform.h"
 
+// The lock that SM_DECLARE_ATOMIC_OPERATION() puts around a critical
+// section.  The critical sections are a few dozen instructions long, so
+// a thread that finds the lock taken is usually better off spinning
+// than going to sleep in the kernel.  SM_LOCK_BACKEND (see sm_config.h)
+// selects the implementation:
+//  SM_LOCK_MUTEX:  pthread_mutex_t (a CRITICAL_SECTION on Windows).
+//  SM_LOCK_TTAS:   test-and-test-and-set with exponential backoff.
+//  SM_LOCK_TICKET: FIFO ticket lock, with backoff proportional to the
+//                  number of waiters ahead of us.
+//  SM_LOCK_MCS:    FIFO queue lock in which each waiter spins on its
+//                  own cache line, so a release invalidates only the
+//                  next waiter's line.
+// The spinning locks are adaptive: once a waiter has backed off for a
+// while it yields the CPU on every round, in case the holder has been
+// preempted.  Even so, the FIFO locks hand the lock to a particular
+// waiter, and if that waiter isn't running everyone else waits too, so
+// they do badly when there are more runnable threads than CPUs.
+
+#if SM_LOCK_BACKEND == SM_LOCK_MCS
+typedef struct sm_mcs_node
+{
+    SM_ALIGNED( 64 ) _Atomic( struct sm_mcs_node* ) next;
+    _Atomic( uint32_t ) waiting;
+} sm_mcs_node;
+
+// Each thread takes the queue nodes for the locks it holds from a small
+// pool, which only has to cover the few locks a thread nests.
+// fork_prepare() takes every allocator lock at once, which can be more
+// than the pool holds, so it queues on a node in each lock instead (see
+// sm_lock_for_fork()).
+enum
+{
+    sm_mcs_nodes_per_thread = 64
+};
+extern SM_ATTRIBUTE_THREAD sm_mcs_node sm_mcs_nodes[sm_mcs_nodes_per_thread];
+extern SM_ATTRIBUTE_THREAD uint64_t    sm_mcs_nodes_used;
+#endif
+
 typedef struct lock_t
 {
     union
     {
-#ifdef __linux__
+#if SM_LOCK_BACKEND == SM_LOCK_TTAS
+        SM_ALIGNED( 64 ) _Atomic( uint32_t ) locked;
+#elif SM_LOCK_BACKEND == SM_LOCK_TICKET
+        SM_ALIGNED( 64 ) struct
+        {
+            _Atomic( uint32_t ) next_ticket;
+            _Atomic( uint32_t ) now_serving;
+        } ticket;
+#elif SM_LOCK_BACKEND == SM_LOCK_MCS
+        SM_ALIGNED( 64 ) struct
+        {
+            _Atomic( sm_mcs_node* ) tail;
+            sm_mcs_node*            holder;    // written only by the holder
+            sm_mcs_node             fork_node;
+        } mcs;
+#elif defined( __linux__ )
         SM_ALIGNED( 64 ) pthread_mutex_t pt_m;
 #elif defined( _WIN64 )
         SM_ALIGNED( 64 ) CRITICAL_SECTION cs_m;
@@ -33,10 +87,51 @@ typedef struct lock_t
 
 //>typedef sm_lock_t lock_t;
 
+enum
+{
+    sm_lock_max_backoff         = 1024,    // pause instructions
+    sm_lock_pauses_per_waiter   = 64,      // for the ticket lock
+    sm_lock_rounds_before_yield = 8
+};
+
+static inline void
+sm_lock_backoff( uint32_t* backoff, uint32_t* rounds )
+// Effect: Pause for *backoff iterations and double *backoff (up to a limit).  After sm_lock_rounds_before_yield rounds,
+//  yield the CPU instead.
+{
+    if( ++*rounds > sm_lock_rounds_before_yield )
+    {
+        sched_yield();
+        return;
+    }
+    for( uint32_t i = 0; i < *backoff; i++ ) _mm_pause();
+    if( *backoff < sm_lock_max_backoff ) *backoff *= 2;
+}
+
 static inline void
 initialize_lock_array( lock_t* locks, size_t count )
 {
-#ifdef __linux__
+#if SM_LOCK_BACKEND == SM_LOCK_TTAS
+    for( size_t i = 0; i < count; ++i ) { atomic_store( &locks[i].locked, 0 ); }
+#elif SM_LOCK_BACKEND == SM_LOCK_TICKET
+    for( size_t i = 0; i < count; ++i )
+    {
+        atomic_store( &locks[i].ticket.next_ticket, 0 );
+        atomic_store( &locks[i].ticket.now_serving, 0 );
+    }
+#elif SM_LOCK_BACKEND == SM_LOCK_MCS
+    for( size_t i = 0; i < count; ++i )
+    {
+        // In a child after fork() we are the thread that took every lock, so give back the nodes it held them with.
+        sm_mcs_node* holder = locks[i].mcs.holder;
+        if( holder >= &sm_mcs_nodes[0] && holder < &sm_mcs_nodes[sm_mcs_nodes_per_thread] )
+        {
+            sm_mcs_nodes_used &= ~( 1ull << ( holder - &sm_mcs_nodes[0] ) );
+        }
+        locks[i].mcs.holder = NULL;
+        atomic_store( &locks[i].mcs.tail, NULL );
+    }
+#elif defined( __linux__ )
     pthread_mutexattr_t attr;
     pthread_mutexattr_init( &attr );
     for( size_t i = 0; i < count; ++i ) { pthread_mutex_init( &locks[i].pt_m, &attr ); }
@@ -45,10 +140,52 @@ initialize_lock_array( lock_t* locks, size_t count )
 #endif
     //>for( size_t i = 0; i < count; ++i ) { sm_lock_init( &locks[i] ); }
 }
+
+#if SM_LOCK_BACKEND == SM_LOCK_MCS
+static inline void
+sm_mcs_acquire( lock_t* mylock, sm_mcs_node* me )
+// Effect: Queue on mylock with the node me, and wait until it's our turn.
+{
+    atomic_store_explicit( &me->next, NULL, memory_order_relaxed );
+    atomic_store_explicit( &me->waiting, 1, memory_order_relaxed );
+    sm_mcs_node* pred = atomic_exchange_explicit( &mylock->mcs.tail, me, memory_order_acq_rel );
+    if( pred )
+    {
+        atomic_store_explicit( &pred->next, me, memory_order_release );
+        uint32_t backoff = 1, rounds = 0;
+        while( atomic_load_explicit( &me->waiting, memory_order_acquire ) ) sm_lock_backoff( &backoff, &rounds );
+    }
+    mylock->mcs.holder = me;
+}
+#endif
+
 static inline void
 sm_lock( lock_t* mylock )
 {
-#ifdef __linux__
+#if SM_LOCK_BACKEND == SM_LOCK_TTAS
+    uint32_t backoff = 1, rounds = 0;
+    while( atomic_load_explicit( &mylock->locked, memory_order_relaxed )
+           || atomic_exchange_explicit( &mylock->locked, 1, memory_order_acquire ) )
+    {
+        sm_lock_backoff( &backoff, &rounds );
+    }
+#elif SM_LOCK_BACKEND == SM_LOCK_TICKET
+    uint32_t me     = atomic_fetch_add_explicit( &mylock->ticket.next_ticket, 1, memory_order_relaxed );
+    uint32_t rounds = 0;
+    while( true )
+    {
+        uint32_t ahead = me - atomic_load_explicit( &mylock->ticket.now_serving, memory_order_acquire );
+        if( ahead == 0 ) return;
+        uint32_t backoff = ahead * sm_lock_pauses_per_waiter;
+        sm_lock_backoff( &backoff, &rounds );
+    }
+#elif SM_LOCK_BACKEND == SM_LOCK_MCS
+    uint64_t used = sm_mcs_nodes_used;
+    SM_ASSERT( used != UINT64_MAX );
+    int idx           = SM_BUILTIN_CTZ64( ~used );
+    sm_mcs_nodes_used = used | ( 1ull << idx );
+    sm_mcs_acquire( mylock, &sm_mcs_nodes[idx] );
+#elif defined( __linux__ )
     pthread_mutex_lock( &mylock->pt_m );
 #elif defined( _WIN64 )
     EnterCriticalSection( &mylock->cs_m );
@@ -58,13 +195,48 @@ sm_lock( lock_t* mylock )
 static inline void
 sm_unlock( lock_t* mylock )
 {
-#ifdef __linux__
+#if SM_LOCK_BACKEND == SM_LOCK_TTAS
+    atomic_store_explicit( &mylock->locked, 0, memory_order_release );
+#elif SM_LOCK_BACKEND == SM_LOCK_TICKET
+    uint32_t serving = atomic_load_explicit( &mylock->ticket.now_serving, memory_order_relaxed );
+    atomic_store_explicit( &mylock->ticket.now_serving, serving + 1, memory_order_release );
+#elif SM_LOCK_BACKEND == SM_LOCK_MCS
+    sm_mcs_node* me    = mylock->mcs.holder;
+    mylock->mcs.holder = NULL;
+    sm_mcs_node* next  = atomic_load_explicit( &me->next, memory_order_acquire );
+    if( next == NULL )
+    {
+        sm_mcs_node* expected = me;
+        if( !atomic_compare_exchange_strong_explicit( &mylock->mcs.tail, &expected, NULL, memory_order_release,
+                                                      memory_order_relaxed ) )
+        {
+            // Someone has swapped itself into the tail, but hasn't linked itself behind us yet.
+            uint32_t backoff = 1, rounds = 0;
+            while( ( next = atomic_load_explicit( &me->next, memory_order_acquire ) ) == NULL ) sm_lock_backoff( &backoff, &rounds );
+        }
+    }
+    if( next ) atomic_store_explicit( &next->waiting, 0, memory_order_release );
+    if( me != &mylock->mcs.fork_node ) sm_mcs_nodes_used &= ~( 1ull << ( me - &sm_mcs_nodes[0] ) );
+#elif defined( __linux__ )
     pthread_mutex_unlock( &mylock->pt_m );
 #elif defined( _WIN64 )
     LeaveCriticalSection( &mylock->cs_m );
 #endif
 }
 
+static inline void
+sm_lock_for_fork( lock_t* mylock )
+// Effect: Lock mylock in fork_prepare(), which holds every allocator lock at once.  Release it with sm_unlock().
+//  The MCS lock queues on the lock's own node rather than on one from the thread's pool.  That is safe because fork_prepare()
+//  takes the purge pass lock first, so at most one thread at a time is in here.
+{
+#if SM_LOCK_BACKEND == SM_LOCK_MCS
+    sm_mcs_acquire( mylock, &mylock->mcs.fork_node );
+#else
+    sm_lock( mylock );
+#endif
+}
+
 #define __GET_NTH_ARG__( _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, N, ... ) N
 #define __NARG__( ... )                                                                                       __GET_NTH_ARG__( "ignored", ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 )
 
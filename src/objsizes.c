@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <inttypes.h>    // for PRIu64
 #include <stdbool.h>
+#include <stddef.h>    // for offsetof
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -153,13 +154,22 @@ enum bin_category
 };
 
 static uint32_t
-overhead_bytes_per_chunk( enum bin_category bc, uint64_t foliosize )
+folio_header_bytes( enum bin_category bc, uint32_t objects_per_folio )
+{
+    // A small folio's header has a bitmap of just objects_per_folio bits, and is rounded up to cache lines so that no two
+    // folios share one.
+    if( bc != BIN_SMALL ) return 0;
+    return cacheline_size * ceil32( (uint32_t) offsetof( per_folio, inuse_bitmap ) + ceil32( objects_per_folio, 64 ) * 8, cacheline_size );
+}
+
+static uint32_t
+overhead_bytes_per_chunk( enum bin_category bc, uint64_t foliosize, uint32_t folio_header_size )
 {
     switch( bc )
     {
         case BIN_HUGE: return 0;
         case BIN_LARGE: return 1;
-        case BIN_SMALL: return ceil32( (uint32_t) ( sizeof( per_folio ) * ( chunksize / foliosize ) ), pagesize );
+        case BIN_SMALL: return ceil32( (uint32_t) ( folio_header_size * ( chunksize / foliosize ) ), pagesize );
         default: abort();
     }
 }
@@ -179,6 +189,8 @@ typedef struct static_bin_t
     uint32_t folio_division_shift_magic;
     uint32_t overhead_pages_per_chunk;
     uint32_t folios_per_chunk;
+    uint32_t folio_header_size;
+    uint32_t folio_header_division_multiply_magic;    // shift is 32
 } static_bin_t;
 
 void
@@ -192,7 +204,12 @@ static_bin_init( static_bin_t* inst, enum bin_category bc, uint64_t object_size
     inst->folio_division_multiply_magic  = calculate_multiply_magic( inst->foliosize );
     inst->object_division_shift_magic    = calculate_shift_magic( object_size );
     inst->folio_division_shift_magic     = calculate_shift_magic( inst->foliosize );
-    inst->overhead_pages_per_chunk       = overhead_bytes_per_chunk( bc, inst->foliosize );
+    inst->folio_header_size              = folio_header_bytes( bc, inst->objects_per_folio );
+    // Only offsets that are multiples of the header size get divided, and they are less than a chunk, so rounding the
+    // reciprocal up doesn't change the quotient.
+    inst->folio_header_division_multiply_magic =
+        inst->folio_header_size ? (uint32_t) ceil64( 1ull << 32, inst->folio_header_size ) : 0;
+    inst->overhead_pages_per_chunk       = overhead_bytes_per_chunk( bc, inst->foliosize, inst->folio_header_size );
     uint64_t folios_perchunk =
         object_size < chunksize ? ( chunksize - inst->overhead_pages_per_chunk * pagesize ) / inst->foliosize : 1;
     assert( folios_perchunk <= UINT32_MAX );
@@ -210,10 +227,12 @@ static_bin_print( static_bin_t* inst, FILE* f, uint32_t bin )
     assert( inst->foliosize % pagesize == 0 );
     print_number( f, inst->foliosize, 10 );
     fprintf( f,
-             ",              %4u,              %3u,                       %2u,                  %2u,          %2u,    "
+             ",              %4u,              %3u,               %3u,   %8u,                       %2u,                  %2u,          %2u,    "
              "%10" PRIu64 ",   %10" PRIu64 " },  // %3u",
-             inst->objects_per_folio, inst->folios_per_chunk, inst->overhead_pages_per_chunk, inst->object_division_shift_magic,
-             inst->folio_division_shift_magic, inst->object_division_multiply_magic, inst->folio_division_multiply_magic, bin );
+             inst->objects_per_folio, inst->folios_per_chunk, inst->folio_header_size,
+             inst->folio_header_division_multiply_magic, inst->overhead_pages_per_chunk,
+             inst->object_division_shift_magic, inst->folio_division_shift_magic, inst->object_division_multiply_magic,
+             inst->folio_division_multiply_magic, bin );
 }
 
 int
@@ -223,7 +242,7 @@ main( int argc, const char* argv[] )
 
     static_bin_t  b;
     static_bin_t* static_bins;
-    const size_t  static_bin_cnt = 47;    //>( pagesize / chunksize / cacheline_size );
+    const size_t  static_bin_cnt = 128;    // bin numbers fit in the low 7 bits of a bin_and_size_t.
 
     assert( argc == 2 );
     FILE* cf = fopen( argv[1], "w" );
@@ -242,8 +261,8 @@ main( int argc, const char* argv[] )
     printf( "#include <sys/types.h>\n" );
     printf( "// For chunks containing small objects, we reserve the first\n" );
     printf( "// several pages for bitmaps and linked lists.\n" );
-    printf( "// There's a per_page struct containing 2 pointers and a\n" );
-    printf( "// bitmap, and there are 512 of those.\n" );
+    printf( "// There's a per_folio struct containing a few pointers and a\n" );
+    printf( "// bitmap for each folio, sized to the bin's objects_per_folio.\n" );
     printf( "// As a result, there is no overhead in each page, but there is\n" );
     printf( "// overhead per chunk, which affects the large object sizes.\n\n" );
     printf( "// We obtain hugepages from the operating system via mmap(2).\n" );
@@ -262,7 +281,8 @@ main( int argc, const char* argv[] )
     const char* const struct_definition =
         "typedef struct static_bin_s { uint64_t object_size, folio_size; objects_per_folio_t objects_per_folio; "
         "folios_per_chunk_t "
-        "folios_per_chunk;  uint8_t overhead_pages_per_chunk, object_division_shift_magic, folio_division_shift_magic; uint64_t "
+        "folios_per_chunk; uint16_t folio_header_size; uint32_t folio_header_division_multiply_magic; uint8_t "
+        "overhead_pages_per_chunk, object_division_shift_magic, folio_division_shift_magic; uint64_t "
         "object_division_multiply_magic, folio_division_multiply_magic;} static_bin_s";
     printf( "%s;\nextern static_bin_s static_bin_info[];\n", struct_definition );
     fprintf( cf, "SM_ALIGNED( 64 ) static_bin_s static_bin_info[] = { \n" );
@@ -271,8 +291,9 @@ main( int argc, const char* argv[] )
     fprintf( cf, "// We stop at when we have 4 cachelines, so that the ones that happen to be multiples of cache lines are "
                  "either a power of two or odd.\n" );
     const char* const header_line =
-        "//{ objsize, folio_size, objects_per_folio, folios_per_chunk, overhead_pages_per_chunk, magic: object_shift, "
-        "folio_shift, object_multiply, folio_multiply},  // fragmentation(overhead bins net)\n";
+        "//{ objsize, folio_size, objects_per_folio, folios_per_chunk, folio_header_size, folio_header_multiply, "
+        "overhead_pages_per_chunk, magic: object_shift, folio_shift, object_multiply, folio_multiply},  // "
+        "fragmentation(overhead bins net)\n";
     fprintf( cf, "%s", header_line );
 
     int bin = 0;
@@ -308,7 +329,7 @@ done_small:
     fprintf( cf, "// Class 2 small objects are prime multiples of a cache line.\n" );
     fprintf( cf, "// The folio size is such that the number of 4K pages equals the\n" );
     fprintf( cf, "// number of cache lines in the object.  Namely, the folio size is 64 times\n" );
-    fprintf( cf, "// the object size.  The small_chunk_header fits into 8 pages.\n" );
+    fprintf( cf, "// the object size.  The folio headers fit into 8 pages.\n" );
 
     fprintf( cf, "%s", header_line );
 
@@ -368,26 +389,34 @@ done_small:
              "// This introduces fragmentation.  This fragmentation doesn't matter much since it will be purged. For sizes up "
              "to 1<<%d we waste the last potential object.\n",
              largest_waste_at_end );
+    fprintf( cf, "// Like the first class of small objects, the sizes are of the form c<<k where c is 4, 5, 6 or 7, up to half a "
+                 "chunk.\n" );
     fprintf( cf,
-             "// for the larger stuff, we reduce the size of the object slightly which introduces some other fragmentation\n" );
+             "// for the larger stuff, when the first page would cost an object per chunk, we reduce the size of the object "
+             "slightly which introduces some other fragmentation\n" );
     int first_large_bin = bin;
     for( uint64_t log_allocsize = 14; log_allocsize < log_chunksize; log_allocsize++ )
     {
-        uint64_t    objsize = 1ull << log_allocsize;
-        const char* comment = "";
-        if( log_allocsize > largest_waste_at_end )
+        for( uint64_t c = 4; c <= 7; c++ )
         {
-            objsize -= pagesize;
-            comment = " (reserve a page for the list of sizes)";
+            if( log_allocsize == log_chunksize - 1 && c > 4 ) break;    // Bigger objects are huge.
+            uint64_t    objsize = ( c << log_allocsize ) / 4;
+            const char* comment = "";
+            if( log_allocsize > largest_waste_at_end
+                && ( chunksize - offset_of_first_object_in_large_chunk ) / objsize < chunksize / objsize )
+            {
+                objsize -= pagesize;
+                comment = " (reserve a page for the list of sizes)";
+            }
+            static_bin_init( &b, BIN_LARGE, objsize );
+            static_bin_print( &b, cf, bin );
+            fprintf( cf, " %s\n", comment );
+            assert( bin < static_bin_cnt );
+            static_bins[bin++] = b;
+
+            assert( b.objects_per_folio * b.folios_per_chunk * sizeof( large_object_list_cell )
+                    <= offset_of_first_object_in_large_chunk );
         }
-        static_bin_init( &b, BIN_LARGE, objsize );
-        static_bin_print( &b, cf, bin );
-        fprintf( cf, " %s\n", comment );
-        assert( bin < static_bin_cnt );
-        static_bins[bin++] = b;
-
-        assert( b.objects_per_folio * b.folios_per_chunk * sizeof( large_object_list_cell )
-                <= offset_of_first_object_in_large_chunk );
     }
     binnumber_t first_huge_bin = bin;
     fprintf( cf, "// huge objects (chunk allocated) start  at this size. %d\n", chunksize );
@@ -405,7 +434,9 @@ done_small:
     printf( "    offset_of_first_object_in_large_chunk = %" PRIu64 ",\n", offset_of_first_object_in_large_chunk );
     printf( "    largest_large         = %zu,\n", largest_large );
     printf( "    first_large_bin_number = %d,\n", first_large_bin );
-    printf( "    first_huge_bin_number   = %u };\n", first_huge_bin );
+    printf( "    first_huge_bin_number   = %u,\n", first_huge_bin );
+    // The folio header sizes above depend on where the bitmap is.
+    printf( "    folio_bitmap_offset     = %zu };\n", offsetof( per_folio, inuse_bitmap ) );
 
     printf( "#define REPEAT_FOR_SMALL_BINS(x) " );
     for( int b1 = 0; b1 < first_large_bin; b1++ )
@@ -456,6 +487,37 @@ done_small:
     printf( "    return offs[bin];\n" );
     printf( "}\n" );
 
+    // Merge groups for small bins that are rarely used (see sm_set_merge_cold_bins()).  A cold bin is served by the largest
+    // bin in the same power-of-two range that malloc() itself uses (it skips power-of-two bins above a cache line), so that a
+    // process that touches many bins lightly doesn't pay for a chunk per bin.
+    printf( "// While bin is cold, its objects may come from cold_bin_merge_target(bin) instead.\n" );
+    printf( "static inline binnumber_t cold_bin_merge_target(binnumber_t bin) {\n" );
+    printf( "    const static uint8_t targets[]={" );
+    for( int b1 = 0; b1 < first_large_bin; b1++ )
+    {
+        uint64_t size   = static_bins[b1].object_size;
+        int      target = b1;
+        if( !( is_power_of_two( size ) && size > cacheline_size ) )
+        {
+            uint64_t range_end = hyperceil( size );
+            for( int b2 = b1 + 1; b2 < first_large_bin && static_bins[b2].object_size <= range_end; b2++ )
+            {
+                uint64_t s2 = static_bins[b2].object_size;
+                if( !( is_power_of_two( s2 ) && s2 > cacheline_size ) ) target = b2;
+            }
+            if( range_end > largest_small ) target = first_large_bin - 1;
+        }
+        // The target must be as well aligned as malloc() promises.
+        uint64_t target_size = static_bins[target].object_size;
+        assert( target_size >= size );
+        assert( ( target_size & -target_size ) >= 16 || ( target_size & -target_size ) >= ( size & -size ) );
+        if( b1 > 0 ) printf( ", " );
+        printf( "%d", target );
+    }
+    printf( "};\n" );
+    printf( "    return targets[bin];\n" );
+    printf( "}\n" );
+
     printf( "static inline binnumber_t size_2_bin(size_t size) {\n" );
     printf( "  if (size <= 8) return 0;\n" );
     printf( "  if (size <= 320) {\n" );
@@ -39,6 +39,9 @@
 #define MEMALIGN           PREFIXIFY( memalign )
 #define REALLOC            PREFIXIFY( realloc )
 #define MALLOC_USABLE_SIZE PREFIXIFY( malloc_usable_size )
+#define FREE_SIZED         PREFIXIFY( free_sized )
+#define MALLOC_BATCH       PREFIXIFY( malloc_batch )
+#define FREE_BATCH         PREFIXIFY( free_batch )
 
 #ifdef __cplusplus
 extern "C"
@@ -92,7 +95,7 @@ chunk_info*               chunk_infos;
 
 enum
 {
-    n_elts = 1ull << 27
+    n_elts = 1ull << log_max_chunknumber
 };
 
 _Atomic( uint32_t ) ci_bitfields[n_elts / 32] = { 0 };
@@ -169,7 +172,8 @@ extern "C"
     init_huge_malloc();
     init_large_malloc();
     init_small_malloc();
-    //>init_cached_malloc();
+    init_cached_malloc();
+    init_fork_handling();
 }
 
 void
@@ -224,40 +228,77 @@ test_hyperceil( void )
 }
 #endif
 
-void*
-cached_malloc( binnumber_t bin )
+static uint64_t max_allocatable_size = ( (uint64_t) chunksize << log_max_chunknumber ) - 1;
+
+static inline binnumber_t
+small_malloc_bin( size_t size )
+// Effect: Return the bin that MALLOC() uses for size.
+// Requires: size < largest_small.
 {
-    SM_ASSERT( bin < first_huge_bin_number );
-    uint64_t siz = bin_2_size( bin );
+    binnumber_t bin = size_2_bin( size );
+    size_t      siz = bin_2_size( bin );
+    // We are willing to go with powers of two that are up to a single
+    // cache line with no issues, since that doesn't cause
+    // associativity problems.
+    if( size <= cacheline_size || !is_power_of_two( siz ) ) { return bin; }
+    else { return bin + 1; }
+}
 
-    if( bin < first_large_bin_number )
-    {
-        void* result = small_malloc( bin );
-        return result;
-    }
-    else
-    {
-        void* result = large_malloc( siz );
-        return result;
-    }
+// Cold bin merging (see sm_set_merge_cold_bins()).  Every small bin
+// that is used at all costs a chunk, with its header pages, so a
+// process that allocates a few objects from each of many bins pays for
+// many mostly-empty chunks.  In this mode, a small bin starts out cold:
+// MALLOC() serves it from cold_bin_merge_target(bin), a bigger bin in
+// the same power-of-two range, until it has handed out
+// cold_bin_promotion_bytecount bytes for that bin.  Then the bin gets
+// its own chunks.  The internal fragmentation this costs is bounded by
+// that byte count per bin.  Objects keep the bin they were allocated
+// from, so FREE() needs no change, but FREE_SIZED() can no longer
+// derive the bin from the size of a bin that may have been merged.
+static _Atomic( uint8_t ) cold_bin_target[first_large_bin_number];    // 0 means not merged (no bin merges into bin 0)
+static _Atomic( uint64_t ) cold_bin_bytecount[first_large_bin_number];
+static _Atomic( bool ) cold_bin_merging_used;
+
+static binnumber_t
+cold_bin_serve( binnumber_t bin, binnumber_t target, uint64_t n_objects )
+// Effect: Account for n_objects allocations from the cold bin, and return the bin that should serve them.
+{
+    if( bin >= first_large_bin_number ) return bin;    // Only small bins are ever cold.
+    uint64_t bytes = atomic_fetch_add_explicit( &cold_bin_bytecount[bin], n_objects * bin_2_size( bin ), memory_order_relaxed );
+    if( bytes + n_objects * bin_2_size( bin ) < cold_bin_promotion_bytecount ) return target;
+    // It's warm now.
+    atomic_store_explicit( &cold_bin_target[bin], 0, memory_order_relaxed );
+    return bin;
 }
 
-void
-cached_free( void* ptr, binnumber_t bin )
+static inline binnumber_t
+small_serving_bin( binnumber_t bin, uint64_t n_objects )
+// Effect: Return the bin that serves n_objects allocations from the small bin, which is bin itself unless bin is cold.
 {
-    // What I want:
-    //  If the threadcache is empty enough, add the object to the thread cache, and we are done.
-    //  If the cpucache is empty enough, add everything in one of the threadcaches to the cpucache (including ptr), and we are done.
-    //  Else if the global cache is empty enough, add everything from one of the cpucaches (including the ptr), and we are done.
-    //  Else really free the pointer.
-    SM_ASSERT( bin < first_huge_bin_number );
-    uint64_t siz = bin_2_size( bin );
+    binnumber_t target = atomic_load_explicit( &cold_bin_target[bin], memory_order_relaxed );
+    if( target == 0 ) return bin;
+    return cold_bin_serve( bin, target, n_objects );
+}
 
-    if( bin < first_large_bin_number ) { small_free( ptr ); }
-    else { large_free( ptr ); }
+static inline bool
+small_bin_may_be_merged( binnumber_t bin )
+{
+    return cold_bin_merge_target( bin ) != bin && atomic_load_explicit( &cold_bin_merging_used, memory_order_relaxed );
 }
 
-static uint64_t max_allocatable_size = ( chunksize << 27 ) - 1;
+void
+sm_set_merge_cold_bins( int enable )
+{
+    maybe_initialize_malloc();
+    if( enable ) atomic_store( &cold_bin_merging_used, true );
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        binnumber_t target = cold_bin_merge_target( bin );
+        bool        cold   = enable && target != bin
+                    && atomic_load_explicit( &cold_bin_bytecount[bin], memory_order_relaxed ) < cold_bin_promotion_bytecount;
+        atomic_store_explicit( &cold_bin_target[bin], cold ? target : 0, memory_order_relaxed );
+    }
+}
 
 // Three kinds of mallocs:
 //   BIG, used for large allocations.  These are 2MB-aligned chunks.  We use BIG for anything bigger than a quarter of a chunk.
@@ -275,16 +316,10 @@ extern "C"
         errno = ENOMEM;
         return NULL;
     }
-    if( size < largest_small )
-    {
-        binnumber_t bin = size_2_bin( size );
-        size_t      siz = bin_2_size( bin );
-        // We are willing to go with powers of two that are up to a single
-        // cache line with no issues, since that doesn't cause
-        // associativity problems.
-        if( size <= cacheline_size || !is_power_of_two( siz ) ) { return cached_malloc( bin ); }
-        else { return cached_malloc( bin + 1 ); }
-    }
+    if( size < largest_small ) { return cached_malloc( small_serving_bin( small_malloc_bin( size ), 1 ) ); }
+#if SM_LARGE_PAGE_RUNS
+    else if( size <= page_run_largest ) { return page_run_malloc( size ); }
+#endif
     else
     {
         // For large and up, we need to add our own misalignment.
@@ -342,9 +377,16 @@ extern "C"
     SM_ASSERT( !( offset_in_chunk( p ) == 0 && bin == 0 ) );    // we cannot have a bin 0 item that is chunk-aligned
     if( bin < first_huge_bin_number )
     {
+        // Leave objects in a fresh-heap child's inherited chunks alone; even caching them would write to the parent's pages.
+        if( chunk_belongs_to_parent( cn ) ) return;
         // Cached_free cannot tolerate it.
         cached_free( object_base( p ), bin );
     }
+    else if( bin == page_run_bin_number )
+    {
+        if( chunk_belongs_to_parent( cn ) ) return;
+        page_run_free( p );
+    }
     else
     {
         // Huge free can tolerate p being offset.
@@ -352,6 +394,98 @@ extern "C"
     }
 }
 
+#ifdef __cplusplus
+extern "C"
+#endif
+    void
+    FREE_SIZED( void* p, size_t size )
+// Effect: Free p, which was returned by MALLOC(), CALLOC() or REALLOC() for size bytes (as with C++14 sized delete).
+//  For small sizes that tells us the bin, so we can skip the chunk_infos lookup and object_base().
+{
+    if( p == NULL ) return;
+    if( size >= largest_small )
+    {
+        // Large objects carry a random misalignment, so they need object_base() anyway.
+        FREE( p );
+        return;
+    }
+    binnumber_t bin = small_malloc_bin( size );
+    if( small_bin_may_be_merged( bin ) ) bin = bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size );
+    if( IS_TESTING )
+    {
+        SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size ) == bin );
+        SM_ASSERT( object_base( p ) == p );
+    }
+    if( chunk_belongs_to_parent( address_2_chunknumber( p ) ) ) return;
+    cached_free( p, bin );
+}
+
+#ifdef __cplusplus
+extern "C"
+#endif
+    size_t
+    MALLOC_BATCH( size_t size, size_t n, void** out )
+// Effect: Allocate n objects of size bytes into out[0..n), and return how many we allocated (fewer than n only if we ran out
+//  of memory).  Small objects that aren't in the thread cache are carved out of as few folios as possible, under a single
+//  acquisition of the bin lock, instead of one per object.
+{
+    maybe_initialize_malloc();
+    if( size < largest_small ) return cached_malloc_batch( small_serving_bin( small_malloc_bin( size ), n ), out, n );
+    for( size_t i = 0; i < n; i++ )
+    {
+        out[i] = MALLOC( size );
+        if( out[i] == NULL ) return i;
+    }
+    return n;
+}
+
+#ifdef __cplusplus
+extern "C"
+#endif
+    void
+    FREE_BATCH( void** ptrs, size_t n )
+// Effect: Free ptrs[0..n), skipping NULLs.  Small objects go to the thread cache while it has room.  The rest are grouped by
+//  bin, and each group is freed in one step (see small_free_batch()).
+{
+    maybe_initialize_malloc();
+    _Static_assert( first_large_bin_number <= 64, "bins_used must have a bit per small bin" );
+    void*    lists[first_large_bin_number];
+    uint64_t counts[first_large_bin_number];
+    uint64_t bins_used = 0;
+    for( size_t i = 0; i < n; i++ )
+    {
+        void* p = ptrs[i];
+        if( p == NULL ) continue;
+        chunknumber_t  cn  = address_2_chunknumber( p );
+        bin_and_size_t bnt = chunk_infos[cn].bin_and_size;
+        binnumber_t    bin = bin_from_bin_and_size( bnt );
+        if( bnt == 0 || bin >= first_large_bin_number )
+        {
+            FREE( p );
+            continue;
+        }
+        if( chunk_belongs_to_parent( cn ) ) continue;
+        void* base = object_base( p );
+        if( cached_free_if_room( base, bin ) ) continue;
+        if( !( bins_used & ( 1ull << bin ) ) )
+        {
+            lists[bin]  = NULL;
+            counts[bin] = 0;
+        }
+        bins_used |= 1ull << bin;
+        counts[bin]++;
+        // Another thread may still be reading base's first word as a stale stash link, so write it atomically.
+        atomic_store_explicit( (_Atomic uint64_t*) base, (uint64_t) lists[bin], memory_order_relaxed );
+        lists[bin] = base;
+    }
+    while( bins_used )
+    {
+        binnumber_t bin = SM_BUILTIN_CTZ64( bins_used );
+        bins_used &= bins_used - 1;
+        small_free_batch( bin, lists[bin], counts[bin] );
+    }
+}
+
 #ifdef __cplusplus
 extern "C"
 #endif
@@ -365,6 +499,12 @@ extern "C"
         return NULL;
     }
     if( p == NULL ) return MALLOC( size );
+    binnumber_t p_bin   = bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size );
+    bool        p_large = first_large_bin_number <= p_bin && p_bin < first_huge_bin_number;
+    // A large object grows and shrinks in place while it stays in its bin, so a growing buffer is copied only when it
+    //  outgrows the bin.  One that leaves its bin moves, since the large bins are close enough together that the smaller
+    //  one saves pages.
+    if( p_large && size >= largest_small && large_realloc_in_place( p, size ) ) return p;
     size_t oldsize = MALLOC_USABLE_SIZE( p );
     if( oldsize < size )
     {
@@ -374,11 +514,22 @@ extern "C"
         FREE( p );
         return result;
     }
-    if( oldsize > 16 && size < oldsize / 2 )
+    if( p_large || ( oldsize > 16 && size < oldsize / 2 ) )
     {
         void* result = MALLOC( size );
         if( !result ) return NULL;    // without disrupting the contents of p.
         for( size_t i = 0; i < size; i++ ) { ( (char*) result )[i] = ( (char*) p )[i]; }
+        FREE( p );
+        return result;
+    }
+    if( size < largest_small && small_malloc_bin( size ) != p_bin
+        && !( small_bin_may_be_merged( small_malloc_bin( size ) ) && cold_bin_merge_target( small_malloc_bin( size ) ) == p_bin ) )
+    {
+        // Keep a small result in place only if MALLOC( size ) could have returned it, so that FREE_SIZED( p, size ) works.
+        void* result = MALLOC( size );
+        if( !result ) return NULL;
+        for( size_t i = 0; i < size; i++ ) { ( (char*) result )[i] = ( (char*) p )[i]; }
+        FREE( p );
         return result;
     }
     return p;
@@ -400,6 +551,139 @@ test_realloc( void )
     char* d = (char*) REALLOC( c, 31 );
     SM_ASSERT( c == d );
     FREE( d );
+
+    // A shrink that changes the bin moves the object, so that it can be freed with its new size.
+    char* e = (char*) MALLOC( 112 );
+    for( int i = 0; i < 112; i++ ) e[i] = 'e';
+    char* f = (char*) REALLOC( e, 96 );
+    SM_ASSERT( f != e );
+    for( int i = 0; i < 96; i++ ) SM_ASSERT( f[i] == 'e' );
+    FREE_SIZED( f, 96 );
+
+#if !SM_LARGE_PAGE_RUNS
+    // A large object stays put while it stays in its bin, and gives back the pages it no longer needs.
+    binnumber_t bin   = first_large_bin_number + 3;
+    size_t      big   = bin_2_size( bin );
+    size_t      small = bin_2_size( bin - 1 ) + 1;    // The smallest size in bin.
+    char*       g     = (char*) MALLOC( small );
+    memset( g, 'g', small );
+    size_t g_size = MALLOC_USABLE_SIZE( g );
+    SM_ASSERT( REALLOC( g, g_size ) == g );
+    memset( g, 'g', g_size );
+    SM_ASSERT( REALLOC( g, small ) == g );
+    SM_ASSERT( MALLOC_USABLE_SIZE( g ) == g_size );
+    size_t end = g - (char*) object_base( g ) + small;
+    SM_ASSERT( large_footprint( object_base( g ) ) == pagesize * ceil64( end, pagesize ) );
+    for( size_t i = 0; i < small; i++ ) SM_ASSERT( g[i] == 'g' );
+    SM_ASSERT( REALLOC( g, g_size ) == g );
+    SM_ASSERT( large_footprint( object_base( g ) ) == big );
+    char* h = (char*) REALLOC( g, small - 1 - pagesize );
+    SM_ASSERT( h != g );
+    for( size_t i = 0; i < small - 1 - pagesize; i++ ) SM_ASSERT( h[i] == 'g' );
+    FREE( h );
+
+    // An object that was shrunk in place and freed comes back with its whole bin's footprint, cached or not.
+    bin   = size_2_bin( 256 * 1024 );
+    big   = bin_2_size( bin );
+    small = bin_2_size( bin - 1 ) + 1;
+    g     = (char*) MALLOC( small );
+    SM_ASSERT( REALLOC( g, small ) == g && large_footprint( object_base( g ) ) < big );
+    FREE( g );
+    g = (char*) MALLOC( small );
+    SM_ASSERT( large_footprint( object_base( g ) ) == big );
+    FREE( g );
+#endif
+}
+
+void
+test_free_sized( void )
+{
+    for( size_t size = 1; size < largest_small; size += 1 + size / 8 )
+    {
+        void* p = MALLOC( size );
+        FREE_SIZED( p, size );
+        p = CALLOC( 1, size );
+        FREE_SIZED( p, size );
+    }
+    // Large sizes fall back to FREE().
+    void* p = MALLOC( largest_small + 1 );
+    FREE_SIZED( p, largest_small + 1 );
+}
+#endif
+
+#ifdef TESTING
+void
+test_malloc_batch( void )
+{
+    enum
+    {
+        n = 500
+    };
+    static void* objs[n];
+
+    // A batch from a bin that has no free objects yet is carved out of one folio after the other.
+    const size_t size = 48;
+    SM_ASSERT( MALLOC_BATCH( size, n, objs ) == n );
+    for( size_t i = 0; i < n; i++ )
+    {
+        SM_ASSERT( MALLOC_USABLE_SIZE( objs[i] ) >= size );
+        memset( objs[i], (int) i, size );
+    }
+    for( size_t i = 0; i < n; i++ )
+        for( size_t j = 0; j < size; j++ ) SM_ASSERT( ( (unsigned char*) objs[i] )[j] == (unsigned char) i );
+    FREE_BATCH( objs, n );
+
+    // Mixed bins, large objects and NULLs in one batch.
+    for( size_t i = 0; i < n; i++ )
+    {
+        size_t s = ( i % 7 == 0 ) ? largest_small + i : 8 + i * 3;
+        objs[i]  = ( i % 11 == 0 ) ? NULL : MALLOC( s );
+    }
+    FREE_BATCH( objs, n );
+
+    // Large sizes go through MALLOC() one at a time.
+    SM_ASSERT( MALLOC_BATCH( largest_small + 1, 3, objs ) == 3 );
+    FREE_BATCH( objs, 3 );
+}
+#endif
+
+#ifdef TESTING
+void
+test_cold_bin_merging( void )
+{
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        binnumber_t target = cold_bin_merge_target( bin );
+        SM_ASSERT( target >= bin && target < first_large_bin_number );
+        SM_ASSERT( cold_bin_merge_target( target ) == target );
+        SM_ASSERT( bin_2_size( target ) < 2 * bin_2_size( bin ) );
+    }
+
+    const size_t      size   = 40;
+    const binnumber_t bin    = small_malloc_bin( size );
+    const binnumber_t target = cold_bin_merge_target( bin );
+    SM_ASSERT( target != bin );
+    SM_ASSERT( atomic_load( &cold_bin_bytecount[bin] ) == 0 );
+
+    sm_set_merge_cold_bins( 1 );
+    void* p = MALLOC( size );
+    SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size ) == target );
+    SM_ASSERT( REALLOC( p, size ) == p );
+    FREE_SIZED( p, size );
+
+    // Keep one merged object across the promotion.
+    void* merged = MALLOC( size );
+    while( atomic_load( &cold_bin_target[bin] ) != 0 ) FREE_SIZED( MALLOC( size ), size );
+    SM_ASSERT( atomic_load( &cold_bin_bytecount[bin] ) >= cold_bin_promotion_bytecount );
+    void* warm = MALLOC( size );
+    SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( warm )].bin_and_size ) == bin );
+    FREE_SIZED( merged, size );
+    FREE_SIZED( warm, size );
+
+    // Another bin is still cold.
+    SM_ASSERT( atomic_load( &cold_bin_target[small_malloc_bin( 24 )] ) == cold_bin_merge_target( small_malloc_bin( 24 ) ) );
+    sm_set_merge_cold_bins( 0 );
+    SM_ASSERT( atomic_load( &cold_bin_target[small_malloc_bin( 24 )] ) == 0 );
 }
 #endif
 
@@ -579,7 +863,7 @@ extern "C"
     const char* base = (const char*) object_base( (void*) ptr );
     SM_ASSERT( address_2_chunknumber( base ) == cn );
     const char* ptr_c     = (const char*) ptr;
-    size_t      base_size = bin_2_size( bin );
+    size_t      base_size = bin == page_run_bin_number ? page_run_size( base ) : bin_2_size( bin );
     SM_ASSERT( base <= (const char*) ptr );
     SM_ASSERT( base_size >= ptr_c - base );
     return base_size - ( ptr_c - base );
@@ -592,9 +876,17 @@ test_malloc_usable_size_internal( size_t given_s )
     char*       a    = (char*) MALLOC( given_s );
     size_t      as   = MALLOC_USABLE_SIZE( a );
     char*       base = (char*) object_base( a );
-    binnumber_t b    = size_2_bin( MALLOC_USABLE_SIZE( base ) );
-    SM_ASSERT( MALLOC_USABLE_SIZE( base ) == bin_2_size( b ) );
     SM_ASSERT( MALLOC_USABLE_SIZE( base ) + base == MALLOC_USABLE_SIZE( a ) + a );
+    if( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( a )].bin_and_size ) == page_run_bin_number )
+    {
+        // A run has just the pages it needs.
+        SM_ASSERT( MALLOC_USABLE_SIZE( base ) == pagesize * ceil64( given_s, pagesize ) );
+        SM_ASSERT( address_2_chunknumber( a ) == address_2_chunknumber( a + as - 1 ) );
+        FREE( a );
+        return;
+    }
+    binnumber_t b = size_2_bin( MALLOC_USABLE_SIZE( base ) );
+    SM_ASSERT( MALLOC_USABLE_SIZE( base ) == bin_2_size( b ) );
     if( b < first_huge_bin_number ) { SM_ASSERT( address_2_chunknumber( a ) == address_2_chunknumber( a + as - 1 ) ); }
     else { SM_ASSERT( offset_in_chunk( base ) == 0 ); }
     FREE( a );
@@ -618,6 +910,7 @@ object_base( void* ptr )
     bin_and_size_t b_and_s = chunk_infos[cn].bin_and_size;
     SM_ASSERT( b_and_s != 0 );
     binnumber_t bin = bin_from_bin_and_size( b_and_s );
+    if( bin == page_run_bin_number ) { return page_run_base( ptr ); }
     if( bin >= first_huge_bin_number ) { return address_2_chunkaddress( ptr ); }
     else
     {
@@ -742,12 +1035,14 @@ test_object_base()
 //
 // We maintain a table which is simply the object size for each chunk.
 // This is just a big array indexed by chunk number.  The chunk number
-// is gotten by taking the chunk address and shifting it right by 21
-// (sign extending) and adding an offset so that the index ranges from
-// 0 (inclusive) to 2^{27} (exclusive).  The table contains a bin
+// is gotten by taking the chunk address and shifting it right by
+// log_chunksize, 21 by default (sign extending) and adding an offset so
+// that the index ranges from 0 (inclusive) to 2^{27} (exclusive), or
+// 2^{log_max_chunknumber} in general.  The table contains a bin
 // number, except for huge objects where it contains the number of
 // chunks.  This allows the table to be kept with a single 32-bit
-// number, making the entire table 2^{29} bytes (512MiB).  Again we
+// number, making the entire table 2^{29} bytes (512MiB) with 2MiB
+// chunks, and twice that for every halving of the chunk size.  Again we
 // rely on the table no being all mapped into main memory, but it
 // might make good sense for this table to use transparent huge pages,
 // even at the beginning, since it probably means a single page table
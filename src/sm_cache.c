@@ -0,0 +1,499 @@
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+#include <string.h>
+
+#ifdef TESTING
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+#include "atomically.h"
+#include "generated_constants.hxx"
+#include "sm_assert.h"
+#include "sm_internal.h"
+#include "sm_rseq.h"
+
+// Two tiers of object caches sit in front of small_malloc()/small_free()
+// and large_malloc()/large_free().
+//
+// The thread cache (SM_THREAD_CACHE): for each small bin, each thread
+// keeps a stack of free objects threaded through the first word of the
+// objects themselves.  As long as the stack is neither empty (on
+// malloc) nor over its byte limit (on free), malloc and free touch only
+// thread-local memory: no locks, no dsbi, no folio bitmaps.
+//
+// The byte limit is per bin (thread_cache_bytecount_limit).  When a
+// free would push a bin over the limit, we pass about half of that
+// bin's stack on to the next tier, so that a thread that alternates
+// between malloc and free right at the limit doesn't pay for a trip to
+// the global structures on every call.  Bins whose objects are bigger
+// than the limit are never cached in the thread cache.
+//
+// When a thread exits its cache is passed on as well.  We use a pthread
+// key (or a fiber-local slot on Windows) only for its destructor; the
+// cache itself is a plain __thread variable so that the fast path is a
+// couple of loads and stores.
+//
+// The per-CPU cache (SM_CPU_CACHE, Linux only): for each CPU and each
+// small or large bin, an array-based stack of free objects.  Pushes and
+// pops are restartable sequences (see sm_rseq.h), so they need no
+// atomic instructions, and the amount of memory cached is bounded by
+// the number of CPUs rather than by the number of threads, which
+// matters for programs with many mostly-idle threads.  Each stack holds
+// at most per_cpu_cache_bytecount_limit bytes (and at most
+// cpu_cache_slots objects).  CPUs numbered cpulimit or higher, and
+// threads that can't use rseq, skip this tier.
+typedef struct cached_object
+{
+    struct cached_object* next;
+} cached_object;
+
+typedef struct thread_cache_bin
+{
+    cached_object* head;
+    uint32_t       bytecount;
+} thread_cache_bin;
+
+typedef struct thread_cache
+{
+    thread_cache_bin bins[first_large_bin_number];
+    bool             exit_hook_registered;
+} thread_cache;
+
+static SM_ATTRIBUTE_THREAD thread_cache tc;
+
+static inline void
+uncached_free( void* ptr, binnumber_t bin )
+{
+    if( bin < first_large_bin_number ) small_free_in_bin( ptr, bin );
+    else
+        large_free( ptr );
+}
+
+#if SM_CPU_CACHE
+enum
+{
+    cpu_cache_slots = 127    // so that a cpu_cache_bin is 1KiB
+};
+
+typedef struct cpu_cache_bin
+{
+    uint64_t top;
+    void*    slots[cpu_cache_slots];
+} cpu_cache_bin;
+
+typedef struct cpu_cache
+{
+    cpu_cache_bin bins[first_huge_bin_number];
+} cpu_cache;
+
+static cpu_cache* cpu_caches;    // cpulimit of them.  Pages are committed only for the CPUs that use them.
+static uint64_t   cpu_cache_capacity[first_huge_bin_number];
+
+static void
+init_cpu_cache( void )
+{
+    for( binnumber_t bin = 0; bin < first_huge_bin_number; bin++ )
+    {
+        uint64_t n               = per_cpu_cache_bytecount_limit / bin_2_size( bin );
+        cpu_cache_capacity[bin] = n == 0 ? 1 : n < cpu_cache_slots ? n : cpu_cache_slots;
+    }
+    cpu_caches = (cpu_cache*) mmap_size( cpulimit * sizeof( cpu_cache ) );
+}
+
+static void*
+cpu_cache_pop( binnumber_t bin )
+// Effect: Pop an object off the current CPU's stack for bin.  Return NULL if the stack is empty or the tier is unavailable.
+{
+    struct rseq* rs = sm_rseq_area();
+    if( rs == NULL || cpu_caches == NULL ) return NULL;
+    while( true )
+    {
+        uint32_t cpu = sm_rseq_cpu_start( rs );
+        if( cpu >= cpulimit ) return NULL;
+        cpu_cache_bin* ccb = &cpu_caches[cpu].bins[bin];
+        void*          result;
+        switch( sm_rseq_stack_pop( rs, cpu, &ccb->top, ccb->slots, &result ) )
+        {
+            case SM_RSEQ_OK: return result;
+            case SM_RSEQ_FULL_OR_EMPTY: return NULL;
+            case SM_RSEQ_ABORTED: break;    // preempted or migrated: try again on whatever CPU we are on now.
+        }
+    }
+}
+
+static bool
+cpu_cache_push( void* ptr, binnumber_t bin )
+// Effect: Push ptr onto the current CPU's stack for bin.  Return false if the stack is full or the tier is unavailable.
+{
+    struct rseq* rs = sm_rseq_area();
+    if( rs == NULL || cpu_caches == NULL ) return false;
+    while( true )
+    {
+        uint32_t cpu = sm_rseq_cpu_start( rs );
+        if( cpu >= cpulimit ) return false;
+        cpu_cache_bin* ccb = &cpu_caches[cpu].bins[bin];
+        switch( sm_rseq_stack_push( rs, cpu, &ccb->top, ccb->slots, cpu_cache_capacity[bin], ptr ) )
+        {
+            case SM_RSEQ_OK: return true;
+            case SM_RSEQ_FULL_OR_EMPTY: return false;
+            case SM_RSEQ_ABORTED: break;
+        }
+    }
+}
+#else
+static inline void*
+cpu_cache_pop( binnumber_t bin )
+{
+    (void) bin;
+    return NULL;
+}
+
+static inline bool
+cpu_cache_push( void* ptr, binnumber_t bin )
+{
+    (void) ptr;
+    (void) bin;
+    return false;
+}
+#endif
+
+#if SM_THREAD_CACHE
+static void
+thread_cache_release_bin( thread_cache_bin* tcb, binnumber_t bin, uint32_t keep_bytes )
+// Effect: Pass objects from the top of the stack on to the per-CPU cache (or free them) until at most keep_bytes remain.
+{
+    uint32_t o_size = (uint32_t) bin_2_size( bin );
+    while( tcb->bytecount > keep_bytes )
+    {
+        cached_object* h = tcb->head;
+        SM_ASSERT( h );
+        tcb->head = h->next;
+        tcb->bytecount -= o_size;
+        if( !cpu_cache_push( h, bin ) ) small_free_in_bin( h, bin );
+    }
+}
+
+static void
+thread_cache_flush( void )
+{
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        thread_cache_release_bin( &tc.bins[bin], bin, 0 );
+    }
+}
+
+#if defined( __linux__ )
+static pthread_key_t thread_cache_key;
+
+static void
+thread_cache_destructor( void* arg )
+{
+    (void) arg;
+    // If anything is freed after this point (e.g. by a later TLS
+    // destructor), the next push registers the hook again and pthreads
+    // calls us again.
+    tc.exit_hook_registered = false;
+    thread_cache_flush();
+}
+#elif defined( _WIN64 )
+static DWORD thread_cache_fls_index = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI
+thread_cache_destructor( PVOID arg )
+{
+    (void) arg;
+    tc.exit_hook_registered = false;
+    thread_cache_flush();
+}
+#endif
+
+static void
+thread_cache_register_exit_hook( void )
+{
+#if defined( __linux__ )
+    pthread_setspecific( thread_cache_key, &tc );
+#elif defined( _WIN64 )
+    if( thread_cache_fls_index != FLS_OUT_OF_INDEXES ) FlsSetValue( thread_cache_fls_index, &tc );
+#endif
+    tc.exit_hook_registered = true;
+}
+#endif
+
+void
+init_cached_malloc()
+{
+#if SM_THREAD_CACHE && defined( __linux__ )
+    pthread_key_create( &thread_cache_key, thread_cache_destructor );
+#elif SM_THREAD_CACHE && defined( _WIN64 )
+    thread_cache_fls_index = FlsAlloc( thread_cache_destructor );
+#endif
+#if SM_CPU_CACHE
+    init_cpu_cache();
+#endif
+}
+
+void
+cached_malloc_postfork_child( bool fresh_heap )
+{
+    if( !fresh_heap ) return;
+    // Whatever the caches hold belongs to the parent's chunks.  Forget it.
+    memset( &tc, 0, sizeof( tc ) );
+#if SM_CPU_CACHE && defined( __linux__ )
+    if( cpu_caches )
+    {
+        mmap( cpu_caches, cpulimit * sizeof( cpu_cache ), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 );
+    }
+#endif
+}
+
+void*
+cached_malloc( binnumber_t bin )
+{
+    SM_ASSERT( bin < first_huge_bin_number );
+
+#if SM_THREAD_CACHE
+    if( bin < first_large_bin_number )
+    {
+        thread_cache_bin* tcb = &tc.bins[bin];
+        cached_object*    h   = tcb->head;
+        if( h )
+        {
+            tcb->head = h->next;
+            tcb->bytecount -= (uint32_t) bin_2_size( bin );
+            return h;
+        }
+    }
+#endif
+    void* r = cpu_cache_pop( bin );
+    if( r )
+    {
+        if( bin >= first_large_bin_number ) large_reuse_cached( r, bin );
+        return r;
+    }
+    if( bin < first_large_bin_number ) return small_malloc( bin );
+    else { return large_malloc( bin_2_size( bin ) ); }
+}
+
+void
+cached_free( void* ptr, binnumber_t bin )
+{
+    // What I want:
+    //  If the threadcache is empty enough, add the object to the thread cache, and we are done.
+    //  If the cpucache is empty enough, add everything in one of the threadcaches to the cpucache (including ptr), and we are done.
+    //  Else if the global cache is empty enough, add everything from one of the cpucaches (including the ptr), and we are done.
+    //  Else really free the pointer.
+    // There is no global cache yet, and the thread cache spills into the cpu cache one object at a time.
+    SM_ASSERT( bin < first_huge_bin_number );
+
+#if SM_THREAD_CACHE
+    if( bin < first_large_bin_number )
+    {
+        uint32_t o_size = (uint32_t) bin_2_size( bin );
+        if( o_size <= thread_cache_bytecount_limit )
+        {
+            if( !tc.exit_hook_registered ) thread_cache_register_exit_hook();
+            thread_cache_bin* tcb = &tc.bins[bin];
+            if( tcb->bytecount + o_size > thread_cache_bytecount_limit )
+            {
+                thread_cache_release_bin( tcb, bin, thread_cache_bytecount_limit / 2 );
+            }
+            cached_object* co = (cached_object*) ptr;
+            co->next          = tcb->head;
+            tcb->head         = co;
+            tcb->bytecount += o_size;
+            return;
+        }
+    }
+#endif
+    if( cpu_cache_push( ptr, bin ) ) return;
+    uncached_free( ptr, bin );
+}
+
+size_t
+cached_malloc_batch( binnumber_t bin, void** out, size_t n )
+// Effect: Like n calls to cached_malloc( bin ) for a small bin: what this thread has cached comes first, and the rest comes
+//  from small_malloc_batch() in bulk.  Returns the number of objects allocated.
+{
+    SM_ASSERT( bin < first_large_bin_number );
+    size_t got = 0;
+#if SM_THREAD_CACHE
+    thread_cache_bin* tcb    = &tc.bins[bin];
+    uint32_t          o_size = (uint32_t) bin_2_size( bin );
+    while( got < n && tcb->head )
+    {
+        cached_object* h = tcb->head;
+        tcb->head        = h->next;
+        tcb->bytecount -= o_size;
+        out[got++] = h;
+    }
+#endif
+    return got + small_malloc_batch( bin, out + got, n - got );
+}
+
+bool
+cached_free_if_room( void* ptr, binnumber_t bin )
+// Effect: If this thread's cache for the small bin has room for ptr, put it there and return true.  Otherwise return false
+//  and leave ptr to the caller, which can free it together with others.
+{
+    SM_ASSERT( bin < first_large_bin_number );
+#if SM_THREAD_CACHE
+    uint32_t          o_size = (uint32_t) bin_2_size( bin );
+    thread_cache_bin* tcb    = &tc.bins[bin];
+    if( tcb->bytecount + o_size > thread_cache_bytecount_limit ) return false;
+    if( !tc.exit_hook_registered ) thread_cache_register_exit_hook();
+    cached_object* co = (cached_object*) ptr;
+    co->next          = tcb->head;
+    tcb->head         = co;
+    tcb->bytecount += o_size;
+    return true;
+#else
+    (void) ptr;
+    return false;
+#endif
+}
+
+#ifdef TESTING
+void
+test_cached_malloc( void )
+{
+#if SM_THREAD_CACHE
+    const binnumber_t bin    = 0;
+    const uint32_t    o_size = (uint32_t) bin_2_size( bin );
+    const uint32_t    n      = 3 * thread_cache_bytecount_limit / o_size;
+
+    thread_cache_flush();
+    void** objects = (void**) malloc( n * sizeof( void* ) );
+    SM_ASSERT( objects );
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        objects[i] = cached_malloc( bin );
+        SM_ASSERT( objects[i] );
+        for( uint32_t j = 0; j < i; j++ ) SM_ASSERT( objects[j] != objects[i] );
+    }
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        cached_free( objects[i], bin );
+        SM_ASSERT( tc.bins[bin].bytecount <= thread_cache_bytecount_limit );
+    }
+    SM_ASSERT( tc.bins[bin].bytecount > 0 );
+
+    // The cache is a stack, so the most recently freed object comes back first.
+    void* x = cached_malloc( bin );
+    SM_ASSERT( x == objects[n - 1] );
+    cached_free( x, bin );
+
+    // Bins too big for the thread cache bypass it.
+    binnumber_t big_bin = size_2_bin( thread_cache_bytecount_limit + 1 );
+    SM_ASSERT( big_bin < first_large_bin_number );
+    void* y = cached_malloc( big_bin );
+    cached_free( y, big_bin );
+    SM_ASSERT( tc.bins[big_bin].bytecount == 0 );
+
+    thread_cache_flush();
+    SM_ASSERT( tc.bins[bin].bytecount == 0 && tc.bins[bin].head == NULL );
+    free( objects );
+#endif
+}
+
+void
+test_cpu_cache( void )
+{
+#if SM_CPU_CACHE
+    struct rseq* rs = sm_rseq_area();
+    if( rs == NULL || cpu_caches == NULL )
+    {
+        printf( "rseq is not available, skipping the per-CPU cache test\n" );
+        return;
+    }
+    // The thread may migrate between any two steps below, in which case
+    // we are looking at a different CPU's stack.  Only check the results
+    // when we stayed put.
+    const binnumber_t bins[] = { 0, first_large_bin_number - 1, first_large_bin_number, first_huge_bin_number - 1 };
+    for( size_t i = 0; i < sizeof( bins ) / sizeof( bins[0] ); i++ )
+    {
+        binnumber_t bin = bins[i];
+        uint32_t    cpu = sm_rseq_cpu_start( rs );
+
+        void* held[cpu_cache_slots];
+        int   n_held = 0;
+        void* p;
+        while( ( p = cpu_cache_pop( bin ) ) != NULL ) uncached_free( p, bin );
+
+        // Fill the stack up to its capacity; the next push is refused.
+        while( true )
+        {
+            p = bin < first_large_bin_number ? small_malloc( bin ) : large_malloc( bin_2_size( bin ) );
+            if( n_held == cpu_cache_slots || !cpu_cache_push( p, bin ) )
+            {
+                uncached_free( p, bin );
+                break;
+            }
+            held[n_held++] = p;
+        }
+        if( sm_rseq_cpu_start( rs ) == cpu ) SM_ASSERT( (uint64_t) n_held == cpu_cache_capacity[bin] );
+
+        // And it is a stack.
+        for( int j = n_held - 1; j >= 0; j-- )
+        {
+            p = cpu_cache_pop( bin );
+            if( sm_rseq_cpu_start( rs ) == cpu ) SM_ASSERT( p == held[j] );
+            if( p ) uncached_free( p, bin );
+        }
+        if( sm_rseq_cpu_start( rs ) == cpu ) SM_ASSERT( cpu_cache_pop( bin ) == NULL );
+    }
+#endif
+}
+#endif
+
+#ifndef NOCPPRUNTIME
+
+enum
+{
+    n_cached_calls = 10000000
+};
+
+#ifdef __cplusplus
+extern "C"
+#endif
+    void
+    time_cached_malloc( void )
+{
+    // measure a malloc/free pair that hits the thread cache.
+    struct timespec start, end;
+
+    void* warm = cached_malloc( 0 );
+    cached_free( warm, 0 );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for( int i = 0; i < n_cached_calls; i++ )
+    {
+        void* p = cached_malloc( 0 );
+        cached_free( p, 0 );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+#ifdef TESTING
+    printf( "%fns/cached_malloc+cached_free\n", tdiff( &start, &end ) * 1e9 / n_cached_calls );
+#endif
+
+#if SM_CPU_CACHE
+    // and one that hits the per-CPU cache (large objects skip the thread cache).
+    const binnumber_t bin = first_large_bin_number;
+    warm                  = cached_malloc( bin );
+    cached_free( warm, bin );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for( int i = 0; i < n_cached_calls; i++ )
+    {
+        void* p = cached_malloc( bin );
+        cached_free( p, bin );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+#ifdef TESTING
+    printf( "%fns/cached_malloc+cached_free (per-CPU cache)\n", tdiff( &start, &end ) * 1e9 / n_cached_calls );
+#endif
+#endif
+}
+#endif    // !defined NOCPPRUNTIME
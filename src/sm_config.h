@@ -54,6 +54,7 @@
 
 #define SM_ATTRIBUTE_THREAD __declspec( thread )
 #define SM_ATTRIBUTE_UNROLL
+#define SM_ATTRIBUTE_TARGET( isa )
 
 // clang-format off
 #define SM_LOCK_INITIALIZER  {0}
@@ -61,10 +62,120 @@
 
 #elif defined( __GNUC__ )
 
-#define SM_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+// Fully braced for lock_t's anonymous union, so arrays of locks initialize without -Wmissing-braces.
+// clang-format off
+#define SM_LOCK_INITIALIZER { { PTHREAD_MUTEX_INITIALIZER } }
+// clang-format on
 
 #define SM_ALIGNED( num )   __attribute__( ( aligned( ( num ) ) ) )
 #define SM_ATTRIBUTE_THREAD __thread
 #define SM_ATTRIBUTE_UNROLL __attribute__( ( optimize( "unroll-loops" ) ) )
+#define SM_ATTRIBUTE_TARGET( isa ) __attribute__( ( target( isa ) ) )
+
+#endif
+
+// log2 of the chunk size, the unit the allocator gets from the OS and
+// carves into small folios and large objects: 20 (1 MiB) to 23 (8 MiB),
+// e.g. -DSM_LOG_CHUNKSIZE=20.  objsizes derives the bin tables from it,
+// so it must be given to objsizes too.  Smaller chunks hold less memory
+// per bin in use; larger ones map fewer chunks and keep more objects
+// out of huge_malloc().
+#ifndef SM_LOG_CHUNKSIZE
+#define SM_LOG_CHUNKSIZE 21
+#endif
+
+#if SM_LOG_CHUNKSIZE < 20 || SM_LOG_CHUNKSIZE > 23
+#error "SM_LOG_CHUNKSIZE must be between 20 (1 MiB) and 23 (8 MiB)."
+#endif
+
+// The object caches in front of small_malloc() and large_malloc() (see
+// sm_cache.c), and the lock-free stash in front of the small bins (see
+// small_malloc.c).  Each can be switched off on the command line,
+// e.g. -DSM_THREAD_CACHE=0.  The per-CPU tier needs restartable
+// sequences, so it exists only on Linux.
+#ifndef SM_THREAD_CACHE
+#define SM_THREAD_CACHE 1
+#endif
+
+#ifndef SM_CPU_CACHE
+#if defined( SM_PLATFORM_LINUX )
+#define SM_CPU_CACHE 1
+#else
+#define SM_CPU_CACHE 0
+#endif
+#endif
+
+#ifndef SM_SMALL_STASH
+#define SM_SMALL_STASH 1
+#endif
+
+// Thread-owned active folios for small_malloc() (see small_malloc.c).
+// Off by default, since each thread then holds a partly used folio of
+// every small bin it allocates from.
+#ifndef SM_ACTIVE_FOLIO
+#define SM_ACTIVE_FOLIO 0
+#endif
+
+// How many bytes of freed large objects stay committed for reuse before
+// the oldest of them are purged in a batch (see sm_large_malloc.c), until
+// sm_set_large_retained_bytes() says otherwise.  0 purges each large
+// object as it is freed.
+#ifndef SM_LARGE_RETAINED_BYTES
+#define SM_LARGE_RETAINED_BYTES ( 32ull << 20 )
+#endif
+
+// Allocate large objects as runs of whole pages (see sm_page_runs.c)
+// instead of from the large bins, so that each costs only the pages it
+// needs, and objects up to a chunk less its header pages stay out of
+// huge_malloc().  Off by default: allocating and freeing a run takes a
+// global lock and an madvise().
+#ifndef SM_LARGE_PAGE_RUNS
+#define SM_LARGE_PAGE_RUNS 0
+#endif
+
+// Search folio bitmaps 4 words at a time with AVX2 or SSE4.1 (see
+// small_malloc.c), whichever the CPU has.  -DSM_SIMD_BITMAP_SEARCH=0
+// leaves only the word-by-word loop.
+#ifndef SM_SIMD_BITMAP_SEARCH
+#define SM_SIMD_BITMAP_SEARCH 1
+#endif
 
-#endif
\ No newline at end of file
+// The number of shards the small bins are split into (see small_malloc.c),
+// each with its own locks, e.g. -DSM_SMALL_SHARDS=8 on hosts with many
+// cores.  A thread uses the shard of the CPU it runs on, or with
+// -DSM_SMALL_SHARD_BY_CPU=0 (and off Linux), one picked by hashing the
+// thread.  Each shard keeps its own partly used folios, so more shards
+// mean more memory.
+#ifndef SM_SMALL_SHARDS
+#define SM_SMALL_SHARDS 1
+#endif
+
+#ifndef SM_SMALL_SHARD_BY_CPU
+#if defined( SM_PLATFORM_LINUX )
+#define SM_SMALL_SHARD_BY_CPU 1
+#else
+#define SM_SMALL_SHARD_BY_CPU 0
+#endif
+#endif
+
+// The lock around the allocator's critical sections (see atomically.h),
+// e.g. -DSM_LOCK_BACKEND=SM_LOCK_MCS.
+#define SM_LOCK_MUTEX  0
+#define SM_LOCK_TTAS   1
+#define SM_LOCK_TICKET 2
+#define SM_LOCK_MCS    3
+
+#ifndef SM_LOCK_BACKEND
+#define SM_LOCK_BACKEND SM_LOCK_MUTEX
+#endif
+
+#if SM_LOCK_BACKEND != SM_LOCK_MUTEX
+#undef SM_LOCK_INITIALIZER
+// clang-format off
+#if SM_LOCK_BACKEND == SM_LOCK_TTAS
+#define SM_LOCK_INITIALIZER { { 0 } }
+#else
+#define SM_LOCK_INITIALIZER { { { 0 } } }
+#endif
+// clang-format on
+#endif
@@ -0,0 +1,168 @@
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef TESTING
+#include <stdio.h>
+#endif
+
+#include "atomically.h"
+#include "generated_constants.hxx"
+#include "sm_assert.h"
+#include "sm_internal.h"
+#include "supermalloc.h"
+
+// fork() copies the address space but only the calling thread, so any
+// lock that another thread held at the time of the fork stays locked
+// forever in the child.  We register pthread_atfork() handlers that take
+// every allocator lock before the fork, and release them afterwards in
+// the parent and reinitialize them in the child.  The lock-free parts
+// (the stash, the per-CPU caches, the CAS-pushed free lists) are always
+// consistent between individual atomic steps, so a snapshot of them
+// taken by fork() is usable as is.
+//
+// Prefork servers warm up their heap and then fork many workers.  If a
+// worker keeps allocating out of the parent's folios, its first
+// allocations write to dsbi, to the folio headers and to the data pages
+// around the objects it gets, and each write is a copy-on-write fault
+// on a page that was shared with the parent.  In SM_FORK_FRESH_HEAP
+// mode the child instead starts with empty metadata (dsbi, the stash,
+// the caches, the large free lists) and takes new chunks for what it
+// allocates.  Chunks are tagged with the generation that allocated them
+// (chunk_generations[]); frees of objects that live in an ancestor's
+// chunks are dropped, so the child never writes into them.  The huge
+// allocator doesn't depend on per-chunk metadata in that way and is
+// shared as is.
+
+uint8_t  heap_generation;
+uint8_t* chunk_generations;
+
+static _Atomic int fork_mode = SM_FORK_INHERIT_HEAP;
+
+enum
+{
+    n_chunk_generations = 1ull << log_max_chunknumber
+};
+
+void
+sm_set_fork_mode( sm_fork_mode mode )
+{
+    maybe_initialize_malloc();
+#if defined( __linux__ )
+    if( mode == SM_FORK_FRESH_HEAP && chunk_generations == NULL )
+    {
+        // Chunks allocated before this point are generation 0, which is also ours.
+        uint8_t* g = (uint8_t*) mmap_size( n_chunk_generations );
+        if( g == NULL ) return;
+        chunk_generations = g;
+    }
+    atomic_store( &fork_mode, mode );
+#else
+    (void) mode;
+#endif
+}
+
+#if defined( __linux__ )
+static void
+fork_prepare( void )
+{
+    purge_prefork();    // The purge thread takes the bin locks while it holds the purge lock.
+    huge_malloc_prefork();
+    page_run_prefork();
+    small_malloc_prefork();
+}
+
+static void
+fork_parent( void )
+{
+    small_malloc_postfork_parent();
+    page_run_postfork_parent();
+    huge_malloc_postfork_parent();
+    purge_postfork_parent();
+}
+
+static void
+fork_child( void )
+{
+    bool fresh_heap = atomic_load( &fork_mode ) == SM_FORK_FRESH_HEAP && chunk_generations != NULL;
+    if( fresh_heap )
+    {
+        // Generation 0 means "never forked with a fresh heap", so skip it when wrapping around.
+        if( ++heap_generation == 0 ) heap_generation = 1;
+    }
+    small_malloc_postfork_child( fresh_heap );
+    large_malloc_postfork_child( fresh_heap );
+    page_run_postfork_child( fresh_heap );
+    huge_malloc_postfork_child( fresh_heap );
+    cached_malloc_postfork_child( fresh_heap );
+    purge_postfork_child( fresh_heap );
+}
+#endif
+
+void
+init_fork_handling()
+{
+#if defined( __linux__ )
+    pthread_atfork( fork_prepare, fork_parent, fork_child );
+#endif
+}
+
+#ifdef TESTING
+void
+test_fork( void )
+{
+#if defined( __linux__ )
+    const binnumber_t small_bin = size_2_bin( 100 );
+    const binnumber_t large_bin = first_large_bin_number;
+    void*             s         = small_malloc( small_bin );
+    void*             l         = large_malloc( bin_2_size( large_bin ) );
+
+    // An ordinary fork: the child keeps using the parent's heap.
+    pid_t pid = fork();
+    SM_ASSERT( pid >= 0 );
+    if( pid == 0 )
+    {
+        SM_ASSERT( heap_generation == 0 );
+        small_free( s );
+        large_free( l );
+        void* x = small_malloc( small_bin );
+        small_free( x );
+        _exit( 0 );
+    }
+    int status;
+    SM_ASSERT( waitpid( pid, &status, 0 ) == pid );
+    SM_ASSERT( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+
+    // A fresh-heap fork: new objects come from new chunks, and freeing the parent's objects leaves the parent's chunks alone.
+    sm_set_fork_mode( SM_FORK_FRESH_HEAP );
+    uint64_t s_word = *(uint64_t*) s;
+    pid             = fork();
+    SM_ASSERT( pid >= 0 );
+    if( pid == 0 )
+    {
+        SM_ASSERT( heap_generation == 1 );
+        SM_ASSERT( chunk_belongs_to_parent( address_2_chunknumber( s ) ) );
+        SM_ASSERT( chunk_belongs_to_parent( address_2_chunknumber( l ) ) );
+        void* x = small_malloc( small_bin );
+        void* y = large_malloc( bin_2_size( large_bin ) );
+        SM_ASSERT( !chunk_belongs_to_parent( address_2_chunknumber( x ) ) );
+        SM_ASSERT( !chunk_belongs_to_parent( address_2_chunknumber( y ) ) );
+        small_free( s );
+        large_free( l );
+        SM_ASSERT( *(uint64_t*) s == s_word );    // in particular, s didn't go onto the stash.
+        small_free( x );
+        large_free( y );
+        SM_ASSERT( small_malloc( small_bin ) != s );
+        _exit( 0 );
+    }
+    SM_ASSERT( waitpid( pid, &status, 0 ) == pid );
+    SM_ASSERT( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+    sm_set_fork_mode( SM_FORK_INHERIT_HEAP );
+
+    small_free( s );
+    large_free( l );
+#endif
+}
+#endif
@@ -15,7 +15,7 @@
 static lock_t huge_lock = SM_LOCK_INITIALIZER;
 
 // free_chunks[0] is a list of 1-chunk objects (which are, by definition chunk-aligned)
-// free_chunks[1] is a list of 2-chunk objects which are also 2-chunk aligned (that is 4MiB-aligned).
+// free_chunks[1] is a list of 2-chunk objects which are also 2-chunk aligned (that is 4MiB-aligned with 2MiB chunks).
 // free_chunks[2] is a list of 4-chunk objects that are 4-chunk aligned.
 // terminated by 0.
 chunknumber_t free_chunks[log_max_chunknumber];
@@ -118,6 +118,26 @@ init_huge_malloc()
     initialize_lock_array( &huge_lock, 1 );
 }
 
+void
+huge_malloc_prefork()
+{
+    sm_lock_for_fork( &huge_lock );
+}
+
+void
+huge_malloc_postfork_parent()
+{
+    sm_unlock( &huge_lock );
+}
+
+void
+huge_malloc_postfork_child( bool fresh_heap )
+{
+    // The free chunk lists are kept even in a fresh heap: the chunks on them are madvised and hold nothing of the parent's.
+    (void) fresh_heap;
+    initialize_lock_array( &huge_lock, 1 );
+}
+
 void*
 huge_malloc( size_t size )
 {
@@ -234,14 +254,14 @@ test_huge_malloc( void )
 
     {
         chunknumber_t m1_n = address_2_chunknumber( (void*) ( -1ull ) );
-        if( print ) printf( "-1 ==> 0x%x (1<<27)-1=%llx\n", m1_n, ( 1ull << 26 ) - 1 );
-        SM_ASSERT( m1_n == ( 1ull << 27 ) - 1 );
+        if( print ) printf( "-1 ==> 0x%x (1<<%d)-1=%llx\n", m1_n, log_max_chunknumber, ( 1ull << log_max_chunknumber ) - 1 );
+        SM_ASSERT( m1_n == ( 1ull << log_max_chunknumber ) - 1 );
         if( print ) printf( "-1 ==> 0x%x\n", m1_n );
     }
 
     {
         chunknumber_t zero_n = address_2_chunknumber( (void*) ( 0 ) );
-        if( print ) printf( "0 ==> 0x%x (1<<27)-1=%llx\n", zero_n, ( 1ull << 26 ) - 1 );
+        if( print ) printf( "0 ==> 0x%x (1<<%d)-1=%llx\n", zero_n, log_max_chunknumber, ( 1ull << log_max_chunknumber ) - 1 );
         SM_ASSERT( zero_n == 0 );
         if( print ) printf( "-1 ==> 0x%x\n", zero_n );
     }
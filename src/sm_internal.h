@@ -37,8 +37,10 @@ log_debug( FILE* f, const char* format, ... )
 enum
 {
     pagesize            = 4096,
-    log_chunksize       = 21,
+    log_chunksize       = SM_LOG_CHUNKSIZE,
     chunksize           = 1ull << log_chunksize,
+    log_address_space   = 48,
+    log_max_chunknumber = log_address_space - log_chunksize,
     cacheline_size      = 64,
     cachelines_per_page = pagesize / cacheline_size
 };
@@ -51,6 +53,7 @@ typedef uint32_t chunknumber_t;
 typedef uint32_t bin_and_size_t;    // we encode the bin number as 7 bits low-order bits.  The size is encoded as
     //                                1 bit means the size is in 4K pages (0) or the size is in 2M pages (1)
     //                                24 bits is the size (in 4K or 2M pages )
+    //                                Small chunks have no size, and those 24 bits hold the chunk's shard (see small_malloc.c).
 typedef uint32_t binnumber_t;
 typedef uint16_t objects_per_folio_t;
 typedef uint16_t folios_per_chunk_t;
@@ -102,10 +105,10 @@ address_2_chunknumber( const void* a )
 {
     // TODO: static assert on pointer size
 
-    // Given an address anywhere in a chunk, convert it to a chunk number from 0 to 1<<27
+    // Given an address anywhere in a chunk, convert it to a chunk number from 0 to 1<<log_max_chunknumber
     uint64_t au     = (uint64_t) a;
     uint64_t am     = au / chunksize;
-    uint64_t result = am % ( 1ull << 27 );
+    uint64_t result = am % ( 1ull << log_max_chunknumber );
     return (chunknumber_t) result;
 }
 
@@ -144,9 +147,9 @@ void* object_base( void* ptr );
 // Requires: the pointer must be on the same  chunk as the beginning of the object.
 
 // We keep a table of all the chunks for record keeping.
-// Since the chunks are 2MB (21 bits) and the current address space of x86_64 processors is only 48 bits (256 TiB) \cite[p.120]{AMD12b}
-// that means there can be at most 2^{27} chunks (that's 128 million chunks.)   We simply allocate a direct-mapped table for them all.
-// We take the chunk's beginning address P, shift it as P>>21 in a sign-extended fashion.  Then add 2^26 and we have a table.
+// Since the chunks are 2MB (21 bits, see SM_LOG_CHUNKSIZE) and the current address space of x86_64 processors is only 48 bits (256 TiB) \cite[p.120]{AMD12b}
+// that means there can be at most 2^{27} chunks (that's 128 million chunks; 2^{log_max_chunknumber} in general.)   We simply allocate a direct-mapped table for them all.
+// We take the chunk's beginning address P, shift it as P>>log_chunksize in a sign-extended fashion.  Then add 2^(log_max_chunknumber-1) and we have a table.
 // Most of this table won't end up mapped.
 
 typedef struct chunk_info
@@ -156,7 +159,7 @@ typedef struct chunk_info
         bin_and_size_t bin_and_size;
         chunknumber_t  next;    // Forms a linked list.
     };
-} chunk_info;    // I want this to be an array of length [1u<<27], but that causes link-time errors.  Instead initialize_malloc() mmaps something big enough.
+} chunk_info;    // I want this to be an array of length [1u<<log_max_chunknumber], but that causes link-time errors.  Instead initialize_malloc() mmaps something big enough.
 
 // Functions that are separated into various files.
 void  init_huge_malloc();
@@ -165,8 +168,7 @@ void  huge_free( void* ptr );
 
 enum
 {
-    log_max_chunknumber = 27,
-    null_chunknumber    = 0
+    null_chunknumber = 0
 };
 
 // We allocate chunks using only powers of two.  We don't bother with
@@ -178,6 +180,7 @@ enum
 
 extern chunknumber_t free_chunks[log_max_chunknumber];
 
+void* mmap_size( size_t size );
 void* mmap_chunk_aligned_block( size_t n_chunks );
 
 #if defined( __linux__ )
@@ -256,29 +259,95 @@ commit_ci_page_as_needed( chunknumber_t chunknum )
 
 #endif
 
-void  init_large_malloc();
-void* large_malloc( size_t size );
-void  large_free( void* ptr );
+void   init_large_malloc();
+void*  large_malloc( size_t size );
+void   large_free( void* ptr );
+bool   large_realloc_in_place( void* p, size_t size );
+void   large_reuse_cached( void* p, binnumber_t bin );
+size_t large_footprint( void* p );
+
+// The page-run engine for large objects (see sm_page_runs.c).  Its chunks carry page_run_bin_number, which no size maps
+// to, and start with page_run_header_pages pages of bitmaps and a 16-byte entry per page.
+enum
+{
+    page_run_pages_per_chunk = chunksize / pagesize,
+    page_run_header_pages    = ( page_run_pages_per_chunk / 4 + page_run_pages_per_chunk * 16 + pagesize - 1 ) / pagesize,
+    page_run_largest         = ( page_run_pages_per_chunk - page_run_header_pages ) * pagesize,
+    page_run_bin_number      = 126
+};
+
+void*  page_run_malloc( size_t size );
+void   page_run_free( void* p );
+void*  page_run_base( const void* p );
+size_t page_run_size( const void* run );
 
 //void    add_to_footprint( int64_t delta );
 //int64_t get_footprint();
 
-void  init_small_malloc();
-void* small_malloc( binnumber_t bin );
-void  small_free( void* ptr );
+void   init_small_malloc();
+void*  small_malloc( binnumber_t bin );
+size_t small_malloc_batch( binnumber_t bin, void** out, size_t n );
+void   small_free( void* ptr );
+void   small_free_in_bin( void* ptr, binnumber_t bin );
+void   small_free_batch( binnumber_t bin, void* list, uint64_t n );
+
+void   init_cached_malloc();
+void*  cached_malloc( binnumber_t bin );
+size_t cached_malloc_batch( binnumber_t bin, void** out, size_t n );
+void   cached_free( void* ptr, binnumber_t bin );
+bool   cached_free_if_room( void* ptr, binnumber_t bin );
+
+void maybe_initialize_malloc( void );
+
+// Fork handling (see sm_fork.c).  Each part of the allocator takes its
+// locks before fork() and releases (or, in the child, reinitializes)
+// them afterwards.  In a child forked in SM_FORK_FRESH_HEAP mode the
+// postfork_child hooks also drop everything that would lead the child
+// to write into the parent's chunks.
+void init_fork_handling();
+void huge_malloc_prefork();
+void huge_malloc_postfork_parent();
+void huge_malloc_postfork_child( bool fresh_heap );
+void large_malloc_postfork_child( bool fresh_heap );
+void page_run_prefork( void );
+void page_run_postfork_parent( void );
+void page_run_postfork_child( bool fresh_heap );
+void small_malloc_prefork();
+void small_malloc_postfork_parent();
+void small_malloc_postfork_child( bool fresh_heap );
+void cached_malloc_postfork_child( bool fresh_heap );
+
+// Which fresh-heap fork generation allocated each small and large
+// chunk.  heap_generation is 0 until this process is a fresh-heap
+// child, and chunk_generations is mapped the first time fresh-heap
+// mode is turned on.
+extern uint8_t  heap_generation;
+extern uint8_t* chunk_generations;
 
-//void  init_cached_malloc();
-//void* cached_malloc( binnumber_t bin );
-//void  cached_free( void* ptr, binnumber_t bin );
+static inline void
+set_chunk_generation( chunknumber_t cn )
+{
+    if( chunk_generations ) chunk_generations[cn] = heap_generation;
+}
 
-// enum
-// {
-//     cpulimit                      = 64, // no numa
-//     global_cache_depth            = 8,
-//     per_cpu_cache_bytecount_limit = 1024 * 1024,
-//     thread_cache_bytecount_limit  = 2 * 4096
+static inline bool
+chunk_belongs_to_parent( chunknumber_t cn )
+// Effect: Return true if we are a fresh-heap child and chunk cn was allocated by an ancestor process.  Objects freed into such a
+//  chunk are dropped, so that its metadata and data pages stay shared with the parent.
+{
+    return heap_generation != 0 && chunk_generations[cn] != heap_generation;
+}
 
-// };
+enum
+{
+    cpulimit                      = 64,    // no numa
+    global_cache_depth            = 8,
+    per_cpu_cache_bytecount_limit = 1024 * 1024,    // per bin
+    per_cpu_large_bytecount_limit = 1024 * 1024,    // per large bin, of retained objects
+    thread_cache_bytecount_limit  = 2 * 4096,    // per bin
+    small_stash_bytecount_limit   = 64 * 1024,    // per bin
+    cold_bin_promotion_bytecount  = 256 * 1024    // bytes malloc()ed from a merged cold bin before it gets its own chunks
+};
 
 #ifdef TESTING
 #define IS_TESTING 1
@@ -297,21 +366,79 @@ typedef struct large_object_list_cell
 
 enum
 {
-    max_objects_per_folio = 2048,
-    folio_bitmap_n_words  = max_objects_per_folio / 64
+    max_objects_per_folio = 2048
 };
 
+// The header of a folio of small objects.  The headers are packed at the start of their chunk, each one the bin's
+// folio_header_size bytes long (see objsizes.c), which leaves room for a bitmap of just objects_per_folio bits.
 typedef struct per_folio
 {
     SM_ALIGNED( 64 ) struct per_folio* next;
     struct per_folio*   prev;
-    _Atomic( uint64_t ) inuse_bitmap
-        [folio_bitmap_n_words];    // up to 512 objects (8 bytes per object) per page.  The bit is set if the object is in use.
+    // Bits of inuse_bitmap (below) are set only under the bin lock, but cleared with a fetch-and by whoever frees the object,
+    // so the bitmap can have more free slots than the dsbi list the folio is on.  free_count is that list's slot (the free
+    // slots as of the last time a lock holder looked), and a free that clears a bit marks the folio dirty so that the next lock
+    // holder moves it.
+    uint16_t free_count;
+    // Set while the folio is on the madvised list because it was purged (rather than never used), so that taking it off
+    // counts as a refault (see sm_get_purge_stats()).
+    bool purged;
+    // The number of objects in use is alloc_count minus the high half of free_state (mod 2^32), so nobody has to popcount the
+    // bitmap.  alloc_count is written only under the bin lock, before the bits are set, so malloc needs no extra
+    // read-modify-write.  Each free adds 1<<32 to free_state after it clears the bit (a carry out of the top is harmless);
+    // the low half is the high half as of the last sync, and the folio is dirty (on its bin's dirty stack) whenever the
+    // halves differ.
+    _Atomic( uint32_t ) alloc_count;
+    _Atomic( uint64_t ) free_state;
+    struct per_folio*   dirty_next;
+#if SM_ACTIVE_FOLIO
+    // Objects freed into some other thread's active folio, linked through their first words.  Its owner drains them in a batch.
+    // When the folio isn't anyone's active folio this is folio_remote_frees_closed, and frees go to the bitmap as usual.
+    _Atomic( void* ) remote_frees;
+#endif
+    // One bit per object, set if the object is in use.
+    _Atomic( uint64_t ) inuse_bitmap[];
 } per_folio;
 
+// Purging (see sm_purge.c).  When purge_deferred() is true, frees hand
+// empty folios and free large objects to the purge queues instead of
+// madvising them themselves, and the purge thread calls
+// small_purge_folio() and large_purge_object() on them.
+bool purge_deferred( void );
+void purge_enqueue_folios( per_folio* head, per_folio* tail );
+void purge_enqueue_large_object( large_object_list_cell* e );
+void small_purge_folio( per_folio* pp );
+void large_purge_object( large_object_list_cell* e );
+// With decay (purge_decay_enabled()), frees retain empty folios and free
+// large objects instead, call purge_retained(), and the decay passes call
+// small_decay_folios() and large_decay_objects().
+bool purge_decay_enabled( void );
+void purge_retained( void );
+void small_decay_folios( uint32_t keep_q16 );
+void large_decay_objects( uint32_t keep_q16 );
+// Freed large objects are also retained while purge_retain_large() says
+// so, up to a budget of bytes: once large_retained_bytes() goes over it,
+// large_trim_retained() purges the oldest of them.  large_retained_over()
+// is the cheap, approximate check that a free makes.
+bool     purge_retain_large( void );
+uint64_t large_retained_bytes( void );
+bool     large_retained_over( uint64_t budget );
+void     large_trim_retained( uint64_t budget );
+
+void purge_count_purged( uint64_t pages );
+void purge_count_refaulted( uint64_t pages );
+void purge_count_saved( uint64_t pages );
+void purge_prefork( void );
+void purge_postfork_parent( void );
+void purge_postfork_child( bool fresh_heap );
+
 #ifdef TESTING
 #include "unit-tests.h"
 
+void small_test_purge( void );    // called by test_purge()
+void small_test_purge_decay( void );
+void purge_wait_until_idle( void );
+
 static inline double
 tdiff( struct timespec* start, struct timespec* end )
 {
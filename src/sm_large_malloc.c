@@ -5,6 +5,7 @@
 #ifdef __linux__
 #include <sys/mman.h>
 #endif
+#include <string.h>
 
 #include "atomically.h"
 #include "generated_constants.hxx"
@@ -30,8 +31,13 @@ static SM_ATTRIBUTE_THREAD processor_id prid;
 
 static inline void
 check_cpuid( void )
+// Effect: Refresh prid.cpuid now and then.  It indexes per-CPU arrays, so if sched_getcpu() fails we use slot 0.
 {
-    if( prid.count++ % prid_cache_time == 0 ) { prid.cpuid = sched_getcpu() % processor_number_limit; }
+    if( prid.count++ % prid_cache_time == 0 )
+    {
+        int cpu    = sched_getcpu();
+        prid.cpuid = cpu < 0 ? 0 : cpu % processor_number_limit;
+    }
 }
 
 static void
@@ -59,31 +65,216 @@ enum
     n_large_classes = first_huge_bin_number - first_large_bin_number
 };
 
-static large_object_list_cell* free_large_objects
+// A stack of free objects of one large size, threaded through their large_object_list_cells in the chunk headers.  Nobody
+// takes a lock to push or pop, so the top carries a version in its high bits (user space addresses fit in
+// large_stack_version_shift bits), which every push and pop increments.  A pop that read the top and then its next field,
+// while other threads popped that object and pushed it back, fails its compare-and-swap instead of installing a stale next.
+// The cells stay mapped, so reading a stale next is harmless.
+typedef struct large_stack
+{
+    _Atomic uint64_t versioned_top;
+} large_stack;
+
+enum
+{
+    large_stack_version_shift = 48
+};
+
+static large_stack free_large_objects
     [n_large_classes];    // For each large size, a list (threaded through the chunk headers) of all the free objects of that size.
 // Later we'll be a little careful about purging those large objects (and we'll need to remember which are which, but we may also want thread-specific parts).  For now, just purge them all.
 
-static lock_t large_lock = SM_LOCK_INITIALIZER;
+// With decay or a retained-bytes budget (see sm_purge.c), a freed object is retained instead: it stays committed on a
+// retained stack of its size, newest first, which large_malloc() tries before the free list, until a decay pass or a trim
+// down to the budget purges it and moves it to the free list.  Each CPU has a retained stack for each size, holding up to
+// per_cpu_large_bytecount_limit bytes, so that threads on different CPUs don't fight over the same top; the rest goes onto
+// the global retained stack of the size.  Each stack has a count that is at least its length (it goes up before a push and
+// down after a pop).  A CPU's bit in cpus_retaining[c] gets set when it retains an object of class c, and only the decay
+// passes clear it, so large_retained_pop() looks for objects to steal only on the CPUs that may have some.
+// The retained bytes are counted per CPU as well, like partitioned_footprint, and a CPU adds its count to
+// folded_retained_bytes only once it reaches large_retained_bytes_batch either way (and the decay passes fold them all).  So
+// frees and mallocs of large objects on different CPUs don't write the same cache lines.
+// n_purged is how many purged objects are on the free list.  Since the free list is a stack, and a new chunk's objects are
+// put on it only when it is empty, those are the first n_purged objects on it.
+enum
+{
+    // Small enough batches would fold on every malloc and free of the biggest objects.
+    large_retained_bytes_batch = per_cpu_large_bytecount_limit
+};
 
-large_object_list_cell*
-do_large_malloc_pop( large_object_list_cell** free_head )
+typedef struct large_global_stack
 {
-    large_object_list_cell* h = *free_head;
-    SM_LOG_DEBUG( " dlmp: h=%p\n", h );
-    if( h == NULL ) { return NULL; }
-    else
+    SM_ALIGNED( 64 ) large_stack stack;
+    _Atomic uint32_t n_retained;
+} large_global_stack;
+
+static large_global_stack retained_large_objects[n_large_classes];
+static _Atomic uint64_t   cpus_retaining[n_large_classes];
+static _Atomic int64_t    folded_retained_bytes;
+static struct
+{
+    SM_ALIGNED( 64 ) uint32_t decay_carry;    // The fraction of an object the decay passes owe, as in do_small_decay_folios().
+    _Atomic uint32_t n_purged;
+} large_decay[n_large_classes];
+
+typedef struct large_cpu_stacks
+{
+    SM_ALIGNED( 64 ) large_stack retained[n_large_classes];
+    _Atomic uint32_t n_retained[n_large_classes];    // At least the length of each stack.
+    _Atomic int64_t  retained_bytes;                 // Retained here (or taken, if negative), and not yet folded.
+} large_cpu_stacks;
+
+static large_cpu_stacks cpu_retained_large_objects[processor_number_limit];
+static uint32_t         cpu_retained_capacity[n_large_classes];
+
+static inline large_object_list_cell*
+large_stack_cell( uint64_t versioned_top )
+{
+    return (large_object_list_cell*) ( versioned_top & ( ( 1ull << large_stack_version_shift ) - 1 ) );
+}
+
+static inline uint64_t
+large_stack_next_top( uint64_t versioned_top, large_object_list_cell* top )
+// Effect: Return what replaces versioned_top on the stack to make top the top.
+{
+    return ( ( ( versioned_top >> large_stack_version_shift ) + 1 ) << large_stack_version_shift ) | (uint64_t) top;
+}
+
+static void
+large_stack_push_chain( large_stack* s, large_object_list_cell* first, large_object_list_cell* last )
+// Effect: Push the objects from first to last (linked through their next fields) onto s.
+{
+    uint64_t old = atomic_load_explicit( &s->versioned_top, memory_order_relaxed );
+    do
     {
-        *free_head = h->next;
-        return h;
+        last->next = large_stack_cell( old );
+    } while( !atomic_compare_exchange_weak_explicit( &s->versioned_top, &old, large_stack_next_top( old, first ),
+                                                     memory_order_release, memory_order_relaxed ) );
+}
+
+static large_object_list_cell*
+large_stack_pop( large_stack* s )
+// Effect: Take the top object off s, or return NULL if it is empty.
+{
+    uint64_t old = atomic_load_explicit( &s->versioned_top, memory_order_acquire );
+    while( true )
+    {
+        large_object_list_cell* top = large_stack_cell( old );
+        if( top == NULL ) return NULL;
+        if( atomic_compare_exchange_weak_explicit( &s->versioned_top, &old, large_stack_next_top( old, top->next ),
+                                                   memory_order_acquire, memory_order_acquire ) )
+            return top;
     }
 }
 
-SM_DECLARE_ATOMIC_OPERATION( large_malloc_pop, do_large_malloc_pop, large_object_list_cell*, large_object_list_cell** );
+static large_object_list_cell*
+large_stack_take_all( large_stack* s )
+// Effect: Empty s, and return what was on it, linked through the next fields.
+{
+    uint64_t old = atomic_load_explicit( &s->versioned_top, memory_order_acquire );
+    while( large_stack_cell( old ) != NULL
+           && !atomic_compare_exchange_weak_explicit( &s->versioned_top, &old, large_stack_next_top( old, NULL ),
+                                                      memory_order_acquire, memory_order_acquire ) )
+    {
+    }
+    return large_stack_cell( old );
+}
 
 void
 init_large_malloc()
 {
-    initialize_lock_array( &large_lock, 1 );
+    for( uint32_t c = 0; c < n_large_classes; c++ )
+    {
+        uint64_t n               = per_cpu_large_bytecount_limit / bin_2_size( first_large_bin_number + c );
+        cpu_retained_capacity[c] = n == 0 ? 1 : (uint32_t) n;
+    }
+}
+
+void
+large_malloc_postfork_child( bool fresh_heap )
+{
+    if( fresh_heap )
+    {
+        memset( free_large_objects, 0, sizeof( free_large_objects ) );
+        memset( retained_large_objects, 0, sizeof( retained_large_objects ) );
+        memset( cpu_retained_large_objects, 0, sizeof( cpu_retained_large_objects ) );
+        memset( cpus_retaining, 0, sizeof( cpus_retaining ) );
+        memset( large_decay, 0, sizeof( large_decay ) );
+        atomic_store( &folded_retained_bytes, 0 );
+    }
+}
+
+static void
+large_count_retained_bytes( large_cpu_stacks* cs, int64_t delta )
+// Effect: Add delta to the retained bytes counted on cs's CPU, and fold them into folded_retained_bytes once they reach
+//  large_retained_bytes_batch either way.
+{
+    int64_t n = atomic_fetch_add_explicit( &cs->retained_bytes, delta, memory_order_relaxed ) + delta;
+    if( n < large_retained_bytes_batch && n > -large_retained_bytes_batch ) return;
+    // Another thread on this CPU may fold the same bytes, but each moves what it subtracts, so the sum stays right.
+    atomic_fetch_sub_explicit( &cs->retained_bytes, n, memory_order_relaxed );
+    atomic_fetch_add_explicit( &folded_retained_bytes, n, memory_order_relaxed );
+}
+
+static void
+large_retained_push( uint32_t c, large_object_list_cell* e )
+// Effect: Push the freed object e of class c onto this CPU's retained stack, or onto the global one if this CPU's is full.
+{
+    check_cpuid();
+    large_cpu_stacks* cs = &cpu_retained_large_objects[prid.cpuid];
+    large_count_retained_bytes( cs, (int64_t) bin_2_size( first_large_bin_number + c ) );
+    if( atomic_load_explicit( &cs->n_retained[c], memory_order_relaxed ) < cpu_retained_capacity[c] )
+    {
+        uint64_t me = 1ull << prid.cpuid;
+        if( !( atomic_load_explicit( &cpus_retaining[c], memory_order_relaxed ) & me ) )
+            atomic_fetch_or_explicit( &cpus_retaining[c], me, memory_order_relaxed );
+        atomic_fetch_add_explicit( &cs->n_retained[c], 1, memory_order_relaxed );
+        large_stack_push_chain( &cs->retained[c], e, e );
+    }
+    else
+    {
+        atomic_fetch_add_explicit( &retained_large_objects[c].n_retained, 1, memory_order_relaxed );
+        large_stack_push_chain( &retained_large_objects[c].stack, e, e );
+    }
+}
+
+static large_object_list_cell*
+large_retained_pop_from( large_stack* s, _Atomic uint32_t* n_on_s )
+// Effect: Take the top object off the retained stack s, whose length n_on_s counts, or return NULL if it is empty.
+{
+    if( atomic_load_explicit( n_on_s, memory_order_relaxed ) == 0 ) return NULL;
+    large_object_list_cell* h = large_stack_pop( s );
+    if( h != NULL ) atomic_fetch_sub_explicit( n_on_s, 1, memory_order_relaxed );
+    return h;
+}
+
+static large_object_list_cell*
+large_retained_pop( uint32_t c )
+// Effect: Take a retained object of class c: this CPU's newest one, or else one from the global stack, or else one from
+//  another CPU's stack.  Return NULL if there is none.
+{
+    check_cpuid();
+    large_cpu_stacks*       cs = &cpu_retained_large_objects[prid.cpuid];
+    large_object_list_cell* h  = large_retained_pop_from( &cs->retained[c], &cs->n_retained[c] );
+    if( h == NULL ) h = large_retained_pop_from( &retained_large_objects[c].stack, &retained_large_objects[c].n_retained );
+    uint64_t others = atomic_load_explicit( &cpus_retaining[c], memory_order_relaxed ) & ~( 1ull << prid.cpuid );
+    for( ; h == NULL && others != 0; others &= others - 1 )
+    {
+        large_cpu_stacks* other = &cpu_retained_large_objects[SM_BUILTIN_CTZ64( others )];
+        h                       = large_retained_pop_from( &other->retained[c], &other->n_retained[c] );
+    }
+    if( h != NULL ) large_count_retained_bytes( cs, -(int64_t) bin_2_size( first_large_bin_number + c ) );
+    return h;
+}
+
+static bool
+large_took_purged( binnumber_t bin )
+// Effect: An object was just taken off bin's free list.  Return whether it was a purged one.
+{
+    _Atomic uint32_t* n_purged = &large_decay[bin - first_large_bin_number].n_purged;
+    uint32_t          n        = atomic_load_explicit( n_purged, memory_order_relaxed );
+    while( n != 0 && !atomic_compare_exchange_weak( n_purged, &n, n - 1 ) ) {}
+    return n != 0;
 }
 
 void*
@@ -102,33 +293,22 @@ large_malloc( size_t size )
     SM_ASSERT( b >= first_large_bin_number );
     SM_ASSERT( b < first_huge_bin_number );
 
-    large_object_list_cell** free_head = &free_large_objects[b - first_large_bin_number];
+    uint32_t c = b - first_large_bin_number;
 
     while( 1 )
     {    // Keep going until we find a free object and return it.
 
-        // This needs to be done atomically (along the successful branch).
-        // It cannot be done with a compare-and-swap since we read two locations that
-        // are visible to other threads (getting h, and getting h->next).
-        large_object_list_cell* h = *free_head;
+        // A retained object is still committed, so try those first.
+        large_object_list_cell* h = large_retained_pop( c );
+        if( h != NULL ) { purge_count_saved( footprint / pagesize ); }
+        else
+        {
+            h = large_stack_pop( &free_large_objects[c] );
+            if( h != NULL && large_took_purged( b ) ) purge_count_refaulted( footprint / pagesize );
+        }
         SM_LOG_DEBUG( "h==%p\n", h );
         if( h != NULL )
         {
-            if( 0 )
-            {
-                // This is what we want the atomic code below to do.
-                // The atomic code will have to re-read *free_head to get h again.
-                *free_head = h->next;
-            }
-            else
-            {
-                // The strategy for the atomic version is that we set e.result to NULL if the list
-                // becomes empty (so that we go around and do chunk allocation again).
-
-                h = SM_INVOKE_ATOMIC_OPERATION( &large_lock, large_malloc_pop, free_head );
-                if( h == NULL ) continue;    // Go try again
-            }
-            // that was the atomic part.
             h->footprint = footprint;
             add_to_footprint( footprint );
             SM_LOG_DEBUG( "setting its footprint to %d\n", h->footprint );
@@ -168,22 +348,9 @@ large_malloc( size_t size )
             chunknumber_t chunknum = address_2_chunknumber( chunk );
             commit_ci_page_as_needed( chunknum );
             chunk_infos[chunknum].bin_and_size = b_and_s;
+            set_chunk_generation( chunknum );
 
-            // Do this atomically.
-            if( 0 )
-            {
-                entry[objects_per_chunk - 1].next = *free_head;
-                *free_head                        = &entry[0];
-            }
-            else
-            {
-                while( 1 )
-                {
-                    large_object_list_cell* old_first = *free_head;
-                    entry[objects_per_chunk - 1].next = old_first;
-                    if( atomic_compare_and_swap( (atomic_ptr*) free_head, &old_first, &entry[0] ) ) break;    //> added &
-                }
-            }
+            large_stack_push_chain( &free_large_objects[c], &entry[0], &entry[objects_per_chunk - 1] );
 
             SM_LOG_DEBUG( "Got object\n" );
         }
@@ -211,17 +378,75 @@ large_footprint( void* p )
     return footprint;
 }
 
+static void
+large_release_pages( void* address, size_t length )
+// Effect: Give the pages from address to address+length back to the kernel.  They stay mapped, and read as zeros (or as
+//  their old contents) when touched again.
+{
+#if defined( MADV_FREE )
+    // MADV_FREE lets the kernel take the pages only when it runs short of memory, so if it doesn't, reusing the object costs
+    // no page faults.  Kernels before 4.5 reject it.
+    static _Atomic bool no_madv_free;
+    if( atomic_load_explicit( &no_madv_free, memory_order_relaxed ) || madvise( address, length, MADV_FREE ) != 0 )
+    {
+        atomic_store_explicit( &no_madv_free, true, memory_order_relaxed );
+        madvise( address, length, MADV_DONTNEED );
+    }
+#else
+    madvise( address, length, MADV_DONTNEED );
+#endif
+}
+
+bool
+large_realloc_in_place( void* p, size_t size )
+// Effect: p points into a live large object.  If the object's bin is still the one for size bytes from p (the bytes before p
+//  included), make its footprint the pages that those bytes touch, give the pages past them back to the kernel, and return
+//  true.  Otherwise return false, and the caller moves the object.
+{
+    chunknumber_t cn = address_2_chunknumber( p );
+    if( chunk_belongs_to_parent( cn ) ) return false;
+    binnumber_t bin = bin_from_bin_and_size( chunk_infos[cn].bin_and_size );
+    SM_ASSERT( first_large_bin_number <= bin && bin < first_huge_bin_number );
+    uint64_t                usable_size = bin_2_size( bin );
+    uint64_t                objnum      = ( offset_in_chunk( p ) - offset_of_first_object_in_large_chunk ) / usable_size;
+    large_object_list_cell* entries     = (large_object_list_cell*) address_2_chunkaddress( p );
+    char*                   base        = (char*) entries + offset_of_first_object_in_large_chunk + objnum * usable_size;
+    uint64_t                end         = (uint64_t) ( (char*) p - base ) + size;
+    if( end > usable_size || size_2_bin( end ) != bin ) return false;
+    uint32_t old_footprint = entries[objnum].footprint;
+    uint32_t footprint     = (uint32_t) ( pagesize * ceil64( end, pagesize ) );
+    if( footprint < old_footprint ) large_release_pages( base + footprint, old_footprint - footprint );
+    entries[objnum].footprint = footprint;
+    add_to_footprint( (int64_t) footprint - old_footprint );
+    return true;
+}
+
+void
+large_reuse_cached( void* p, binnumber_t bin )
+// Effect: The object p of the large bin bin is coming out of a cache, which hands it out as large_malloc() would hand out a
+//  new object of the whole bin.  Give it that object's footprint, since large_realloc_in_place() may have shrunk it.
+{
+    uint64_t offset    = offset_in_chunk( p );
+    uint64_t objnum    = divide_offset_by_objsize( (uint32_t) ( offset - offset_of_first_object_in_large_chunk ), bin );
+    uint32_t footprint = (uint32_t) ( pagesize * ceil64( bin_2_size( bin ), pagesize ) );
+
+    large_object_list_cell* entries = (large_object_list_cell*) address_2_chunkaddress( p );
+    uint32_t                old     = entries[objnum].footprint;
+    if( old == footprint ) return;
+    entries[objnum].footprint = footprint;
+    add_to_footprint( (int64_t) footprint - old );
+}
+
 void
 large_free( void* p )
 {
     bin_and_size_t b_and_s = chunk_infos[address_2_chunknumber( p )].bin_and_size;
     SM_ASSERT( b_and_s != 0 );
+    if( chunk_belongs_to_parent( address_2_chunknumber( p ) ) ) return;
     binnumber_t bin = bin_from_bin_and_size( b_and_s );
     SM_ASSERT( first_large_bin_number <= bin && bin < first_huge_bin_number );
     uint64_t usable_size = bin_2_size( bin );
 
-    madvise( p, usable_size, MADV_DONTNEED );
-
     uint64_t offset = offset_in_chunk( p );
     uint64_t objnum = divide_offset_by_objsize( (uint32_t) ( offset - offset_of_first_object_in_large_chunk ), bin );
     if( IS_TESTING )
@@ -232,23 +457,183 @@ large_free( void* p )
     large_object_list_cell* entries   = (large_object_list_cell*) address_2_chunkaddress( p );
     uint32_t                footprint = entries[objnum].footprint;
     add_to_footprint( -(int32_t) footprint );
-    large_object_list_cell** h  = &free_large_objects[bin - first_large_bin_number];
-    large_object_list_cell*  ei = entries + objnum;
-    // This part atomic. Can be done with compare_and_swap
-    if( 0 )
+    large_object_list_cell* ei = entries + objnum;
+    if( purge_retain_large() )
     {
-        ei->next = *h;
-        *h       = ei;
+        // Keep it committed, and let a decay pass or a trim purge it if it isn't reused.
+        large_retained_push( bin - first_large_bin_number, ei );
+        purge_retained();
+        return;
     }
-    else
+    if( purge_deferred() )
+    {
+        // The purge thread madvises it and then pushes it onto the free list.
+        purge_enqueue_large_object( ei );
+        return;
+    }
+    large_purge_object( ei );
+}
+
+void
+large_purge_object( large_object_list_cell* e )
+// Effect: Madvise the free large object whose chunk header entry is e, which is on no free list, and then push it onto its
+//  free list.
+{
+    large_object_list_cell* entries     = (large_object_list_cell*) address_2_chunkaddress( e );
+    binnumber_t             bin         = bin_from_bin_and_size( chunk_infos[address_2_chunknumber( e )].bin_and_size );
+    uint64_t                usable_size = bin_2_size( bin );
+    void*                   address     = (char*) entries + offset_of_first_object_in_large_chunk + ( e - entries ) * usable_size;
+    large_release_pages( address, usable_size );
+    purge_count_purged( usable_size / pagesize );
+    atomic_fetch_add( &large_decay[bin - first_large_bin_number].n_purged, 1 );
+    large_stack_push_chain( &free_large_objects[bin - first_large_bin_number], e, e );
+}
+
+static void
+large_decay_stack( uint32_t c, large_stack* s, _Atomic uint32_t* n_on_s, uint32_t keep_q16 )
+// Effect: Purge the oldest of the retained objects of class c on s, all but keep_q16/65536 of them.  n_on_s counts the objects
+//  on s.
+// Implementation notes: Concurrent frees and mallocs keep pushing and popping s, so take the whole stack, and push the
+//  newest part back.  Meanwhile large_retained_pop() may find s empty and look elsewhere.
+{
+    large_object_list_cell* first = large_stack_take_all( s );
+    if( first == NULL ) return;
+    uint32_t m = 1;
+    for( large_object_list_cell* e = first->next; e; e = e->next ) m++;
+    atomic_fetch_sub_explicit( n_on_s, m, memory_order_relaxed );
+    uint64_t                owed     = (uint64_t) m * ( 65536 - keep_q16 ) + large_decay[c].decay_carry;
+    uint32_t                n_purge  = owed >> 16 < m ? (uint32_t) ( owed >> 16 ) : m;
+    large_object_list_cell* purge_us = first;
+    large_decay[c].decay_carry       = owed & 0xffff;
+    if( n_purge < m )
     {
-        while( 1 )
+        // The stack is newest first, so the ones to purge are at its end.
+        large_object_list_cell* newest_kept = first;
+        for( uint32_t i = 1; i < m - n_purge; i++ ) newest_kept = newest_kept->next;
+        purge_us = newest_kept->next;
+        atomic_fetch_add_explicit( n_on_s, m - n_purge, memory_order_relaxed );
+        large_stack_push_chain( s, first, newest_kept );
+    }
+    if( n_purge == 0 ) return;
+    check_cpuid();
+    large_count_retained_bytes( &cpu_retained_large_objects[prid.cpuid],
+                                -(int64_t) ( n_purge * bin_2_size( first_large_bin_number + c ) ) );
+    while( purge_us )
+    {
+        large_object_list_cell* next = purge_us->next;
+        large_purge_object( purge_us );
+        purge_us = next;
+    }
+}
+
+void
+large_decay_objects( uint32_t keep_q16 )
+// Effect: Purge the oldest retained objects of every size, so that keep_q16/65536 of them stay committed.  The caller holds
+//  the purge pass lock, so this is the only decay pass.
+{
+    for( uint32_t c = 0; c < n_large_classes; c++ )
+    {
+        if( atomic_load_explicit( &retained_large_objects[c].n_retained, memory_order_relaxed ) != 0 )
+            large_decay_stack( c, &retained_large_objects[c].stack, &retained_large_objects[c].n_retained, keep_q16 );
+        // Look at every CPU, not just the ones in cpus_retaining[c]: a push may race with clearing a CPU's bit.
+        for( int cpu = 0; cpu < processor_number_limit; cpu++ )
         {
-            large_object_list_cell* first = atomic_load( (atomic_ptr*) h );
-            ei->next                      = first;
-            if( atomic_compare_and_swap( (atomic_ptr*) h, &first, ei ) ) break;    //> added &
+            large_cpu_stacks* cs = &cpu_retained_large_objects[cpu];
+            if( atomic_load_explicit( &cs->n_retained[c], memory_order_relaxed ) != 0 )
+                large_decay_stack( c, &cs->retained[c], &cs->n_retained[c], keep_q16 );
+            uint64_t me = 1ull << cpu;
+            if( atomic_load_explicit( &cs->n_retained[c], memory_order_relaxed ) == 0
+                && ( atomic_load_explicit( &cpus_retaining[c], memory_order_relaxed ) & me ) )
+                atomic_fetch_and_explicit( &cpus_retaining[c], ~me, memory_order_relaxed );
         }
     }
+    // Fold every CPU's count, so that large_retained_over() is exact again for a while.
+    for( int cpu = 0; cpu < processor_number_limit; cpu++ )
+    {
+        _Atomic int64_t* n = &cpu_retained_large_objects[cpu].retained_bytes;
+        if( atomic_load_explicit( n, memory_order_relaxed ) != 0 )
+            atomic_fetch_add_explicit( &folded_retained_bytes, atomic_exchange_explicit( n, 0, memory_order_relaxed ),
+                                       memory_order_relaxed );
+    }
+}
+
+uint64_t
+large_retained_bytes( void )
+{
+    int64_t sum = atomic_load_explicit( &folded_retained_bytes, memory_order_relaxed );
+    for( int cpu = 0; cpu < processor_number_limit; cpu++ )
+    {
+        sum += atomic_load_explicit( &cpu_retained_large_objects[cpu].retained_bytes, memory_order_relaxed );
+    }
+    return sum < 0 ? 0 : (uint64_t) sum;
+}
+
+bool
+large_retained_over( uint64_t budget )
+// Effect: Return whether the retained objects seem to take more than budget bytes.  This looks only at the bytes folded so far
+//  and at this CPU's, so that a free needn't read every CPU's count; since the last decay pass, the other CPUs may each have
+//  held back up to large_retained_bytes_batch.
+{
+    check_cpuid();
+    int64_t n = atomic_load_explicit( &folded_retained_bytes, memory_order_relaxed )
+                + atomic_load_explicit( &cpu_retained_large_objects[prid.cpuid].retained_bytes, memory_order_relaxed );
+    return n > (int64_t) budget;
+}
+
+void
+large_trim_retained( uint64_t budget )
+// Effect: If the retained objects take more than budget bytes, purge the oldest of every size, so that about half the budget
+//  stays committed.  Purging in batches leaves room for the next frees before the budget is hit again.
+{
+    uint64_t retained = large_retained_bytes();
+    if( retained <= budget ) return;
+    // retained is less than the address space, so this doesn't overflow.
+    large_decay_objects( (uint32_t) ( ( budget / 2 ) * 65536 / retained ) );
+    // If only a few big objects are retained, their rounded down share may not have been enough.
+    if( large_retained_bytes() > budget ) large_decay_objects( 0 );
+}
+
+static uint32_t
+large_retained_count( uint32_t c )
+// Effect: Return how many objects of class c are retained, if nobody is pushing or popping them.
+{
+    uint32_t n = atomic_load( &retained_large_objects[c].n_retained );
+    for( int cpu = 0; cpu < processor_number_limit; cpu++ ) n += atomic_load( &cpu_retained_large_objects[cpu].n_retained[c] );
+    return n;
+}
+
+static void
+test_large_cpu_stacks( void )
+// Effect: Check that frees fill this CPU's retained stack up to its capacity and spill onto the global one, and that another
+//  CPU takes the global ones first and then steals this one's.
+{
+    large_decay_objects( 0 );
+    uint32_t c   = size_2_bin( 8 * pagesize ) - first_large_bin_number;
+    uint32_t cap = cpu_retained_capacity[c];
+    uint32_t n   = cap + 2;
+    void*    x[n];
+    for( uint32_t i = 0; i < n; i++ ) x[i] = large_malloc( 8 * pagesize );
+    prid.cpuid = processor_number_limit - 1;
+    prid.count = 1;    // Don't look up the CPU again for a while.
+    for( uint32_t i = 0; i < n; i++ ) large_free( x[i] );
+    SM_ASSERT( atomic_load( &cpu_retained_large_objects[processor_number_limit - 1].n_retained[c] ) == cap );
+    SM_ASSERT( large_retained_count( c ) == n );
+    SM_ASSERT( large_retained_bytes() == n * bin_2_size( first_large_bin_number + c ) );
+    SM_ASSERT( atomic_load( &cpus_retaining[c] ) & ( 1ull << ( processor_number_limit - 1 ) ) );
+    prid.cpuid = processor_number_limit - 2;
+    prid.count = 1;
+    void* y[n];
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        y[i] = large_malloc( 8 * pagesize );
+        SM_ASSERT( y[i] == x[n - 1 - i] );
+    }
+    SM_ASSERT( atomic_load( &cpu_retained_large_objects[processor_number_limit - 1].n_retained[c] ) == 0 );
+    for( uint32_t i = 0; i < n; i++ ) large_free( y[i] );
+    large_decay_objects( 0 );
+    SM_ASSERT( large_retained_count( c ) == 0 && large_retained_bytes() == 0 );
+    SM_ASSERT( atomic_load( &cpus_retaining[c] ) == 0 );
+    prid.count = 0;
 }
 
 void
@@ -318,7 +703,7 @@ test_large_malloc( void )
     }
     SM_ASSERT( get_footprint() - fp == 0 );
     {
-        size_t s = 100 * 4096;
+        size_t s = 25 * 4096;    // Not in largest_large's bin, even with 1MiB chunks.
         SM_LOG_DEBUG( "s=%" PRIu64 "\n", s );
 
         void* x = large_malloc( s );
@@ -339,4 +724,5 @@ test_large_malloc( void )
         large_free( y );
     }
     SM_ASSERT( get_footprint() - fp == 0 );
+    if( purge_retain_large() ) test_large_cpu_stacks();
 }
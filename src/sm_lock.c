@@ -0,0 +1,73 @@
+#ifdef TESTING
+#if defined( __linux__ )
+#include <pthread.h>
+#endif
+#endif
+
+#include "atomically.h"
+#include "sm_assert.h"
+#include "sm_internal.h"
+
+#if SM_LOCK_BACKEND == SM_LOCK_MCS
+SM_ATTRIBUTE_THREAD sm_mcs_node sm_mcs_nodes[sm_mcs_nodes_per_thread];
+SM_ATTRIBUTE_THREAD uint64_t    sm_mcs_nodes_used;
+#endif
+
+#ifdef TESTING
+static lock_t   test_locks_array[2] = { SM_LOCK_INITIALIZER, SM_LOCK_INITIALIZER };
+static uint64_t test_locks_counter;
+
+enum
+{
+    test_locks_n_threads    = 4,
+    test_locks_n_increments = 100000
+};
+
+static void*
+test_locks_worker( void* arg )
+{
+    (void) arg;
+    for( int i = 0; i < test_locks_n_increments; i++ )
+    {
+        // Take both locks every so often, in the same order as SM_DECLARE_ATOMIC_OPERATION2 would.
+        if( i % 8 == 0 ) sm_lock( &test_locks_array[0] );
+        sm_lock( &test_locks_array[1] );
+        test_locks_counter++;
+        sm_unlock( &test_locks_array[1] );
+        if( i % 8 == 0 ) sm_unlock( &test_locks_array[0] );
+    }
+    return NULL;
+}
+
+void
+test_locks( void )
+{
+    initialize_lock_array( &test_locks_array[0], 2 );
+
+    // Nested acquisitions, released in either order.
+    sm_lock( &test_locks_array[0] );
+    sm_lock( &test_locks_array[1] );
+    sm_unlock( &test_locks_array[0] );
+    sm_unlock( &test_locks_array[1] );
+#if SM_LOCK_BACKEND == SM_LOCK_MCS
+    SM_ASSERT( sm_mcs_nodes_used == 0 );
+    // Reinitializing a held lock, as the child does after fork(), gives its node back.
+    sm_lock( &test_locks_array[1] );
+    SM_ASSERT( sm_mcs_nodes_used != 0 );
+    initialize_lock_array( &test_locks_array[1], 1 );
+    SM_ASSERT( sm_mcs_nodes_used == 0 );
+#else
+    initialize_lock_array( &test_locks_array[1], 1 );
+#endif
+
+#if defined( __linux__ )
+    pthread_t threads[test_locks_n_threads];
+    test_locks_counter = 0;
+    for( int i = 0; i < test_locks_n_threads; i++ ) SM_ASSERT( pthread_create( &threads[i], NULL, test_locks_worker, NULL ) == 0 );
+    for( int i = 0; i < test_locks_n_threads; i++ ) pthread_join( threads[i], NULL );
+    SM_ASSERT( test_locks_counter == (uint64_t) test_locks_n_threads * test_locks_n_increments );
+#else
+    test_locks_worker( NULL );
+#endif
+}
+#endif
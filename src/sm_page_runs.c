@@ -0,0 +1,345 @@
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include <string.h>
+
+#include "atomically.h"
+#include "generated_constants.hxx"
+#include "sm_assert.h"
+#include "sm_internal.h"
+#include "sm_platform.h"
+
+// The page-run engine for large objects (SM_LARGE_PAGE_RUNS, see sm_config.h).
+//
+// Instead of slots of a bin's size, a page-run chunk is carved into runs
+// of whole pages, each exactly as long as the object in it needs, so an
+// object of size bytes costs ceil(size/pagesize) pages and no more.  The
+// chunk's first page_run_header_pages pages hold a page_run_chunk:
+//  * run_starts has a bit for each page where a run (free or in use)
+//    starts.  The header is a run that is always in use, so every page
+//    is in some run, and a run ends where the next one starts.
+//  * free_starts has a bit for each page where a free run starts.
+//  * entries has, for the first page of each run, the free run's links
+//    in the free list of its length, or the length of the run in use.
+// The free runs of every chunk are on free_runs[n_pages], and
+// nonempty_free_runs has a bit for each list that isn't empty, so an
+// allocation takes the shortest free run that is long enough, and splits
+// it.  Freeing a run merges it with the free runs around it.
+//
+// Freed runs are given back to the kernel right away, so that the
+// resident set matches the pages in use.  Everything else happens under
+// page_run_lock, except that page_run_base() reads run_starts without
+// it, so the words of run_starts are atomic, and are read and written
+// with relaxed loads and stores (only the lock holder writes them).
+typedef struct page_run_entry
+{
+    union
+    {
+        struct
+        {
+            void* next;
+            void* prev;
+        };
+        uint64_t n_pages;
+    };
+} page_run_entry;
+
+enum
+{
+    page_run_bitmap_words = ( page_run_pages_per_chunk + 63 ) / 64,
+    page_run_max_pages    = page_run_pages_per_chunk - page_run_header_pages
+};
+
+typedef struct page_run_chunk
+{
+    _Atomic( uint64_t ) run_starts[page_run_bitmap_words];
+    uint64_t            free_starts[page_run_bitmap_words];
+    page_run_entry      entries[page_run_pages_per_chunk];
+} page_run_chunk;
+
+_Static_assert( sizeof( page_run_chunk ) <= page_run_header_pages * pagesize, "page_run_header_pages is too small" );
+_Static_assert( (int) bin_number_limit < (int) page_run_bin_number, "page_run_bin_number must not be a real bin" );
+
+static lock_t   page_run_lock = SM_LOCK_INITIALIZER;
+static void*    free_runs[page_run_max_pages + 1];
+static uint64_t nonempty_free_runs[( page_run_max_pages + 64 ) / 64];
+
+static inline bool
+bit_is_set( const uint64_t* bits, uint32_t i )
+{
+    return ( bits[i / 64] >> ( i % 64 ) ) & 1;
+}
+
+static inline void
+set_bit( uint64_t* bits, uint32_t i )
+{
+    bits[i / 64] |= 1ull << ( i % 64 );
+}
+
+static inline void
+clear_bit( uint64_t* bits, uint32_t i )
+{
+    bits[i / 64] &= ~( 1ull << ( i % 64 ) );
+}
+
+static inline uint64_t
+run_starts_word( const page_run_chunk* h, uint32_t w )
+{
+    return atomic_load_explicit( &h->run_starts[w], memory_order_relaxed );
+}
+
+static inline void
+set_run_start( page_run_chunk* h, uint32_t i )
+{
+    atomic_store_explicit( &h->run_starts[i / 64], run_starts_word( h, i / 64 ) | ( 1ull << ( i % 64 ) ), memory_order_relaxed );
+}
+
+static inline void
+clear_run_start( page_run_chunk* h, uint32_t i )
+{
+    atomic_store_explicit( &h->run_starts[i / 64], run_starts_word( h, i / 64 ) & ~( 1ull << ( i % 64 ) ), memory_order_relaxed );
+}
+
+static inline page_run_chunk*
+run_chunk( const void* run )
+{
+    return (page_run_chunk*) address_2_chunkaddress( run );
+}
+
+static inline page_run_entry*
+run_entry( const void* run )
+{
+    return &run_chunk( run )->entries[pagenum_in_chunk( run )];
+}
+
+static uint32_t
+next_run_start( const page_run_chunk* h, uint32_t page )
+// Effect: Return the first page after page where a run starts, or page_run_pages_per_chunk if none does.
+{
+    uint32_t i = page + 1;
+    if( i >= page_run_pages_per_chunk ) return page_run_pages_per_chunk;
+    uint32_t w    = i / 64;
+    uint64_t bits = run_starts_word( h, w ) & ( ~0ull << ( i % 64 ) );
+    while( bits == 0 )
+    {
+        if( ++w == page_run_bitmap_words ) return page_run_pages_per_chunk;
+        bits = run_starts_word( h, w );
+    }
+    return w * 64 + SM_BUILTIN_CTZ64( bits );
+}
+
+static uint32_t
+run_start_at_or_before( const page_run_chunk* h, uint32_t page )
+// Effect: Return the first page of the run that page is in.
+{
+    uint32_t w    = page / 64;
+    uint64_t bits = run_starts_word( h, w ) & ( ~0ull >> ( 63 - page % 64 ) );
+    while( bits == 0 ) bits = run_starts_word( h, --w );    // The header's run starts at page 0.
+    return w * 64 + 63 - SM_BUILTIN_CLZ64( bits );
+}
+
+static void
+free_run_push( void* run, uint32_t n_pages )
+// Effect: Mark run, which is n_pages long, free, and put it on its free list.
+{
+    page_run_entry* e = run_entry( run );
+    e->prev           = NULL;
+    e->next           = free_runs[n_pages];
+    if( e->next != NULL ) run_entry( e->next )->prev = run;
+    free_runs[n_pages] = run;
+    set_bit( nonempty_free_runs, n_pages );
+    set_bit( run_chunk( run )->free_starts, (uint32_t) pagenum_in_chunk( run ) );
+}
+
+static void
+free_run_remove( void* run, uint32_t n_pages )
+// Effect: Take the free run, which is n_pages long, off its free list, and mark it in use.
+{
+    page_run_entry* e = run_entry( run );
+    if( e->prev != NULL ) run_entry( e->prev )->next = e->next;
+    else
+        free_runs[n_pages] = e->next;
+    if( e->next != NULL ) run_entry( e->next )->prev = e->prev;
+    if( free_runs[n_pages] == NULL ) clear_bit( nonempty_free_runs, n_pages );
+    clear_bit( run_chunk( run )->free_starts, (uint32_t) pagenum_in_chunk( run ) );
+}
+
+static uint32_t
+shortest_free_run( uint32_t n_pages )
+// Effect: Return the shortest length, at least n_pages, that has a free run, or 0 if there is none.
+{
+    uint32_t w    = n_pages / 64;
+    uint64_t bits = nonempty_free_runs[w] & ( ~0ull << ( n_pages % 64 ) );
+    while( bits == 0 )
+    {
+        if( ++w == sizeof( nonempty_free_runs ) / sizeof( nonempty_free_runs[0] ) ) return 0;
+        bits = nonempty_free_runs[w];
+    }
+    return w * 64 + SM_BUILTIN_CTZ64( bits );
+}
+
+static void*
+do_page_run_alloc( uint32_t n_pages, page_run_chunk* new_chunk )
+// Effect: If new_chunk isn't NULL, add its pages as a free run.  Then take a run of n_pages pages, and return it, or NULL if
+//  no free run is long enough.
+{
+    if( new_chunk != NULL )
+    {
+        set_run_start( new_chunk, 0 );
+        set_run_start( new_chunk, page_run_header_pages );
+        free_run_push( (char*) new_chunk + page_run_header_pages * pagesize, page_run_max_pages );
+    }
+    uint32_t m = shortest_free_run( n_pages );
+    if( m == 0 ) return NULL;
+    char* run = free_runs[m];
+    free_run_remove( run, m );
+    if( m > n_pages )
+    {
+        set_run_start( run_chunk( run ), (uint32_t) pagenum_in_chunk( run ) + n_pages );
+        free_run_push( run + n_pages * pagesize, m - n_pages );
+    }
+    run_entry( run )->n_pages = n_pages;
+    return run;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __page_run_alloc, do_page_run_alloc, void*, uint32_t, page_run_chunk* );
+
+static bool
+do_page_run_free( char* run )
+// Effect: Mark run free, merged with the free runs on either side of it.
+{
+    page_run_chunk* h     = run_chunk( run );
+    uint32_t        first = (uint32_t) pagenum_in_chunk( run );
+    uint32_t        end   = first + (uint32_t) run_entry( run )->n_pages;
+    if( end < page_run_pages_per_chunk && bit_is_set( h->free_starts, end ) )
+    {
+        uint32_t next_end = next_run_start( h, end );
+        free_run_remove( (char*) h + end * pagesize, next_end - end );
+        clear_run_start( h, end );
+        end = next_end;
+    }
+    uint32_t prev = run_start_at_or_before( h, first - 1 );
+    if( bit_is_set( h->free_starts, prev ) )
+    {
+        free_run_remove( (char*) h + prev * pagesize, first - prev );
+        clear_run_start( h, first );
+        first = prev;
+    }
+    free_run_push( (char*) h + first * pagesize, end - first );
+    return true;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __page_run_free, do_page_run_free, bool, char* );
+
+void
+page_run_prefork( void )
+{
+    sm_lock_for_fork( &page_run_lock );
+}
+
+void
+page_run_postfork_parent( void )
+{
+    sm_unlock( &page_run_lock );
+}
+
+void
+page_run_postfork_child( bool fresh_heap )
+{
+    initialize_lock_array( &page_run_lock, 1 );
+    if( fresh_heap )
+    {
+        // The free runs are all in the parent's chunks.
+        memset( free_runs, 0, sizeof( free_runs ) );
+        memset( nonempty_free_runs, 0, sizeof( nonempty_free_runs ) );
+    }
+}
+
+void*
+page_run_malloc( size_t size )
+// Effect: Allocate size bytes (at most page_run_largest) as a run of whole pages.  Like the large bins, add a random
+//  misalignment of whole cache lines, but only as much as fits in the last page.
+{
+    SM_ASSERT( size <= page_run_largest );
+    uint32_t n_pages = (uint32_t) ceil64( size, pagesize );
+    void*    run     = SM_INVOKE_ATOMIC_OPERATION( &page_run_lock, __page_run_alloc, n_pages, NULL );
+    while( run == NULL )
+    {
+        page_run_chunk* chunk = mmap_chunk_aligned_block( 1 );
+        if( chunk == NULL ) return NULL;
+#if defined( __linux__ )
+        madvise( chunk, chunksize, MADV_NOHUGEPAGE );    // A huge page would make the unused pages resident.
+#endif
+        chunknumber_t chunknum = address_2_chunknumber( chunk );
+        commit_ci_page_as_needed( chunknum );
+        chunk_infos[chunknum].bin_and_size = bin_and_size_to_bin_and_size( page_run_bin_number, 0 );
+        set_chunk_generation( chunknum );
+        run = SM_INVOKE_ATOMIC_OPERATION( &page_run_lock, __page_run_alloc, n_pages, chunk );
+    }
+    uint64_t slack = n_pages * pagesize - size;
+    return (char*) run + prandnum() % ( slack / cacheline_size + 1 ) * cacheline_size;
+}
+
+void*
+page_run_base( const void* p )
+// Effect: Return the start of the run that p points into.
+// Implementation notes: Other runs of the chunk may be changing under page_run_lock, but not the bits of p's run, and the
+//  run_starts words are read atomically.
+{
+    page_run_chunk* h = run_chunk( p );
+    return (char*) h + run_start_at_or_before( h, (uint32_t) pagenum_in_chunk( p ) ) * pagesize;
+}
+
+size_t
+page_run_size( const void* run )
+// Effect: Return the length in bytes of the run in use that starts at run.
+{
+    return run_entry( run )->n_pages * pagesize;
+}
+
+void
+page_run_free( void* p )
+{
+    char*    run     = page_run_base( p );
+    uint64_t n_pages = run_entry( run )->n_pages;
+    // Not MADV_FREE: its pages stay resident until the kernel runs short of memory.
+    madvise( run, n_pages * pagesize, MADV_DONTNEED );
+    purge_count_purged( n_pages );
+    SM_INVOKE_ATOMIC_OPERATION( &page_run_lock, __page_run_free, run );
+}
+
+#ifdef TESTING
+void
+test_page_runs( void )
+{
+    // Runs are exactly as long as they need to be, and the shortest free run that fits is used.
+    char* a = page_run_malloc( 10 * 1024 );
+    char* b = page_run_malloc( 3 * pagesize );
+    char* c = page_run_malloc( pagesize + 1 );
+    SM_ASSERT( page_run_size( page_run_base( a ) ) == 3 * pagesize );
+    SM_ASSERT( page_run_size( page_run_base( b ) ) == 3 * pagesize );
+    SM_ASSERT( page_run_size( page_run_base( c ) ) == 2 * pagesize );
+    SM_ASSERT( (uint64_t) b % pagesize == 0 );
+    SM_ASSERT( page_run_base( a + 10 * 1024 - 1 ) == page_run_base( a ) );
+    memset( a, 'a', 10 * 1024 );
+    memset( b, 'b', 3 * pagesize );
+    page_run_free( a );
+    char* d = page_run_malloc( 2 * pagesize );
+    SM_ASSERT( page_run_base( d ) == page_run_base( a ) );
+    page_run_free( d );
+    for( size_t i = 0; i < 3 * pagesize; i++ ) SM_ASSERT( b[i] == 'b' );
+
+    // Freeing b merges the runs around it into one run, which then holds an object as long as all three.
+    page_run_free( b );
+    char* e = page_run_malloc( 6 * pagesize );
+    SM_ASSERT( e == page_run_base( a ) );
+    page_run_free( e );
+    page_run_free( c );
+
+    // The largest run takes a whole chunk.
+    char* f = page_run_malloc( page_run_largest );
+    SM_ASSERT( offset_in_chunk( f ) == page_run_header_pages * pagesize );
+    SM_ASSERT( page_run_size( f ) == page_run_largest );
+    page_run_free( f );
+}
+#endif
@@ -0,0 +1,700 @@
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+#include "atomically.h"
+#include "sm_assert.h"
+#include "sm_internal.h"
+#include "supermalloc.h"
+
+// Purging gives the pages of empty small folios and of free large
+// objects back to the kernel with madvise(MADV_DONTNEED).  In
+// SM_PURGE_INLINE mode the thread whose free() emptied them does that
+// right away.  In the other two modes free() pushes them onto one of
+// two lock-free queues (empty folios linked through per_folio.next,
+// large objects through large_object_list_cell.next) and a purge
+// thread drains the queues: in SM_PURGE_BACKGROUND_THREAD mode a
+// thread we create, in SM_PURGE_USER_THREAD mode one the application
+// runs in sm_purge_thread_run().  A queued folio or object is on no
+// list, so nobody can allocate out of it until it has been purged.
+//
+// A purge thread that has nothing to do sleeps until the next free
+// queues something; while frees keep coming it drains the queues every
+// purge_interval_ns instead, so that most frees don't have to wake it.
+//
+// At most one purge thread runs at a time (purger_running).  Whenever
+// a free queues something while no purge thread runs, it drains the
+// queues itself (or, in background mode, starts our thread), so
+// nothing stays queued for long.  The queues are drained by taking
+// the whole list with one exchange, so they have no ABA problem, and
+// a drain holds purge_pass_lock, which fork() takes before the bin
+// locks, so that the child never inherits a half drained list.
+//
+// With a purge half-life (sm_set_purge_decay()), frees don't purge or
+// queue anything.  Empty folios and free large objects stay committed
+// on their bin's list of retained memory, newest first, where the next
+// malloc of that size finds them, and a decay pass purges the oldest of
+// them every half-life / decay_steps_per_half_life, so that what stays
+// unused halves every half-life.  The purge thread runs the passes; while
+// none runs, the free that retains something runs the pass that is due,
+// so a process that stops freeing keeps what it retained until it frees
+// again.
+//
+// Freed large objects are also retained without decay, as long as they
+// take no more than a budget of bytes (sm_set_large_retained_bytes()),
+// so that freeing one and allocating the same size again costs neither
+// a system call nor page faults.  The free that goes over the budget (or
+// the purge thread, if one runs) purges the oldest retained objects of
+// every size in one batch, down to half the budget.
+
+enum
+{
+    purge_interval_ns         = 1000000,    // How often a busy purge thread drains the queues.
+    decay_steps_per_half_life = 8,
+    decay_keep_per_step_q16   = 60097    // 2^(-1/8), as a fraction of 65536.
+};
+
+static _Atomic int  purge_mode = SM_PURGE_INLINE;
+static _Atomic bool purger_running;
+static _Atomic bool purger_sleeping;    // The purge thread waits on purge_wakeup (or is about to).
+
+static _Atomic( per_folio* ) purge_folios;
+static _Atomic( large_object_list_cell* ) purge_large_objects;
+
+static _Atomic uint64_t purge_half_life_ns;    // 0 means no decay.
+static _Atomic uint64_t decay_last_pass_ns;
+static _Atomic uint64_t large_retained_budget = SM_LARGE_RETAINED_BYTES;    // 0 means no budget.
+
+static _Atomic uint64_t purges;
+static _Atomic uint64_t purged_pages;
+static _Atomic uint64_t refaulted_pages;
+static _Atomic uint64_t saved_pages;
+
+#if defined( __linux__ )
+static pthread_mutex_t purge_pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t purge_mode_lock = PTHREAD_MUTEX_INITIALIZER;    // Serializes sm_set_purge_mode().
+static pthread_mutex_t purge_mutex     = PTHREAD_MUTEX_INITIALIZER;    // Protects purge_stop, and goes with the conditions.
+static pthread_cond_t  purge_wakeup    = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  purge_stopped   = PTHREAD_COND_INITIALIZER;
+static bool            purge_stop;
+static pthread_t       background_purge_thread;
+static bool            background_purge_thread_joinable;
+#endif
+
+bool
+purge_deferred( void )
+{
+    return atomic_load_explicit( &purge_mode, memory_order_relaxed ) != SM_PURGE_INLINE;
+}
+
+bool
+purge_decay_enabled( void )
+{
+    return atomic_load_explicit( &purge_half_life_ns, memory_order_relaxed ) != 0;
+}
+
+bool
+purge_retain_large( void )
+{
+    return purge_decay_enabled() || atomic_load_explicit( &large_retained_budget, memory_order_relaxed ) != 0;
+}
+
+void
+purge_count_purged( uint64_t pages )
+// Effect: Count one madvise() that purged pages pages.
+{
+    atomic_fetch_add_explicit( &purges, 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &purged_pages, pages, memory_order_relaxed );
+}
+
+void
+purge_count_refaulted( uint64_t pages )
+{
+    atomic_fetch_add_explicit( &refaulted_pages, pages, memory_order_relaxed );
+}
+
+void
+purge_count_saved( uint64_t pages )
+{
+    atomic_fetch_add_explicit( &saved_pages, pages, memory_order_relaxed );
+}
+
+static uint64_t
+purge_now_ns( void )
+{
+    struct timespec now;
+#if defined( CLOCK_MONOTONIC_COARSE )
+    // A decay step is at least a millisecond, so the coarse clock is good enough, and cheaper.
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+#else
+    clock_gettime( CLOCK_MONOTONIC, &now );
+#endif
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t
+purge_decay_step_ns( void )
+// Effect: Return how often a decay pass is due, or 0 if there is no decay.
+{
+    uint64_t half_life = atomic_load_explicit( &purge_half_life_ns, memory_order_relaxed );
+    if( half_life == 0 ) return 0;
+    uint64_t step = half_life / decay_steps_per_half_life;
+    return step < purge_interval_ns ? purge_interval_ns : step;
+}
+
+static void
+purge_decay_pass( uint32_t keep_q16 )
+// Effect: Purge the oldest retained folios and large objects, so that keep_q16/65536 of them stay committed.
+{
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_pass_lock );
+#endif
+    small_decay_folios( keep_q16 );
+    large_decay_objects( keep_q16 );
+#if defined( __linux__ )
+    pthread_mutex_unlock( &purge_pass_lock );
+#endif
+}
+
+static void
+purge_decay_tick( void )
+// Effect: If a decay step has gone by since the last pass, and nobody else is starting a pass, run one for the steps that have
+//  gone by.
+{
+    uint64_t step = purge_decay_step_ns();
+    if( step == 0 ) return;
+    uint64_t now  = purge_now_ns();
+    uint64_t last = atomic_load_explicit( &decay_last_pass_ns, memory_order_relaxed );
+    if( now - last < step || !atomic_compare_exchange_strong( &decay_last_pass_ns, &last, now ) ) return;
+    uint64_t n_steps = ( now - last ) / step;
+    uint32_t keep    = 65536;
+    for( uint64_t i = 0; i < n_steps && keep != 0; i++ ) keep = (uint32_t) ( ( (uint64_t) keep * decay_keep_per_step_q16 ) >> 16 );
+    purge_decay_pass( keep );
+}
+
+static bool
+purge_over_budget( void )
+{
+    uint64_t budget = atomic_load_explicit( &large_retained_budget, memory_order_relaxed );
+    return budget != 0 && large_retained_over( budget );
+}
+
+static void
+purge_trim_pass( void )
+// Effect: If the retained large objects are over budget, purge a batch of them.
+{
+    if( !purge_over_budget() ) return;
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_pass_lock );
+#endif
+    large_trim_retained( atomic_load_explicit( &large_retained_budget, memory_order_relaxed ) );
+#if defined( __linux__ )
+    pthread_mutex_unlock( &purge_pass_lock );
+#endif
+}
+
+static bool
+purge_queues_empty( void )
+{
+    return atomic_load( &purge_folios ) == NULL && atomic_load( &purge_large_objects ) == NULL;
+}
+
+static uint64_t
+purge_drain( void )
+// Effect: Purge everything that is queued, and return how many folios and objects that was.
+{
+    uint64_t n = 0;
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_pass_lock );
+#endif
+    per_folio* pp = atomic_exchange_explicit( &purge_folios, NULL, memory_order_acquire );
+    while( pp )
+    {
+        per_folio* next = pp->next;
+        small_purge_folio( pp );
+        pp = next;
+        n++;
+    }
+    large_object_list_cell* e = atomic_exchange_explicit( &purge_large_objects, NULL, memory_order_acquire );
+    while( e )
+    {
+        large_object_list_cell* next = e->next;
+        large_purge_object( e );
+        e = next;
+        n++;
+    }
+#if defined( __linux__ )
+    pthread_mutex_unlock( &purge_pass_lock );
+#endif
+    return n;
+}
+
+#if defined( __linux__ )
+static void
+purge_timedwait( uint64_t ns )
+// Effect: Wait on purge_wakeup (with purge_mutex held) for at most ns nanoseconds.
+{
+    struct timespec until;
+    clock_gettime( CLOCK_REALTIME, &until );
+    until.tv_sec += ns / 1000000000;
+    until.tv_nsec += ns % 1000000000;
+    if( until.tv_nsec >= 1000000000 )
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( &purge_wakeup, &purge_mutex, &until );
+}
+
+static void
+purge_loop( void )
+// Effect: Drain the queues until sm_purge_thread_stop() or sm_set_purge_mode() asks us to stop.  The caller has set
+//  purger_running.
+{
+    while( true )
+    {
+        uint64_t n_purged = purge_drain();
+        purge_decay_tick();
+        purge_trim_pass();
+        pthread_mutex_lock( &purge_mutex );
+        if( n_purged != 0 )
+        {
+            // Frees are coming in.  Look again in a little while, rather than have every free wake us up: that costs the freeing
+            // thread a system call, which is what we are here to save it.
+            if( !purge_stop ) purge_timedwait( purge_interval_ns );
+        }
+        else
+        {
+            // Idle.  Announce that we are going to sleep before we look at the queues: a free that queues something (or
+            // goes over the budget) after we looked sees purger_sleeping and wakes us up.  With decay we also wake up for
+            // the next pass.  Waking up for any other reason just costs an empty drain.
+            atomic_store( &purger_sleeping, true );
+            uint64_t step = purge_decay_step_ns();
+            if( !purge_stop && purge_queues_empty() && !purge_over_budget() )
+            {
+                if( step != 0 ) purge_timedwait( step );
+                else pthread_cond_wait( &purge_wakeup, &purge_mutex );
+            }
+            atomic_store( &purger_sleeping, false );
+        }
+        if( purge_stop )
+        {
+            purge_stop = false;
+            atomic_store( &purger_running, false );
+            pthread_cond_broadcast( &purge_stopped );
+            pthread_mutex_unlock( &purge_mutex );
+            return;
+        }
+        pthread_mutex_unlock( &purge_mutex );
+    }
+}
+
+static void*
+background_purge_main( void* arg )
+{
+    (void) arg;
+    purge_loop();
+    return NULL;
+}
+
+static bool
+start_background_purge_thread( void )
+// Effect: Start our purge thread unless some purge thread runs already.  Return false if neither is running.
+{
+    bool expected = false;
+    if( !atomic_compare_exchange_strong( &purger_running, &expected, true ) ) return true;
+    if( pthread_create( &background_purge_thread, NULL, background_purge_main, NULL ) != 0 )
+    {
+        atomic_store( &purger_running, false );
+        return false;
+    }
+    background_purge_thread_joinable = true;
+    return true;
+}
+
+static void
+stop_purge_thread( void )
+// Effect: Make the purge thread (if any) return, wait until it has, and then purge whatever it left in the queues.
+{
+    pthread_mutex_lock( &purge_mutex );
+    if( atomic_load( &purger_running ) )
+    {
+        purge_stop = true;
+        pthread_cond_signal( &purge_wakeup );
+        while( atomic_load( &purger_running ) ) pthread_cond_wait( &purge_stopped, &purge_mutex );
+    }
+    pthread_mutex_unlock( &purge_mutex );
+    // A free that saw purger_running just before it was cleared may have queued something that the purge thread didn't see.
+    purge_drain();
+}
+#endif
+
+static void
+purge_wake( void )
+// Effect: If the purge thread is asleep, wake it up.
+{
+#if defined( __linux__ )
+    if( atomic_load( &purger_sleeping ) )
+    {
+        pthread_mutex_lock( &purge_mutex );
+        pthread_cond_signal( &purge_wakeup );
+        pthread_mutex_unlock( &purge_mutex );
+    }
+#endif
+}
+
+static void
+purge_kick( void )
+// Effect: Something was just queued.  Make sure that somebody purges it.
+{
+    if( atomic_load( &purger_running ) )
+    {
+        purge_wake();
+        return;
+    }
+#if defined( __linux__ )
+    // After fork() the child has the mode but not the thread, so start it again.
+    if( atomic_load( &purge_mode ) == SM_PURGE_BACKGROUND_THREAD && start_background_purge_thread() ) return;
+#endif
+    purge_drain();
+}
+
+void
+purge_retained( void )
+// Effect: Something was just retained.  If no purge thread runs the decay passes, run the one that is due, and if the retained
+//  large objects went over budget, purge a batch of them.
+{
+    if( atomic_load( &purger_running ) )
+    {
+        if( purge_over_budget() ) purge_wake();
+        return;
+    }
+#if defined( __linux__ )
+    if( atomic_load( &purge_mode ) == SM_PURGE_BACKGROUND_THREAD && start_background_purge_thread() ) return;
+#endif
+    purge_decay_tick();
+    purge_trim_pass();
+}
+
+void
+purge_enqueue_folios( per_folio* head, per_folio* tail )
+// Effect: Queue the list of empty folios from head to tail (linked through their next fields) for purging.
+{
+    per_folio* old = atomic_load_explicit( &purge_folios, memory_order_relaxed );
+    do
+    {
+        tail->next = old;
+    } while( !atomic_compare_exchange_weak_explicit( &purge_folios, &old, head, memory_order_seq_cst, memory_order_relaxed ) );
+    purge_kick();
+}
+
+void
+purge_enqueue_large_object( large_object_list_cell* e )
+// Effect: Queue the free large object whose chunk header entry is e for purging.
+{
+    large_object_list_cell* old = atomic_load_explicit( &purge_large_objects, memory_order_relaxed );
+    do
+    {
+        e->next = old;
+    } while( !atomic_compare_exchange_weak_explicit( &purge_large_objects, &old, e, memory_order_seq_cst, memory_order_relaxed ) );
+    purge_kick();
+}
+
+void
+sm_set_purge_mode( sm_purge_mode mode )
+{
+    maybe_initialize_malloc();
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_mode_lock );
+    int old_mode = atomic_exchange( &purge_mode, mode );
+    if( old_mode == SM_PURGE_BACKGROUND_THREAD && mode != SM_PURGE_BACKGROUND_THREAD && background_purge_thread_joinable )
+    {
+        stop_purge_thread();
+        pthread_join( background_purge_thread, NULL );
+        background_purge_thread_joinable = false;
+    }
+    if( mode == SM_PURGE_BACKGROUND_THREAD ) start_background_purge_thread();
+    pthread_mutex_unlock( &purge_mode_lock );
+#else
+    (void) mode;
+#endif
+}
+
+void
+sm_set_purge_decay( uint64_t half_life_ms )
+{
+    maybe_initialize_malloc();
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_mode_lock );
+#endif
+    atomic_store( &decay_last_pass_ns, purge_now_ns() );
+    uint64_t old_half_life = atomic_exchange( &purge_half_life_ns, half_life_ms * 1000000 );
+    // Without decay, nothing purges what is retained, so purge it now.
+    if( old_half_life != 0 && half_life_ms == 0 ) purge_decay_pass( 0 );
+#if defined( __linux__ )
+    // A purge thread that is waiting for a queue to fill up should wait for the next pass instead.
+    pthread_mutex_lock( &purge_mutex );
+    pthread_cond_signal( &purge_wakeup );
+    pthread_mutex_unlock( &purge_mutex );
+    pthread_mutex_unlock( &purge_mode_lock );
+#endif
+}
+
+void
+sm_set_large_retained_bytes( size_t bytes )
+{
+    maybe_initialize_malloc();
+    atomic_store( &large_retained_budget, bytes );
+    if( bytes == 0 && !purge_decay_enabled() )
+    {
+        // Nothing would ever purge what is retained.
+#if defined( __linux__ )
+        pthread_mutex_lock( &purge_pass_lock );
+#endif
+        large_decay_objects( 0 );
+#if defined( __linux__ )
+        pthread_mutex_unlock( &purge_pass_lock );
+#endif
+    }
+    else purge_trim_pass();
+}
+
+void
+sm_get_purge_stats( sm_purge_stats* stats )
+{
+    stats->purges          = atomic_load_explicit( &purges, memory_order_relaxed );
+    stats->purged_pages    = atomic_load_explicit( &purged_pages, memory_order_relaxed );
+    stats->refaulted_pages = atomic_load_explicit( &refaulted_pages, memory_order_relaxed );
+    stats->saved_pages     = atomic_load_explicit( &saved_pages, memory_order_relaxed );
+}
+
+void
+sm_purge_thread_run( void )
+{
+    maybe_initialize_malloc();
+#if defined( __linux__ )
+    if( atomic_load( &purge_mode ) != SM_PURGE_USER_THREAD ) return;
+    bool expected = false;
+    if( !atomic_compare_exchange_strong( &purger_running, &expected, true ) ) return;
+    purge_loop();
+#endif
+}
+
+void
+sm_purge_thread_stop( void )
+{
+#if defined( __linux__ )
+    if( atomic_load( &purge_mode ) == SM_PURGE_USER_THREAD ) stop_purge_thread();
+#endif
+}
+
+void
+purge_prefork( void )
+{
+#if defined( __linux__ )
+    pthread_mutex_lock( &purge_pass_lock );
+#endif
+}
+
+void
+purge_postfork_parent( void )
+{
+#if defined( __linux__ )
+    pthread_mutex_unlock( &purge_pass_lock );
+#endif
+}
+
+void
+purge_postfork_child( bool fresh_heap )
+// Effect: The purge thread didn't come along; the next free that queues something starts a new one (in background mode) or
+//  drains the queues itself.
+{
+#if defined( __linux__ )
+    pthread_mutex_t unlocked_mutex   = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t  fresh_cond       = PTHREAD_COND_INITIALIZER;
+    purge_pass_lock                  = unlocked_mutex;
+    purge_mode_lock                  = unlocked_mutex;
+    purge_mutex                      = unlocked_mutex;
+    purge_wakeup                     = fresh_cond;
+    purge_stopped                    = fresh_cond;
+    purge_stop                       = false;
+    background_purge_thread_joinable = false;
+#endif
+    atomic_store( &purger_running, false );
+    atomic_store( &purger_sleeping, false );
+    if( fresh_heap )
+    {
+        // What is queued lives in the parent's chunks.
+        atomic_store( &purge_folios, NULL );
+        atomic_store( &purge_large_objects, NULL );
+    }
+}
+
+#ifdef TESTING
+void
+purge_wait_until_idle( void )
+// Effect: Wait until everything that was queued before the call has been purged.
+{
+#if defined( __linux__ )
+    while( !purge_queues_empty() ) sched_yield();
+    // The purge thread may still be working on the lists it took.
+    pthread_mutex_lock( &purge_pass_lock );
+    pthread_mutex_unlock( &purge_pass_lock );
+#endif
+}
+
+static void*
+test_purge_user_thread( void* arg )
+{
+    (void) arg;
+    sm_purge_thread_run();
+    return NULL;
+}
+
+static void
+test_purge_large( void )
+// Effect: Free a large object, and check that it can be allocated again once the purge thread is done with it.
+{
+    size_t s = 8 * pagesize;
+    void*  x = large_malloc( s );
+    void*  y = large_malloc( s );
+    large_free( x );
+    purge_wait_until_idle();
+    void* z = large_malloc( s );
+    SM_ASSERT( z == x );
+    large_free( z );
+    large_free( y );
+    purge_wait_until_idle();
+}
+
+static void
+test_purge_decay_large( void )
+// Effect: With decay (and a half-life too long for a pass to come due by itself), check that a freed large object stays
+//  committed until a decay pass purges it, and that the counters add up.
+{
+    size_t         s = 8 * pagesize;
+    sm_purge_stats before, after;
+    void*          x = large_malloc( s );
+    void*          y = large_malloc( s );
+    sm_get_purge_stats( &before );
+    large_free( x );
+    void* z = large_malloc( s );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( z == x && after.purged_pages == before.purged_pages && after.refaulted_pages == before.refaulted_pages );
+    large_free( z );
+    large_decay_objects( 0 );
+    z = large_malloc( s );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( z == x );
+    SM_ASSERT( after.purged_pages - before.purged_pages >= s / pagesize );
+    SM_ASSERT( after.refaulted_pages - before.refaulted_pages == s / pagesize );
+    large_free( z );
+    large_free( y );
+    large_decay_objects( 0 );
+}
+
+static void
+test_purge_budget_large( void )
+// Effect: Without decay, check that freed large objects stay committed until they take more than the budget, that a trim then
+//  purges the oldest of them, and that the counters add up.  Then check that the purge thread trims too.
+{
+    enum
+    {
+        n = 8
+    };
+    size_t         s = 8 * pagesize;
+    sm_purge_stats before, after;
+    void*          x[n];
+    for( int i = 0; i < n; i++ ) x[i] = large_malloc( s );
+    sm_set_large_retained_bytes( 0 );
+    SM_ASSERT( large_retained_bytes() == 0 );
+    sm_set_large_retained_bytes( 4 * s );
+    sm_get_purge_stats( &before );
+    for( int i = 0; i < 4; i++ ) large_free( x[i] );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( large_retained_bytes() == 4 * s && after.purges == before.purges );
+
+    // The newest one comes back first, still committed.
+    x[3] = large_malloc( s );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( after.saved_pages - before.saved_pages == s / pagesize );
+    SM_ASSERT( after.refaulted_pages == before.refaulted_pages );
+
+    // The fifth one goes over the budget, so the oldest three or four are purged.
+    for( int i = 3; i < 5; i++ ) large_free( x[i] );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( large_retained_bytes() <= 2 * s );
+    SM_ASSERT( after.purges - before.purges >= 3 && after.purged_pages - before.purged_pages >= 3 * s / pagesize );
+    for( int i = 0; i < 5; i++ ) x[i] = large_malloc( s );
+
+    // The purge thread trims when a free wakes it up.
+    sm_set_purge_mode( SM_PURGE_BACKGROUND_THREAD );
+    for( int i = 0; i < n; i++ ) large_free( x[i] );
+    while( large_retained_bytes() > 4 * s ) sched_yield();
+    sm_set_purge_mode( SM_PURGE_INLINE );
+
+    sm_set_large_retained_bytes( 0 );
+    SM_ASSERT( large_retained_bytes() == 0 );
+}
+
+void
+test_purge( void )
+{
+#if defined( __linux__ )
+    // Without a budget, freed large objects go through the purge queues.
+    sm_set_large_retained_bytes( 0 );
+    SM_ASSERT( !purge_retain_large() );
+    sm_set_purge_mode( SM_PURGE_BACKGROUND_THREAD );
+    SM_ASSERT( purge_deferred() && atomic_load( &purger_running ) );
+    test_purge_large();
+    small_test_purge();
+    // A user purge thread can't run while ours does.
+    sm_purge_thread_run();
+
+    sm_set_purge_mode( SM_PURGE_USER_THREAD );
+    SM_ASSERT( !atomic_load( &purger_running ) );
+    pthread_t thread;
+    SM_ASSERT( pthread_create( &thread, NULL, test_purge_user_thread, NULL ) == 0 );
+    while( !atomic_load( &purger_running ) ) sched_yield();
+    test_purge_large();
+    small_test_purge();
+    sm_purge_thread_stop();
+    pthread_join( thread, NULL );
+    SM_ASSERT( !atomic_load( &purger_running ) && purge_queues_empty() );
+
+    // Without a purge thread, the free purges what it queued itself.
+    test_purge_large();
+    SM_ASSERT( purge_queues_empty() );
+
+    sm_set_purge_mode( SM_PURGE_INLINE );
+    SM_ASSERT( !purge_deferred() );
+
+    test_purge_budget_large();
+
+    sm_set_purge_decay( 3600 * 1000 );
+    SM_ASSERT( purge_decay_enabled() );
+    test_purge_decay_large();
+    small_test_purge_decay();
+
+    // The purge thread runs the passes by itself.
+    sm_set_purge_mode( SM_PURGE_BACKGROUND_THREAD );
+    sm_set_purge_decay( 8 );
+    sm_purge_stats before, after;
+    void*          x = large_malloc( 8 * pagesize );
+    sm_get_purge_stats( &before );
+    large_free( x );
+    do
+    {
+        sched_yield();
+        sm_get_purge_stats( &after );
+    } while( after.purged_pages == before.purged_pages );
+
+    sm_set_purge_decay( 0 );
+    sm_set_purge_mode( SM_PURGE_INLINE );
+    SM_ASSERT( !purge_decay_enabled() );
+    sm_set_large_retained_bytes( SM_LARGE_RETAINED_BYTES );
+#endif
+}
+#endif
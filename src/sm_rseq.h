@@ -0,0 +1,174 @@
+#pragma once
+
+// Restartable sequences (Linux >= 4.18) for the per-CPU caches.
+//
+// A restartable sequence is a short piece of code that the kernel
+// restarts (by jumping to an abort handler) if the thread is preempted,
+// migrated or signalled while executing it.  If the last instruction of
+// the sequence is a single store (the commit), then everything up to
+// and including that store happens atomically with respect to every
+// other thread running on the same CPU.  That lets us push onto and pop
+// from per-CPU stacks with plain loads and stores.
+//
+// glibc (2.35 and later) registers an rseq area for every thread.  If
+// it did, we use that one; otherwise we register our own.  If neither
+// works (old kernel, seccomp, ...) sm_rseq_area() returns NULL and the
+// caller skips the per-CPU tier.
+
+#include "sm_config.h"
+
+#if SM_CPU_CACHE
+
+#include <linux/rseq.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "sm_assert.h"
+
+#define SM_RSEQ_SIG 0x53053053
+
+// Provided by glibc 2.35+.  Weak, so that we still link (and fall back
+// to registering our own area) against older C libraries.
+extern const ptrdiff_t    __rseq_offset __attribute__( ( weak ) );
+extern const unsigned int __rseq_size __attribute__( ( weak ) );
+
+static SM_ATTRIBUTE_THREAD struct rseq* sm_rseq_thread_area;
+static SM_ATTRIBUTE_THREAD int          sm_rseq_thread_state;    // 0 = not looked up yet, 1 = usable, -1 = unavailable
+static SM_ATTRIBUTE_THREAD struct rseq  sm_rseq_own_area SM_ALIGNED( 32 );
+
+static inline void*
+sm_thread_pointer( void )
+{
+    void* tp;
+    __asm__( "movq %%fs:0, %0" : "=r"( tp ) );
+    return tp;
+}
+
+static struct rseq*
+sm_rseq_register_slow( void )
+{
+    if( &__rseq_size != NULL && __rseq_size > 0 )
+    {
+        sm_rseq_thread_area = (struct rseq*) ( (char*) sm_thread_pointer() + __rseq_offset );
+    }
+    else
+    {
+        sm_rseq_own_area.cpu_id = RSEQ_CPU_ID_UNINITIALIZED;
+        if( syscall( __NR_rseq, &sm_rseq_own_area, sizeof( sm_rseq_own_area ), 0, SM_RSEQ_SIG ) == 0 )
+        {
+            sm_rseq_thread_area = &sm_rseq_own_area;
+        }
+    }
+    if( sm_rseq_thread_area != NULL && (int32_t) sm_rseq_thread_area->cpu_id >= 0 )
+    {
+        sm_rseq_thread_state = 1;
+        return sm_rseq_thread_area;
+    }
+    sm_rseq_thread_state = -1;
+    sm_rseq_thread_area  = NULL;
+    return NULL;
+}
+
+static inline struct rseq*
+sm_rseq_area( void )
+// Effect: Return this thread's registered rseq area, or NULL if restartable sequences can't be used.
+{
+    if( sm_rseq_thread_state > 0 ) return sm_rseq_thread_area;
+    if( sm_rseq_thread_state < 0 ) return NULL;
+    return sm_rseq_register_slow();
+}
+
+static inline uint32_t
+sm_rseq_cpu_start( struct rseq* rs )
+{
+    return *(volatile uint32_t*) &rs->cpu_id_start;
+}
+
+// The descriptor (struct rseq_cs) that tells the kernel where a sequence
+// starts, where it commits and where to go on abort.  The 4 bytes before
+// the abort handler must be the signature we registered with.
+#define SM_RSEQ_DEFINE_TABLE( label, start_ip, post_commit_ip, abort_ip )                                                        \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                                                                         \
+    ".balign 32\n\t" #label ":\n\t"                                                                                              \
+    ".long 0x0, 0x0\n\t"                                                                                                         \
+    ".quad " #start_ip ", (" #post_commit_ip " - " #start_ip "), " #abort_ip "\n\t"                                              \
+    ".popsection\n\t"
+
+#define SM_RSEQ_DEFINE_ABORT( label, abort_label )                                                                               \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                                                                                    \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                                                                                 \
+    ".long 0x53053053\n\t" #label ":\n\t"                                                                                        \
+    "jmp %l[" #abort_label "]\n\t"                                                                                               \
+    ".popsection\n\t"
+
+typedef enum
+{
+    SM_RSEQ_OK,
+    SM_RSEQ_FULL_OR_EMPTY,
+    SM_RSEQ_ABORTED
+} sm_rseq_result;
+
+static inline sm_rseq_result
+sm_rseq_stack_push( struct rseq* rs, uint32_t cpu, uint64_t* top, void** slots, uint64_t capacity, void* obj )
+// Effect: If we are still running on cpu and *top < capacity, then slots[*top] = obj and ++*top, as one step with respect to
+//  everything else running on that cpu.
+{
+    __asm__ __volatile__ goto( SM_RSEQ_DEFINE_TABLE( 3, 1f, 2f, 4f )    //
+                               "leaq 3b(%%rip), %%rax\n\t"
+                               "movq %%rax, %[rseq_cs]\n\t"
+                               "1:\n\t"
+                               "cmpl %[cpu], %[current_cpu]\n\t"
+                               "jnz 4f\n\t"
+                               "movq %[top], %%rax\n\t"
+                               "cmpq %[capacity], %%rax\n\t"
+                               "jae %l[full]\n\t"
+                               "movq %[obj], (%[slots], %%rax, 8)\n\t"
+                               "addq $1, %%rax\n\t"
+                               "movq %%rax, %[top]\n\t"    // commit
+                               "2:\n\t" SM_RSEQ_DEFINE_ABORT( 4, aborted )
+                               :
+                               : [cpu] "r"( cpu ), [current_cpu] "m"( rs->cpu_id ), [rseq_cs] "m"( rs->rseq_cs ), [top] "m"( *top ),
+                                 [capacity] "r"( capacity ), [slots] "r"( slots ), [obj] "r"( obj )
+                               : "memory", "cc", "rax"
+                               : aborted, full );
+    return SM_RSEQ_OK;
+aborted:
+    return SM_RSEQ_ABORTED;
+full:
+    return SM_RSEQ_FULL_OR_EMPTY;
+}
+
+static inline sm_rseq_result
+sm_rseq_stack_pop( struct rseq* rs, uint32_t cpu, uint64_t* top, void** slots, void** result )
+// Effect: If we are still running on cpu and *top > 0, then --*top and *result = slots[*top], as one step with respect to
+//  everything else running on that cpu.
+{
+    __asm__ __volatile__ goto( SM_RSEQ_DEFINE_TABLE( 3, 1f, 2f, 4f )    //
+                               "leaq 3b(%%rip), %%rax\n\t"
+                               "movq %%rax, %[rseq_cs]\n\t"
+                               "1:\n\t"
+                               "cmpl %[cpu], %[current_cpu]\n\t"
+                               "jnz 4f\n\t"
+                               "movq %[top], %%rax\n\t"
+                               "testq %%rax, %%rax\n\t"
+                               "jz %l[empty]\n\t"
+                               "subq $1, %%rax\n\t"
+                               "movq (%[slots], %%rax, 8), %%rdx\n\t"
+                               "movq %%rdx, (%[result])\n\t"
+                               "movq %%rax, %[top]\n\t"    // commit
+                               "2:\n\t" SM_RSEQ_DEFINE_ABORT( 4, aborted )
+                               :
+                               : [cpu] "r"( cpu ), [current_cpu] "m"( rs->cpu_id ), [rseq_cs] "m"( rs->rseq_cs ), [top] "m"( *top ),
+                                 [slots] "r"( slots ), [result] "r"( result )
+                               : "memory", "cc", "rax", "rdx"
+                               : aborted, empty );
+    return SM_RSEQ_OK;
+aborted:
+    return SM_RSEQ_ABORTED;
+empty:
+    return SM_RSEQ_FULL_OR_EMPTY;
+}
+
+#endif    // SM_CPU_CACHE
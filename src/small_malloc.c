@@ -1,6 +1,9 @@
 #if defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #endif
+#include <stddef.h>
 
 #include "atomically.h"
 #include "generated_constants.hxx"
@@ -8,8 +11,77 @@
 #include "sm_atomic.h"
 #include "sm_internal.h"
 #include "sm_platform.h"
+#include "supermalloc.h"
 
-static lock_t small_locks[first_large_bin_number] = { REPEAT_FOR_SMALL_BINS( SM_LOCK_INITIALIZER ) };
+// The small bins can be split into SM_SMALL_SHARDS shards (see sm_config.h), each with its own dsbi, locks, dirty stacks and
+// stash.  A thread allocates from its shard, which is the one for the CPU it runs on (looked up again every
+// shard_refresh_interval calls, like the CPU number in sm_large_malloc.c), or one picked by hashing the thread.  A chunk
+// belongs to the shard that allocated it, which is recorded in its chunk_infos entry, and a free goes back to the chunk's
+// shard, whichever thread does it.
+_Static_assert( SM_SMALL_SHARDS >= 1 && SM_SMALL_SHARDS <= 64, "a uint64_t must have a bit per shard" );
+
+static lock_t small_locks[SM_SMALL_SHARDS][first_large_bin_number] = { { REPEAT_FOR_SMALL_BINS( SM_LOCK_INITIALIZER ) } };
+
+#if SM_SMALL_SHARDS > 1
+enum
+{
+    shard_refresh_interval = 128
+};
+
+static SM_ATTRIBUTE_THREAD struct
+{
+    uint32_t shard;
+    uint32_t countdown;    // Calls until we look up the shard again.
+} thread_shard;
+
+static uint32_t
+small_pick_shard( void )
+{
+#if SM_SMALL_SHARD_BY_CPU
+    int cpu = sched_getcpu();
+    if( cpu >= 0 ) return (uint32_t) cpu % SM_SMALL_SHARDS;
+#endif
+    // Thread-local variables of different threads are at different addresses.
+    uint64_t h = (uint64_t) (uintptr_t) &thread_shard * 0x9e3779b97f4a7c15ull;
+    return (uint32_t) ( ( h >> 32 ) % SM_SMALL_SHARDS );
+}
+#endif
+
+static inline uint32_t
+small_thread_shard( void )
+// Effect: Return the shard that this thread allocates from.
+{
+#if SM_SMALL_SHARDS > 1
+    if( thread_shard.countdown-- == 0 )
+    {
+        thread_shard.shard     = small_pick_shard();
+        thread_shard.countdown = shard_refresh_interval;
+    }
+    return thread_shard.shard;
+#else
+    return 0;
+#endif
+}
+
+static inline uint32_t
+small_chunk_shard( const void* p )
+// Effect: Return the shard that owns the small chunk that p points into.  Small chunks have no size, so the size bits of their
+//  bin_and_size hold the shard (see small_malloc_add_chunk()).
+{
+#if SM_SMALL_SHARDS > 1
+    return chunk_infos[address_2_chunknumber( p )].bin_and_size >> 8;
+#else
+    (void) p;
+    return 0;
+#endif
+}
+
+enum
+{
+    // Each bin has objects_per_folio + 2 dsbi lists.
+    dsbi_nonempty_n_words = ( max_objects_per_folio + 2 + 63 ) / 64
+};
+_Static_assert( dsbi_nonempty_n_words <= 64, "the summary word must cover every word of the nonempty bitmap" );
 
 typedef struct DynamicSmallBinInfo
 {
@@ -33,116 +105,624 @@ typedef struct DynamicSmallBinInfo
     // penultimate slot (number 512), and the madvised' pages in slot
     // 513.
 
-    // We will also eventually provide a way for a separate thread to
-    // actually do the madvising so that it won't slow down the thread
-    // that is doing malloc.  We'll do that by providing three modes:
+    // The madvising can be done by a separate thread, so that it won't
+    // slow down the thread that is doing free.  There are three modes
+    // (see sm_set_purge_mode() and sm_purge.c):
     //  [1] The madvise occurs in the free(), which introduces
     //      performance variance to the caller of free().
     //  [2] The madvise occurs in a separate thread which we manage.
-    //  [3] The madvise occurs in a thread the user creates using a
-    //      function that we create (for this one, we need to provide
-    //      some more synchronization so that the user thread can shut
-    //      us down if they want to.)
+    //  [3] The madvise occurs in a thread the user creates, which
+    //      calls sm_purge_thread_run() until sm_purge_thread_stop().
+    // With a purge half-life (sm_set_purge_decay()), every empty folio
+    // stays in slot 512 instead, and the decay passes madvise the
+    // oldest of them.
 
     _Atomic uint16_t fullest_offset[first_large_bin_number];
+
+    // Bit i of nonempty[bin].words is set if list i of bin is nonempty, and bit w of nonempty[bin].summary is set if
+    // nonempty[bin].words[w] is nonzero.  When the fullest list runs out we find the next one with a couple of
+    // count-trailing-zeros instead of walking up to objects_per_folio empty lists.
+    struct
+    {
+        uint64_t summary;
+        uint64_t words[dsbi_nonempty_n_words];
+    } nonempty[first_large_bin_number];
+
+    // The folio headers of a new chunk are initialized one at a time, as they are needed, so that a bin that uses only a few
+    // folios touches only a few header pages.  fresh[bin] is the newest chunk's first folio and how many of its folios have
+    // been initialized and put on the madvised list; the next one goes there when that list runs out (see
+    // dsbi_unlink_fullest()).  The rest are uncommitted, like the madvised ones.
+    struct
+    {
+        per_folio* folios;
+        uint16_t   n_initialized;
+    } fresh[first_large_bin_number];
+
+    // The committed empty folios of each bin (list objects_per_folio), which are pushed on the front: how many there are, the
+    // oldest (the last one), and the fraction of a folio that the decay passes owe (see do_small_decay_folios()).
+    struct
+    {
+        per_folio* oldest;
+        uint32_t   n;
+        uint32_t   decay_carry;
+    } retained[first_large_bin_number];
 } DynamicSmallBinInfo;
 
-static DynamicSmallBinInfo dsbi;
+static DynamicSmallBinInfo dsbi[SM_SMALL_SHARDS];
+
+static inline void
+dsbi_list_now_nonempty( uint32_t shard, binnumber_t bin, uint32_t list )
+{
+    dsbi[shard].nonempty[bin].words[list / 64] |= 1ull << ( list % 64 );
+    dsbi[shard].nonempty[bin].summary |= 1ull << ( list / 64 );
+}
+
+static inline void
+dsbi_list_now_empty( uint32_t shard, binnumber_t bin, uint32_t list )
+{
+    uint64_t w = dsbi[shard].nonempty[bin].words[list / 64] & ~( 1ull << ( list % 64 ) );
+    dsbi[shard].nonempty[bin].words[list / 64] = w;
+    if( w == 0 ) dsbi[shard].nonempty[bin].summary &= ~( 1ull << ( list / 64 ) );
+}
+
+static inline void
+dsbi_retained_pushed( uint32_t shard, binnumber_t bin, per_folio* pp )
+// Effect: pp was just pushed onto bin's list of committed empty folios.
+{
+    if( dsbi[shard].retained[bin].n++ == 0 ) dsbi[shard].retained[bin].oldest = pp;
+}
+
+static inline void
+dsbi_retained_popped( uint32_t shard, binnumber_t bin )
+// Effect: The first folio was just taken off bin's list of committed empty folios.
+{
+    if( --dsbi[shard].retained[bin].n == 0 ) dsbi[shard].retained[bin].oldest = NULL;
+}
+
+static inline uint32_t
+dsbi_first_nonempty_list( uint32_t shard, binnumber_t bin, uint32_t from )
+// Effect: Return the first nonempty list of bin numbered from or more, or UINT32_MAX if there is none.
+{
+    uint32_t w    = from / 64;
+    uint64_t bits = dsbi[shard].nonempty[bin].words[w] & ( UINT64_MAX << ( from % 64 ) );
+    if( bits ) return w * 64 + SM_BUILTIN_CTZ64( bits );
+    uint64_t summary = ( w + 1 < 64 ) ? dsbi[shard].nonempty[bin].summary & ( UINT64_MAX << ( w + 1 ) ) : 0;
+    if( summary == 0 ) return UINT32_MAX;
+    w = SM_BUILTIN_CTZ64( summary );
+    return w * 64 + SM_BUILTIN_CTZ64( dsbi[shard].nonempty[bin].words[w] );
+}
+
+// Lists of objects to free (the stash, and the batches given to
+// small_free_list()) are threaded through the first word of each
+// object, whose low 48 bits point at the next object.
+enum
+{
+    stash_pointer_bits = 48
+};
+static const uint64_t stash_pointer_mask = ( 1ull << stash_pointer_bits ) - 1;
+
+#if SM_SMALL_STASH
+// The stash: for each small bin, a lock-free stack of recently freed
+// objects that small_free() pushes onto and small_malloc() pops from
+// before going to the dsbi under small_locks[bin].  Objects in the
+// stash are still marked in use in their folio's bitmap, so a folio
+// with stashed objects is never madvised.
+//
+// The stack is threaded through the first word of each object: the low
+// 48 bits point at the next object and the high 16 bits hold the depth
+// of the stack below and including this object, which bounds the stash
+// without a separate counter.  The head carries a 16-bit tag that is
+// bumped on every update so that a pop that raced with a pop-push of the
+// same object (ABA) fails its compare-and-swap.
+//
+// When a push finds the stack at its capacity, the freeing thread
+// detaches the whole stack and frees it with one acquisition of the bin
+// lock (see small_free()).
+//
+// Each shard has its own stashes, and a thread uses its shard's, so a
+// stash may hold objects of other shards' chunks.  Flushing it frees each
+// object to the shard that owns it (see small_free_list()).
+static const uint64_t stash_tag_one = 1ull << stash_pointer_bits;
+
+typedef struct small_stash
+{
+    SM_ALIGNED( 64 ) _Atomic uint64_t head;
+} small_stash;
+
+static small_stash stash[SM_SMALL_SHARDS][first_large_bin_number];
+static uint64_t    stash_capacity[first_large_bin_number];
+
+static inline uint64_t
+stash_read_link( void* obj )
+{
+    // obj may have been popped by another thread, and even handed out and overwritten, since we read the head.
+    // Small chunks are never unmapped, so the read is safe; the tag check in the caller's compare-and-swap discards the value.
+    return atomic_load_explicit( (_Atomic uint64_t*) obj, memory_order_relaxed );
+}
+
+static inline void*
+stash_pop( uint32_t shard, binnumber_t bin )
+{
+    _Atomic uint64_t* head = &stash[shard][bin].head;
+    uint64_t          old  = atomic_load_explicit( head, memory_order_acquire );
+    while( true )
+    {
+        void* top = (void*) ( old & stash_pointer_mask );
+        if( top == NULL ) return NULL;
+        uint64_t next = stash_read_link( top ) & stash_pointer_mask;
+        if( atomic_compare_exchange_weak_explicit( head, &old, next | ( ( old & ~stash_pointer_mask ) + stash_tag_one ),
+                                                   memory_order_acquire, memory_order_acquire ) )
+        {
+            return top;
+        }
+    }
+}
+
+static inline bool
+stash_push( uint32_t shard, binnumber_t bin, void* obj )
+// Effect: Push obj onto the stash for bin.  Return false (and leave the stash alone) if the stash is full.
+{
+    _Atomic uint64_t* head = &stash[shard][bin].head;
+    uint64_t          old  = atomic_load_explicit( head, memory_order_relaxed );
+    while( true )
+    {
+        void*    top   = (void*) ( old & stash_pointer_mask );
+        uint64_t depth = top ? ( stash_read_link( top ) >> stash_pointer_bits ) + 1 : 1;
+        if( depth > stash_capacity[bin] )
+        {
+            // Either the stash is full, or we read a stale link; check which before giving up.
+            uint64_t now = atomic_load_explicit( head, memory_order_relaxed );
+            if( now == old ) return false;
+            old = now;
+            continue;
+        }
+        atomic_store_explicit( (_Atomic uint64_t*) obj, (uint64_t) top | ( depth << stash_pointer_bits ), memory_order_relaxed );
+        if( atomic_compare_exchange_weak_explicit( head, &old, (uint64_t) obj | ( ( old & ~stash_pointer_mask ) + stash_tag_one ),
+                                                   memory_order_release, memory_order_relaxed ) )
+        {
+            return true;
+        }
+    }
+}
+
+static inline bool
+stash_push_list( uint32_t shard, binnumber_t bin, void* list, uint64_t n )
+// Effect: Push the n objects on list (linked through stash links) onto the stash for bin in one step.  Return false (and
+//  leave the stash alone) if they don't all fit.
+{
+    _Atomic uint64_t* head = &stash[shard][bin].head;
+    uint64_t          old  = atomic_load_explicit( head, memory_order_relaxed );
+    void*             last = NULL;
+    while( true )
+    {
+        void*    top   = (void*) ( old & stash_pointer_mask );
+        uint64_t depth = top ? stash_read_link( top ) >> stash_pointer_bits : 0;
+        if( depth + n > stash_capacity[bin] )
+        {
+            uint64_t now = atomic_load_explicit( head, memory_order_relaxed );
+            if( now == old )
+            {
+                // A failed attempt may have hooked the list onto the stash; end it again for the caller.
+                if( last ) atomic_store_explicit( (_Atomic uint64_t*) last, 0, memory_order_relaxed );
+                return false;
+            }
+            old = now;
+            continue;
+        }
+        // Restamp the depths, and hook the last object to the current top.
+        void* obj = list;
+        for( uint64_t i = 0; i < n; i++ )
+        {
+            void* next = ( i + 1 < n ) ? (void*) ( *(uint64_t*) obj & stash_pointer_mask ) : top;
+            atomic_store_explicit( (_Atomic uint64_t*) obj, (uint64_t) next | ( ( depth + n - i ) << stash_pointer_bits ),
+                                   memory_order_relaxed );
+            last = obj;
+            obj  = next;
+        }
+        if( atomic_compare_exchange_weak_explicit( head, &old, (uint64_t) list | ( ( old & ~stash_pointer_mask ) + stash_tag_one ),
+                                                   memory_order_release, memory_order_relaxed ) )
+        {
+            return true;
+        }
+    }
+}
+
+static inline void*
+stash_take_all( uint32_t shard, binnumber_t bin )
+// Effect: Empty the stash for bin, returning the objects that were in it as a list linked through stash links.
+{
+    _Atomic uint64_t* head = &stash[shard][bin].head;
+    uint64_t          old  = atomic_load_explicit( head, memory_order_relaxed );
+    while( !atomic_compare_exchange_weak_explicit( head, &old, ( old & ~stash_pointer_mask ) + stash_tag_one, memory_order_acquire,
+                                                   memory_order_relaxed ) )
+    {
+    }
+    return (void*) ( old & stash_pointer_mask );
+}
+#endif
+
+enum
+{
+    // The free_count of a thread's active folio (see SM_ACTIVE_FOLIO below), which is on no dsbi list.
+    folio_owned = UINT16_MAX
+};
+
+// The remote_frees of a folio that isn't a thread's active folio.
+#define folio_remote_frees_closed ( (void*) 1 )
+
+// Dirty folios: the bitmap bit for an object is cleared without the bin
+// lock (see small_release_object()), which leaves the folio on a dsbi
+// list for fewer free slots than it really has.  The freeing thread
+// then pushes the folio onto a per-bin lock-free stack, and the next
+// thread that takes the bin lock (usually a malloc) pops the whole
+// stack and moves each folio to the list that matches its bitmap (see
+// do_small_sync_folios()).  Only the free that makes the folio dirty (see
+// per_folio::free_state) pushes it, so it is never on the stack twice.
+typedef struct small_dirty_folios
+{
+    SM_ALIGNED( 64 ) _Atomic( per_folio* ) head;
+} small_dirty_folios;
+
+static small_dirty_folios dirty_folios[SM_SMALL_SHARDS][first_large_bin_number];
+
+static inline bool
+folio_state_dirty( uint64_t free_state )
+{
+    return (uint32_t)( free_state >> 32 ) != (uint32_t) free_state;
+}
+
+static inline uint32_t
+folio_objects_in_use( per_folio* pp, uint64_t free_state )
+// Effect: Return the number of objects in use in pp, given a value of pp->free_state.
+{
+    return atomic_load_explicit( &pp->alloc_count, memory_order_relaxed ) - (uint32_t)( free_state >> 32 );
+}
+
+static inline void
+push_dirty_folio( uint32_t shard, binnumber_t bin, per_folio* pp )
+{
+    per_folio* old = atomic_load_explicit( &dirty_folios[shard][bin].head, memory_order_relaxed );
+    do
+    {
+        pp->dirty_next = old;
+    } while( !atomic_compare_exchange_weak_explicit( &dirty_folios[shard][bin].head, &old, pp, memory_order_release,
+                                                     memory_order_relaxed ) );
+}
+
+static inline bool
+small_bin_has_dirty_folios( uint32_t shard, binnumber_t bin )
+{
+    return atomic_load_explicit( &dirty_folios[shard][bin].head, memory_order_relaxed ) != NULL;
+}
+
+// A small chunk starts with the headers of its folios, packed static_bin_info[bin].folio_header_size bytes apart (a multiple of
+// the cache line size, and just big enough for a bitmap of objects_per_folio bits), in the bin's overhead pages.
+_Static_assert( offsetof( per_folio, inuse_bitmap ) == folio_bitmap_offset,
+                "generated_constants.hxx must be generated with the same per_folio (and configuration)" );
+
+static inline per_folio*
+small_chunk_folio( void* chunk, binnumber_t bin, uint32_t folio_num )
+// Effect: Return the header of folio number folio_num of the small chunk that starts at chunk.
+{
+    return (per_folio*) ( (char*) chunk + folio_num * static_bin_info[bin].folio_header_size );
+}
 
-typedef struct small_chunk_header
+static inline uint32_t
+small_folio_number( binnumber_t bin, per_folio* pp )
+// Effect: Return the number of the folio whose header is pp within its chunk.
 {
-    per_folio ll
-        [512];    // This object is 16 pages long, but we don't use that much unless there are lots of folios in a chunk.  We don't use the last the array.  We could get it down to fewer pages if we packed it, but we want this to be
-    //                 //  cached-aligned.  Also for larger objects we could use fewer pages since there are fewer objects per folio.
-} small_chunk_header;
-//const uint64_t n_pages_wasted = sizeof(small_chunk_header)/pagesize;
-//const uint64_t n_pages_used   = (chunksize/pagesize)-n_pages_wasted;
+    return (uint32_t) ( ( offset_in_chunk( pp ) * static_bin_info[bin].folio_header_division_multiply_magic ) >> 32 );
+}
 
 static inline void
 verify_small_invariants()
 {
     return;
+    const uint32_t shard = 0;
     {
-        sm_lock( &small_locks[27] );
-        if( 0 && dsbi.fullest_offset[27] == 0 )
+        sm_lock( &small_locks[shard][27] );
+        if( 0 && dsbi[shard].fullest_offset[27] == 0 )
         {
-            for( unsigned int i = 1; i < static_bin_info[27].objects_per_folio; i++ ) { SM_ASSERT( dsbi.lists.b27[i] == NULL ); }
+            for( unsigned int i = 1; i < static_bin_info[27].objects_per_folio; i++ )
+            {
+                SM_ASSERT( dsbi[shard].lists.b27[i] == NULL );
+            }
         }
-        sm_unlock( &small_locks[27] );
+        sm_unlock( &small_locks[shard][27] );
     }
 
     for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
     {
-        sm_lock( &small_locks[bin] );
-        uint16_t            fullest_off = dsbi.fullest_offset[bin];
+        sm_lock( &small_locks[shard][bin] );
+        uint16_t            fullest_off = dsbi[shard].fullest_offset[bin];
         int                 start       = dynamic_small_bin_offset( bin );
         objects_per_folio_t opp         = static_bin_info[bin].objects_per_folio;
         if( fullest_off == 0 )
         {
-            for( uint16_t i = 1; i <= opp; i++ ) { SM_ASSERT( dsbi.lists.b[start + i] == NULL ); }
+            for( uint16_t i = 1; i <= opp; i++ ) { SM_ASSERT( dsbi[shard].lists.b[start + i] == NULL ); }
         }
         else
         {
             SM_ASSERT( fullest_off <= opp );
-            SM_ASSERT( dsbi.lists.b[start + fullest_off] != NULL );
-            for( uint16_t i = 1; i < fullest_off; i++ ) { SM_ASSERT( dsbi.lists.b[start + i] == NULL ); }
+            SM_ASSERT( dsbi[shard].lists.b[start + fullest_off] != NULL );
+            for( uint16_t i = 1; i < fullest_off; i++ ) { SM_ASSERT( dsbi[shard].lists.b[start + i] == NULL ); }
+        }
+        for( uint16_t i = 0; i < opp + 2; i++ )
+        {
+            SM_ASSERT( ( ( dsbi[shard].nonempty[bin].words[i / 64] >> ( i % 64 ) ) & 1 )
+                       == ( dsbi[shard].lists.b[start + i] != NULL ) );
         }
         for( uint16_t i = 0; i <= opp; i++ )
         {
             per_folio* prev_pp = NULL;
-            for( per_folio* pp = dsbi.lists.b[start + i]; pp; pp = pp->next )
+            for( per_folio* pp = dsbi[shard].lists.b[start + i]; pp; pp = pp->next )
             {
                 SM_ASSERT( prev_pp == pp->prev );
-                prev_pp      = pp;
-                uint64_t sum = 0;
-                for( uint32_t j = 0; j < folio_bitmap_n_words; j++ ) { sum += SM_BUILTIN_POPCOUNT64( pp->inuse_bitmap[j] ); }
-                SM_ASSERT( sum == opp - i );
+                SM_ASSERT( pp->free_count == i );
+                prev_pp = pp;
+                // Read the count first: a concurrent free clears its bit before it is counted.
+                uint32_t in_use = folio_objects_in_use( pp, atomic_load( &pp->free_state ) );
+                uint64_t sum    = 0;
+                for( uint32_t j = 0; j < ceil32( opp, 64 ); j++ ) { sum += SM_BUILTIN_POPCOUNT64( pp->inuse_bitmap[j] ); }
+                // Frees that haven't been synced yet can only make the folio emptier than its list says.
+                SM_ASSERT( sum <= (uint32_t) ( opp - i ) );
+                SM_ASSERT( sum <= in_use && in_use <= (uint32_t) ( opp - i ) );
             }
         }
-        sm_unlock( &small_locks[bin] );
+        sm_unlock( &small_locks[shard][bin] );
     }
 }
 
+static void
+small_init_folio( binnumber_t bin, per_folio* pp )
+// Effect: Initialize the header of a folio that has never been used.
+{
+    for( uint32_t w = 0; w < ceil32( static_bin_info[bin].objects_per_folio, 64 ); w++ ) { pp->inuse_bitmap[w] = 0; }
+    pp->prev        = NULL;
+    pp->next        = NULL;
+    pp->free_count  = static_bin_info[bin].objects_per_folio;
+    pp->purged      = false;
+    pp->alloc_count = 0;
+    pp->free_state  = 0;
+    pp->dirty_next  = NULL;
+#if SM_ACTIVE_FOLIO
+    pp->remote_frees = folio_remote_frees_closed;
+#endif
+}
+
 static bool
-do_small_malloc_add_pages_from_new_chunk( binnumber_t bin, uint32_t dsbi_offset, small_chunk_header* sch )
+dsbi_add_fresh_folio( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset )
+// Effect: If the newest chunk of bin has a folio we haven't used yet, initialize it and put it on the madvised list, and return
+//  true.  Otherwise return false.
 {
-    folios_per_chunk_t  folios_per_chunk = static_bin_info[bin].folios_per_chunk;
-    objects_per_folio_t o_per_folio      = static_bin_info[bin].objects_per_folio;
-    // The "+ 1" in the lines below is to arrange to add the new folkos
-    // to the madvise_done list.  Initially, those folios are
-    // uncommitted.
-    per_folio* old_h                            = dsbi.lists.b[dsbi_offset + o_per_folio + 1];
-    dsbi.lists.b[dsbi_offset + o_per_folio + 1] = &sch->ll[0];
-    sch->ll[folios_per_chunk - 1].next          = old_h;
-    if( dsbi.fullest_offset[bin] == 0 )
+    if( dsbi[shard].fresh[bin].folios == NULL || dsbi[shard].fresh[bin].n_initialized == static_bin_info[bin].folios_per_chunk )
+        return false;
+    uint32_t   madvised = static_bin_info[bin].objects_per_folio + 1;
+    per_folio* pp       = small_chunk_folio( dsbi[shard].fresh[bin].folios, bin, dsbi[shard].fresh[bin].n_initialized++ );
+    small_init_folio( bin, pp );
+    per_folio* old_h = dsbi[shard].lists.b[dsbi_offset + madvised];
+    pp->next         = old_h;
+    if( old_h ) { old_h->prev = pp; }
+    dsbi[shard].lists.b[dsbi_offset + madvised] = pp;
+    dsbi_list_now_nonempty( shard, bin, madvised );
+    return true;
+}
+
+static bool
+do_small_malloc_add_pages_from_new_chunk( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, void* chunk )
+{
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    // If another thread added a chunk at the same time, the previous chunk may still have fresh folios.  That's rare, so we just
+    // put all of them on the list now.
+    while( dsbi_add_fresh_folio( shard, bin, dsbi_offset ) ) {}
+    // Add the new folios to the madvise_done list, since initially they are uncommitted.  Only the first one is there to begin
+    // with.
+    dsbi[shard].fresh[bin].folios        = small_chunk_folio( chunk, bin, 0 );
+    dsbi[shard].fresh[bin].n_initialized = 0;
+    dsbi_add_fresh_folio( shard, bin, dsbi_offset );
+    if( dsbi[shard].fullest_offset[bin] == 0 )
     {    // must test this again here.
         // Even if the fullest slot is actually in o_per_folio+1, we say it's in o_per_folio.
-        dsbi.fullest_offset[bin] = o_per_folio;
+        dsbi[shard].fullest_offset[bin] = o_per_folio;
     }
     return true;    // cannot have the return type with void, since atomically wants to store the return type and then return it.
 }
 
-SM_DECLARE_ATOMIC_OPERATION( small_malloc_add_pages_from_new_chunk, do_small_malloc_add_pages_from_new_chunk, bool, binnumber_t,
-                             uint32_t, small_chunk_header* );
+SM_DECLARE_ATOMIC_OPERATION( small_malloc_add_pages_from_new_chunk, do_small_malloc_add_pages_from_new_chunk, bool, uint32_t,
+                             binnumber_t, uint32_t, void* );
 
-static void*
-do_small_malloc( binnumber_t bin, uint32_t dsbi_offset, uint32_t o_size )
-// Effect: If there is one get an object out of the fullest nonempty page, and return it.
-//    If there is no such object return NULL.
-//    (Previously, we made sure there was something in a nonempty page, but
-//    another thread may have grabbed it.)
+static per_folio*
+small_folio_objects_freed( uint32_t shard, binnumber_t bin, per_folio* pp, uint32_t old_count, uint32_t n_freed,
+                           uint32_t dsbi_offset )
+// Effect: n_freed bits have been cleared in the folio pp, which had old_count objects in use according to its dsbi list.  Move
+// pp to the dsbi list for its new number of free slots.  Returns NULL or else pp, if it is now empty and should be madvised (in
+// which case it is on no list).
 {
-    uint32_t fullest = dsbi.fullest_offset[bin];
-    if( fullest == 0 ) return NULL;    // Indicating that a chunk must be allocated.
+    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    if( IS_TESTING ) SM_ASSERT( old_count > 0 && old_count <= o_per_folio && n_freed > 0 && n_freed <= old_count );
 
+    uint32_t old_offset_within = o_per_folio - old_count;
+    uint32_t new_offset_within = old_offset_within + n_freed;
+    uint32_t old_offset_dsbi   = dsbi_offset + old_offset_within;
+    uint32_t new_offset        = old_offset_dsbi + n_freed;
+    if( IS_TESTING ) SM_ASSERT( pp->free_count == old_offset_within );
+    pp->free_count = new_offset_within;
+
+    // remove from old list
+    per_folio* pp_next = pp->next;
+    per_folio* pp_prev = pp->prev;
+    if( pp_prev == NULL )
+    {
+        SM_ASSERT( dsbi[shard].lists.b[old_offset_dsbi] == pp );
+        dsbi[shard].lists.b[old_offset_dsbi] = pp_next;
+        if( pp_next == NULL ) dsbi_list_now_empty( shard, bin, old_offset_within );
+    }
+    else { pp_prev->next = pp_next; }
+    if( pp_next != NULL ) { pp_next->prev = pp_prev; }
+    // Fix up the old_count
+    uint32_t fullest = dsbi[shard].fullest_offset[bin];
+    if( old_offset_within == 0 )
+    {
+        if( fullest == 0 || new_offset_within < fullest ) { dsbi[shard].fullest_offset[bin] = new_offset_within; }
+    }
+    else if( fullest == old_offset_within && dsbi[shard].lists.b[old_offset_dsbi] == NULL )
+    {
+        // When we free more than one object, there may be a nonempty list between the old one and the new one.
+        uint32_t new_fullest            = dsbi_first_nonempty_list( shard, bin, old_offset_within + 1 );
+        dsbi[shard].fullest_offset[bin] = new_fullest < new_offset_within ? new_fullest : new_offset_within;
+    }
+    // Add to new list
+    SM_ASSERT( new_offset < dsbi_offset + o_per_folio + 1 );
+    if( new_offset != dsbi_offset + o_per_folio || dsbi[shard].lists.b[new_offset] == NULL || purge_decay_enabled() )
+    {
+        // Don't madvise the folio, since either it's not empty or there are no folios in the empty slot.
+        // Even if the folio is empty, we want to keep one folio around without madvising() it
+        //  in order to have some hysteresis in the madvise()/commit cycle.  With decay we keep them all, and the decay
+        //  passes madvise them.
+        per_folio* new_next = dsbi[shard].lists.b[new_offset];
+        pp->prev            = NULL;
+        pp->next            = new_next;
+        if( new_next ) { new_next->prev = pp; }
+        dsbi[shard].lists.b[new_offset] = pp;
+        dsbi_list_now_nonempty( shard, bin, new_offset_within );
+        if( new_offset_within == o_per_folio ) dsbi_retained_pushed( shard, bin, pp );
+        return NULL;
+    }
+    else
+    {
+        // Ask the caller madvise the folio (by returning the pp) and add
+        // it to the slot later.
+        //
+        // The fullest_offset is still correct, because we do this only if
+        // there is something in the new_offset.
+        return pp;
+    }
+}
+
+static per_folio*
+do_small_sync_folios( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset )
+// Effect: Move every dirty folio in bin to the dsbi list for the number of free slots its bitmap has now.  Return the folios
+//  that must be madvised, linked through their next fields.
+{
+    uint16_t   o_per_folio = static_bin_info[bin].objects_per_folio;
+    per_folio* madvise_us  = NULL;
+    per_folio* pp          = atomic_exchange_explicit( &dirty_folios[shard][bin].head, NULL, memory_order_acquire );
+    while( pp )
+    {
+        // Once we make pp clean, a free can push it again, so read the link first.  A free counted in free_state before we
+        // make it clean is counted below; one counted after it will push pp again.
+        per_folio* next  = pp->dirty_next;
+        uint64_t   state = atomic_load_explicit( &pp->free_state, memory_order_relaxed );
+        while( !atomic_compare_exchange_weak_explicit( &pp->free_state, &state, ( state & ~0xffffffffull ) | ( state >> 32 ),
+                                                       memory_order_acquire, memory_order_relaxed ) )
+        {
+        }
+        // An active folio is on no list.  Its owner puts it on the right one when it lets go of it.
+        if( pp->free_count != folio_owned )
+        {
+            uint32_t old_count = o_per_folio - pp->free_count;
+            uint32_t count     = folio_objects_in_use( pp, state );
+            if( IS_TESTING ) SM_ASSERT( count <= old_count );
+            if( count < old_count )
+            {
+                per_folio* madvise_me = small_folio_objects_freed( shard, bin, pp, old_count, old_count - count, dsbi_offset );
+                if( madvise_me )
+                {
+                    madvise_me->next = madvise_us;
+                    madvise_us       = madvise_me;
+                }
+            }
+        }
+        pp = next;
+    }
+    return madvise_us;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_sync_folios, do_small_sync_folios, per_folio*, uint32_t, binnumber_t, uint32_t );
+
+bool
+small_free_post_madvise( uint32_t shard, binnumber_t bin, per_folio* pp, uint32_t total_dsbi_offset )
+// Effect: After calling madvise to clear a folio, put the folio into the free list.
+//  The pp is a per-folio linked-list element stored at the beginning of the chunk.
+//  The total_dsbi_offset is the offset that corresponds to the list of completely
+//  free folios.
+{
+    uint16_t   o_per_folio = static_bin_info[bin].objects_per_folio;
+    per_folio* new_next    = dsbi[shard].lists.b[total_dsbi_offset];
+    pp->prev               = NULL;
+    pp->next               = new_next;
+    if( new_next ) { new_next->prev = pp; }
+    dsbi[shard].lists.b[total_dsbi_offset] = pp;
+    dsbi_list_now_nonempty( shard, bin, o_per_folio + 1 );
+    // The committed empty folios may have run out since pp was taken off the lists.
+    if( dsbi[shard].fullest_offset[bin] == 0 ) dsbi[shard].fullest_offset[bin] = o_per_folio;
+    return true;    // cannot return void from a templated function.
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_free_post_madvise, small_free_post_madvise, bool, uint32_t, binnumber_t, per_folio*,
+                             uint32_t );
+
+void
+small_purge_folio( per_folio* pp )
+// Effect: Madvise the empty folio pp, which small_folio_objects_freed() kept out of the dsbi lists, and then put it in the
+//  madvised slot.
+{
+    // We are the only one that holds this page (it is empty, so no
+    // other thread could free an object into it, and we kept it out
+    // of the dsbi lists, so no other thread can try to allocate out
+    // of it.)
+    binnumber_t         bin             = bin_from_bin_and_size( chunk_infos[address_2_chunknumber( pp )].bin_and_size );
+    uint32_t            shard           = small_chunk_shard( pp );
+    void*               chunk           = address_2_chunkaddress( pp );
+    uint64_t            folio_num       = small_folio_number( bin, pp );
+    uint64_t            folio_size      = static_bin_info[bin].folio_size;
+    uint64_t            wasted_offset   = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+    uint64_t            madvise_address = (uint64_t) chunk + wasted_offset + folio_num * folio_size;
+    madvise( (void*) madvise_address, folio_size, MADV_DONTNEED );
+    pp->purged = true;
+    purge_count_purged( folio_size / pagesize );
+    // Now put it back into the list.
+    // Doing this will not change the fullest offset, since this is fully empty.
+    // Cannot quite do this with a compare-and-swap since we have to update dsbi.lists[new_offset] as well as the prev pointer
+    // in whatever is there.
+    SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_free_post_madvise, shard, bin, pp,
+                                dynamic_small_bin_offset( bin ) + static_bin_info[bin].objects_per_folio + 1 );
+}
+
+static void
+small_madvise_folios( per_folio* madvise_us )
+// Effect: Madvise the folios on the list madvise_us, or hand them to the purge thread.  With decay, the list is empty, but
+//  we may just have retained a folio.
+{
+    if( purge_decay_enabled() ) purge_retained();
+    if( madvise_us && purge_deferred() )
+    {
+        per_folio* tail = madvise_us;
+        while( tail->next ) tail = tail->next;
+        purge_enqueue_folios( madvise_us, tail );
+        return;
+    }
+    while( madvise_us )
+    {
+        per_folio* next = madvise_us->next;
+        small_purge_folio( madvise_us );
+        madvise_us = next;
+    }
+}
+
+static per_folio*
+dsbi_unlink_fullest( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, uint32_t fullest )
+// Effect: Remove the first folio from the list for fullest (which must be bin's fullest_offset, and nonzero) and return it.  The
+//  caller must fix up fullest_offset.
+{
     uint16_t   o_per_folio  = static_bin_info[bin].objects_per_folio;
     uint32_t   fetch_offset = fullest;
-    per_folio* result_pp    = dsbi.lists.b[dsbi_offset + fetch_offset];
+    per_folio* result_pp    = dsbi[shard].lists.b[dsbi_offset + fetch_offset];
     if( fullest == o_per_folio && result_pp == NULL )
     {
         // Special case, get stuff from the end.
         fetch_offset++;
-        result_pp = dsbi.lists.b[dsbi_offset + fetch_offset];
+        result_pp = dsbi[shard].lists.b[dsbi_offset + fetch_offset];
     }
 
     SM_ASSERT( result_pp );
@@ -152,65 +732,532 @@ do_small_malloc( binnumber_t bin, uint32_t dsbi_offset, uint32_t o_size )
     // When I did a study to try to figure out where most of the
     // transaction conflicts occure, it was here: this line is causing
     // most of the trouble because the fullest slot doesn't move much.
-    dsbi.lists.b[dsbi_offset + fetch_offset] = next;
+    dsbi[shard].lists.b[dsbi_offset + fetch_offset] = next;
 
     if( next ) { next->prev = NULL; }
+    else if( fetch_offset != o_per_folio + 1u || !dsbi_add_fresh_folio( shard, bin, dsbi_offset ) )
+    {
+        dsbi_list_now_empty( shard, bin, fetch_offset );
+    }
+    if( fetch_offset == o_per_folio ) dsbi_retained_popped( shard, bin );
+    else if( result_pp->purged )
+    {
+        result_pp->purged = false;
+        purge_count_refaulted( static_bin_info[bin].folio_size / pagesize );
+    }
+    return result_pp;
+}
 
-    // Add the item to the next list down.
-
-    per_folio* old_h_below = dsbi.lists.b[dsbi_offset + fullest - 1];
-    result_pp->next        = old_h_below;
-    if( old_h_below ) { old_h_below->prev = result_pp; }
-    dsbi.lists.b[dsbi_offset + fullest - 1] = result_pp;
+static void
+dsbi_find_fullest( uint32_t shard, binnumber_t bin )
+// Effect: Set bin's fullest_offset to the first nonempty list with a free slot (or 0 if there is none).
+{
+    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint32_t new_fullest = dsbi_first_nonempty_list( shard, bin, 1 );
+    if( new_fullest == UINT32_MAX ) new_fullest = 0;
+    // If the new fullest is the madvise-done pages then pretend
+    // that the fullest one is the madvise_needed slot.
+    else if( new_fullest == o_per_folio + 1u )
+        new_fullest = o_per_folio;
+    dsbi[shard].fullest_offset[bin] = new_fullest;
+}
 
-    // Must also figure out the new fullest.
-    if( fullest > 1 ) { dsbi.fullest_offset[bin] = fullest - 1; }
+static per_folio*
+do_small_decay_folios( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, uint32_t keep_q16 )
+// Effect: Take the oldest of bin's committed empty folios off their list, all but keep_q16/65536 of them, and return them
+//  linked through their next fields, for the caller to madvise.  The fraction of a folio that this leaves over is owed by the
+//  next pass, so that a bin with just a few empty folios decays too.
+{
+    uint16_t o_per_folio                  = static_bin_info[bin].objects_per_folio;
+    uint64_t owed                         = (uint64_t) dsbi[shard].retained[bin].n * ( 65536 - keep_q16 )
+                                            + dsbi[shard].retained[bin].decay_carry;
+    uint32_t n_purge                      = (uint32_t) ( owed >> 16 );
+    dsbi[shard].retained[bin].decay_carry = owed & 0xffff;
+    if( n_purge == 0 ) return NULL;
+    // The list is newest first, so the ones to purge are at its end.
+    per_folio* purge_us = dsbi[shard].retained[bin].oldest;
+    for( uint32_t i = 1; i < n_purge; i++ ) purge_us = purge_us->prev;
+    per_folio* newest_kept           = purge_us->prev;
+    dsbi[shard].retained[bin].oldest = newest_kept;
+    dsbi[shard].retained[bin].n -= n_purge;
+    if( newest_kept ) newest_kept->next = NULL;
     else
     {
-        // It was the last item in the page, so we must look to see if we have any other pages.
-        int use_new_fullest = 0;
-        for( uint32_t new_fullest = 1; new_fullest < o_per_folio + 2u; new_fullest++ )
+        dsbi[shard].lists.b[dsbi_offset + o_per_folio] = NULL;
+        dsbi_list_now_empty( shard, bin, o_per_folio );
+        if( dsbi[shard].fullest_offset[bin] == o_per_folio ) dsbi_find_fullest( shard, bin );
+    }
+    return purge_us;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_decay_folios, do_small_decay_folios, per_folio*, uint32_t, binnumber_t, uint32_t, uint32_t );
+
+void
+small_decay_folios( uint32_t keep_q16 )
+// Effect: Madvise the oldest committed empty folios of every bin, so that keep_q16/65536 of them stay committed.
+{
+    for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+    {
+        for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
         {
-            if( dsbi.lists.b[dsbi_offset + new_fullest] )
+            if( dsbi[shard].retained[bin].n == 0 ) continue;    // Racy, but the next pass will see it.
+            per_folio* purge_us = SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_decay_folios, shard, bin,
+                                                              dynamic_small_bin_offset( bin ), keep_q16 );
+            while( purge_us )
             {
-                // If the new fullest is the madvise-done pages then pretend
-                // that the fullest one is the madvise_needed slot.
-                if( new_fullest == o_per_folio + 1u ) new_fullest = o_per_folio;
-                use_new_fullest = new_fullest;
-                break;
+                per_folio* next = purge_us->next;
+                small_purge_folio( purge_us );
+                purge_us = next;
             }
         }
-        dsbi.fullest_offset[bin] = use_new_fullest;
     }
+}
+
+static inline uint64_t
+small_folio_address( binnumber_t bin, per_folio* pp )
+// Effect: Return the address of the first object in the folio that pp describes.
+{
+    uint64_t chunk_address = (uint64_t) address_2_chunkaddress( pp );
+    uint64_t wasted_off    = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+    uint64_t folio_num     = small_folio_number( bin, pp );
+    uint64_t folio_size    = static_bin_info[bin].folio_size;
+    return chunk_address + wasted_off + folio_num * folio_size;
+}
 
-    // Now set the bitmap
-    uint32_t w_max = ceil32( static_bin_info[bin].objects_per_folio, 64 );
-    for( uint32_t w = 0; w < w_max; w++ )
+static per_folio*
+small_object_folio( void* p, binnumber_t bin, uint64_t* objnum )
+// Effect: Return the folio that holds the small object p, and set *objnum to p's index within that folio.
+{
+    void*               chunk         = address_2_chunkaddress( p );
+    uint64_t            wasted_offset = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+    uint64_t            useful_offset = offset_in_chunk( p ) - wasted_offset;
+    SM_ASSERT( (uint64_t) p >= wasted_offset );
+    uint32_t   folio_num  = divide_offset_by_foliosize( (uint32_t) useful_offset, bin );
+    per_folio* pp         = small_chunk_folio( chunk, bin, folio_num );
+    uint32_t   folio_size = (uint32_t) static_bin_info[bin].folio_size;
+    SM_ASSERT( useful_offset <= UINT32_MAX );
+    uint32_t offset_in_folio = (uint32_t) useful_offset - folio_num * folio_size;
+    *objnum                  = divide_offset_by_objsize( offset_in_folio, bin );
+    if( IS_TESTING )
     {
-        uint64_t bw = result_pp->inuse_bitmap[w];
-        if( bw != UINT64_MAX )
+        uint64_t o_size  = static_bin_info[bin].object_size;
+        uint64_t objnum2 = offset_in_folio / o_size;
+        SM_ASSERT( *objnum == objnum2 );
+    }
+    return pp;
+}
+
+static inline void
+folio_clear_inuse_bit( per_folio* pp, uint64_t objnum )
+{
+    uint64_t bit      = 1ull << ( objnum % 64 );
+    uint64_t old_bits = atomic_fetch_and( &pp->inuse_bitmap[objnum / 64], ~bit );
+    SM_ASSERT( old_bits & bit );
+    (void) old_bits;
+}
+
+// Finding a word of a folio's bitmap with a clear bit.  In the bins with
+// many objects per folio (8 words for bin 0, 32 for bin 1) most of the
+// search of a nearly full folio is skipping full words, so when the CPU
+// has AVX2 or SSE4.1 (as init_small_malloc() finds out) we test 4 words
+// at a time, and only the last group word by word.  Frees may clear bits
+// while we look, but only the lock holder (or the active folio's owner)
+// sets them, so a word we find with a clear bit keeps it.
+enum
+{
+    folio_search_scalar,
+    folio_search_sse41,
+    folio_search_avx2
+};
+
+#if SM_SIMD_BITMAP_SEARCH || defined( TESTING )
+static uint8_t folio_search_level = folio_search_scalar;
+#endif
+
+static inline uint32_t
+folio_next_free_word_scalar( per_folio* pp, uint32_t w, uint32_t w_max )
+{
+    while( w < w_max && atomic_load_explicit( &pp->inuse_bitmap[w], memory_order_relaxed ) == UINT64_MAX ) w++;
+    return w;
+}
+
+#if SM_SIMD_BITMAP_SEARCH
+static SM_ATTRIBUTE_TARGET( "avx2" ) uint32_t
+folio_next_free_word_avx2( per_folio* pp, uint32_t w, uint32_t w_max )
+{
+    const __m256i ones = _mm256_set1_epi64x( -1 );
+    for( ; w + 4 <= w_max; w += 4 )
+    {
+        __m256i v    = _mm256_loadu_si256( (const __m256i*) (const void*) &pp->inuse_bitmap[w] );
+        int     full = _mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpeq_epi64( v, ones ) ) );
+        if( full != 0xf ) return w + sm_ctz32( ~(uint32_t) full );
+    }
+    return folio_next_free_word_scalar( pp, w, w_max );
+}
+
+static SM_ATTRIBUTE_TARGET( "sse4.1" ) uint32_t
+folio_next_free_word_sse41( per_folio* pp, uint32_t w, uint32_t w_max )
+{
+    const __m128i ones = _mm_set1_epi64x( -1 );
+    for( ; w + 4 <= w_max; w += 4 )
+    {
+        __m128i lo      = _mm_loadu_si128( (const __m128i*) (const void*) &pp->inuse_bitmap[w] );
+        __m128i hi      = _mm_loadu_si128( (const __m128i*) (const void*) &pp->inuse_bitmap[w + 2] );
+        int     full_lo = _mm_movemask_pd( _mm_castsi128_pd( _mm_cmpeq_epi64( lo, ones ) ) );
+        int     full_hi = _mm_movemask_pd( _mm_castsi128_pd( _mm_cmpeq_epi64( hi, ones ) ) );
+        int     full    = full_lo | ( full_hi << 2 );
+        if( full != 0xf ) return w + sm_ctz32( ~(uint32_t) full );
+    }
+    return folio_next_free_word_scalar( pp, w, w_max );
+}
+
+static uint8_t
+detect_folio_search_level( void )
+{
+#if defined( _MSC_VER ) && !defined( __clang__ )
+    int r[4];
+    __cpuid( r, 0 );
+    int max_leaf = r[0];
+    __cpuid( r, 1 );
+    bool sse41 = ( r[2] >> 19 ) & 1;
+    // AVX also needs the OS to save the YMM registers.
+    bool avx  = ( ( r[2] >> 27 ) & 1 ) && ( ( r[2] >> 28 ) & 1 ) && ( _xgetbv( 0 ) & 6 ) == 6;
+    bool avx2 = false;
+    if( avx && max_leaf >= 7 )
+    {
+        __cpuidex( r, 7, 0 );
+        avx2 = ( r[1] >> 5 ) & 1;
+    }
+#else
+    __builtin_cpu_init();
+    bool sse41 = __builtin_cpu_supports( "sse4.1" );
+    bool avx2  = __builtin_cpu_supports( "avx2" );
+#endif
+    return avx2 ? folio_search_avx2 : sse41 ? folio_search_sse41 : folio_search_scalar;
+}
+#endif
+
+static inline uint32_t
+folio_next_free_word( per_folio* pp, uint32_t w, uint32_t w_max )
+// Effect: Return the first word of pp's bitmap in [w, w_max) that has a clear bit, or w_max if there is none.
+{
+#if SM_SIMD_BITMAP_SEARCH
+    if( w + 4 < w_max )
+    {
+        // Usually the first word has room, and that's cheaper to see without the vectors.
+        if( atomic_load_explicit( &pp->inuse_bitmap[w], memory_order_relaxed ) != UINT64_MAX ) return w;
+        switch( folio_search_level )
         {
-            // Found an empty bit.
-            uint64_t bwbar             = ~bw;
-            int      bit_to_set        = SM_BUILTIN_CTZ64( bwbar );
-            result_pp->inuse_bitmap[w] = bw | ( 1ull << bit_to_set );
-
-            SM_LOG_DEBUG( "result_pp  = %p\n", result_pp );
-            SM_LOG_DEBUG( "bit_to_set = %d\n", bit_to_set );
-
-            uint64_t chunk_address = (uint64_t) address_2_chunkaddress( result_pp );
-            uint64_t wasted_off    = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
-            uint64_t folio_num     = offset_in_chunk( result_pp ) / sizeof( per_folio );
-            uint64_t folio_size    = static_bin_info[bin].folio_size;
-            uint64_t folio_off     = folio_num * folio_size;
-            uint64_t obj_off       = ( w * 64 + bit_to_set ) * o_size;
-            return (void*) ( chunk_address + wasted_off + folio_off + obj_off );
+            case folio_search_avx2: return folio_next_free_word_avx2( pp, w + 1, w_max );
+            case folio_search_sse41: return folio_next_free_word_sse41( pp, w + 1, w_max );
         }
     }
-    abort();    // It's bad if we get here, it means that there was no bit in the bitmap, but the data structure said there should be.
+#endif
+    return folio_next_free_word_scalar( pp, w, w_max );
 }
 
-SM_DECLARE_ATOMIC_OPERATION( __small_malloc, do_small_malloc, void*, binnumber_t, uint32_t, uint32_t );
+static uint32_t
+do_small_malloc_batch( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, uint32_t o_size, void** out, uint32_t n,
+                       per_folio** madvise_us )
+// Effect: Fill out[0..n) with objects from the fullest nonempty pages, and return how many we got.
+//    We take as many objects as we can from each page before moving to the next one.
+//    We get fewer than n only if we run out of nonempty pages, in which case a chunk must be allocated.
+//    First we sync the dirty folios, and set *madvise_us to the ones the caller must madvise after releasing the lock.
+{
+    if( small_bin_has_dirty_folios( shard, bin ) ) *madvise_us = do_small_sync_folios( shard, bin, dsbi_offset );
+    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint32_t got         = 0;
+    while( got < n )
+    {
+        uint32_t fullest = dsbi[shard].fullest_offset[bin];
+        if( fullest == 0 ) break;    // Indicating that a chunk must be allocated.
+
+        per_folio* result_pp = dsbi_unlink_fullest( shard, bin, dsbi_offset, fullest );
+
+        // The page has fullest free slots; take up to n - got of them and add the page to the list that many slots down.
+        uint32_t n_take    = ( n - got < fullest ) ? n - got : fullest;
+        uint32_t remaining = fullest - n_take;
+
+        per_folio* old_h_below = dsbi[shard].lists.b[dsbi_offset + remaining];
+        result_pp->next        = old_h_below;
+        if( old_h_below ) { old_h_below->prev = result_pp; }
+        dsbi[shard].lists.b[dsbi_offset + remaining] = result_pp;
+        result_pp->free_count                        = remaining;
+        dsbi_list_now_nonempty( shard, bin, remaining );
+
+        // Must also figure out the new fullest.
+        if( remaining > 0 ) { dsbi[shard].fullest_offset[bin] = remaining; }
+        else
+        {
+            // We took the last item in the page, so we must look to see if we have any other pages.
+            dsbi_find_fullest( shard, bin );
+        }
+
+        // Now set the bitmap.  Only lock holders set bits, but frees may clear bits at any time, so we pick free bits from a
+        // snapshot of each word and then set them all with one fetch-or.
+        uint64_t folio_address = small_folio_address( bin, result_pp );
+        uint32_t w_max         = ceil32( o_per_folio, 64 );
+        atomic_store_explicit( &result_pp->alloc_count,
+                               atomic_load_explicit( &result_pp->alloc_count, memory_order_relaxed ) + n_take,
+                               memory_order_relaxed );
+        for( uint32_t w = folio_next_free_word( result_pp, 0, w_max ); n_take > 0 && w < w_max;
+             w     = folio_next_free_word( result_pp, w + 1, w_max ) )
+        {
+            uint64_t bw      = atomic_load_explicit( &result_pp->inuse_bitmap[w], memory_order_relaxed );
+            uint64_t claimed = 0;
+            do
+            {
+                // Found an empty bit.
+                int bit_to_set = SM_BUILTIN_CTZ64( ~bw );
+                bw |= 1ull << bit_to_set;
+                claimed |= 1ull << bit_to_set;
+
+                SM_LOG_DEBUG( "result_pp  = %p\n", result_pp );
+                SM_LOG_DEBUG( "bit_to_set = %d\n", bit_to_set );
+
+                out[got++] = (void*) ( folio_address + ( w * 64 + bit_to_set ) * o_size );
+                n_take--;
+            } while( n_take > 0 && bw != UINT64_MAX );
+            uint64_t old_bits = atomic_fetch_or_explicit( &result_pp->inuse_bitmap[w], claimed, memory_order_acquire );
+            if( IS_TESTING ) SM_ASSERT( ( old_bits & claimed ) == 0 );
+            (void) old_bits;
+        }
+        // It's bad if we get here, it means that there were fewer bits in the bitmap than the data structure said there should be.
+        if( n_take > 0 ) abort();
+    }
+    return got;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_malloc_batch, do_small_malloc_batch, uint32_t, uint32_t, binnumber_t, uint32_t, uint32_t,
+                             void**, uint32_t, per_folio** );
+
+#if SM_ACTIVE_FOLIO
+// Active folios: instead of unlinking the fullest folio and relinking it
+// one list down on every malloc, a thread takes a folio of each bin off
+// the dsbi lists (marking it with free_count == folio_owned) and
+// allocates from it without the bin lock until it is full.  Only the
+// owner sets bits in its active folio.  When the folio is full the owner
+// takes the lock once to put it back on the list for its number of free
+// slots and take the fullest folio in its place.  A thread's active
+// folios go back when it exits.
+//
+// The owner's own frees clear the bit and decrement alloc_count, which
+// only the owner writes.  Other threads push the object on the folio's
+// remote_frees list with one compare-and-swap on the folio's own cache
+// line, instead of touching the bitmap, free_state and the bin's dirty
+// stack, and the owner drains that list in a batch when the folio looks
+// full.  When the owner lets go it closes the list and drains what was
+// on it.  A free that loses that race goes to the bitmap and marks the
+// folio dirty as usual (the sync leaves active folios alone).
+static SM_ATTRIBUTE_THREAD per_folio* active_folios[first_large_bin_number];
+static SM_ATTRIBUTE_THREAD bool       active_folios_exit_hook_registered;
+
+static bool
+remote_free_push( per_folio* pp, void* p )
+// Effect: If pp is some thread's active folio, push p on its remote_frees list and return true.  Otherwise return false.
+{
+    void* head = atomic_load_explicit( &pp->remote_frees, memory_order_relaxed );
+    do
+    {
+        if( head == folio_remote_frees_closed ) return false;
+        *(void**) p = head;
+    } while( !atomic_compare_exchange_weak_explicit( &pp->remote_frees, &head, p, memory_order_release, memory_order_relaxed ) );
+    return true;
+}
+
+static void
+active_folio_free_list( binnumber_t bin, per_folio* pp, void* list )
+// Effect: Free the objects on list, which came off pp's remote_frees, into pp.  pp is the caller's active folio, or is being
+//  released under the bin lock, so the caller is the only one that writes pp->alloc_count.
+{
+    uint32_t n = 0;
+    while( list )
+    {
+        void*      next = *(void**) list;
+        uint64_t   objnum;
+        per_folio* list_pp = small_object_folio( list, bin, &objnum );
+        SM_ASSERT( list_pp == pp );
+        (void) list_pp;
+        folio_clear_inuse_bit( pp, objnum );
+        n++;
+        list = next;
+    }
+    // Clear the bits first, so that the count is never less than the number of bits set.
+    atomic_store_explicit( &pp->alloc_count, atomic_load_explicit( &pp->alloc_count, memory_order_relaxed ) - n,
+                           memory_order_relaxed );
+}
+
+static void*
+active_folio_claim( binnumber_t bin, per_folio* pp )
+// Effect: Allocate an object from pp, which is this thread's active folio of bin, without the lock.  Return NULL if pp is full.
+{
+    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    if( folio_objects_in_use( pp, atomic_load_explicit( &pp->free_state, memory_order_acquire ) ) == o_per_folio )
+    {
+        if( atomic_load_explicit( &pp->remote_frees, memory_order_relaxed ) == NULL ) return NULL;
+        active_folio_free_list( bin, pp, atomic_exchange_explicit( &pp->remote_frees, NULL, memory_order_acquire ) );
+    }
+    uint32_t alloc_count = atomic_load_explicit( &pp->alloc_count, memory_order_relaxed );
+    // The count is never less than the number of bits set, so there is a clear bit, and it's below o_per_folio since we look
+    // at the words in order.  Nobody else sets bits, so a bit that is clear now stays clear until we set it.
+    uint32_t w_max = ceil32( o_per_folio, 64 );
+    uint32_t w     = folio_next_free_word( pp, 0, w_max );
+    if( w < w_max )
+    {
+        uint64_t bw         = atomic_load_explicit( &pp->inuse_bitmap[w], memory_order_relaxed );
+        int      bit_to_set = SM_BUILTIN_CTZ64( ~bw );
+        uint64_t bit        = 1ull << bit_to_set;
+        atomic_store_explicit( &pp->alloc_count, alloc_count + 1, memory_order_relaxed );
+        uint64_t old_bits = atomic_fetch_or_explicit( &pp->inuse_bitmap[w], bit, memory_order_acquire );
+        if( IS_TESTING ) SM_ASSERT( ( old_bits & bit ) == 0 );
+        (void) old_bits;
+        return (void*) ( small_folio_address( bin, pp ) + ( w * 64 + bit_to_set ) * static_bin_info[bin].object_size );
+    }
+    // It's bad if we get here, it means that there were fewer bits in the bitmap than the count said there should be.
+    abort();
+}
+
+static per_folio*
+do_small_release_active_folio( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, per_folio* pp )
+// Effect: Put pp, which a thread has stopped using as its active folio, on the dsbi list for its number of free slots.  Return
+//  pp if it is empty and should be madvised instead (in which case it is on no list, as in small_folio_objects_freed()), and
+//  otherwise NULL.
+{
+    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    SM_ASSERT( pp->free_count == folio_owned );
+    // Once the list is closed, frees go to the bitmap, and those counted after we look will be synced relative to the list we
+    // put pp on, like any other folio's.
+    active_folio_free_list( bin, pp, atomic_exchange( &pp->remote_frees, folio_remote_frees_closed ) );
+    uint32_t free_slots = o_per_folio - folio_objects_in_use( pp, atomic_load( &pp->free_state ) );
+    pp->free_count      = free_slots;
+    if( free_slots == o_per_folio && dsbi[shard].lists.b[dsbi_offset + o_per_folio] != NULL && !purge_decay_enabled() )
+    {
+        pp->next = NULL;    // pp is a list of folios to madvise by itself.
+        return pp;
+    }
+
+    per_folio* new_next = dsbi[shard].lists.b[dsbi_offset + free_slots];
+    pp->prev            = NULL;
+    pp->next            = new_next;
+    if( new_next ) { new_next->prev = pp; }
+    dsbi[shard].lists.b[dsbi_offset + free_slots] = pp;
+    dsbi_list_now_nonempty( shard, bin, free_slots );
+    if( free_slots == o_per_folio ) dsbi_retained_pushed( shard, bin, pp );
+    uint32_t fullest = dsbi[shard].fullest_offset[bin];
+    if( free_slots > 0 && ( fullest == 0 || free_slots < fullest ) ) dsbi[shard].fullest_offset[bin] = free_slots;
+    return NULL;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_release_active_folio, do_small_release_active_folio, per_folio*, uint32_t, binnumber_t,
+                             uint32_t, per_folio* );
+
+static per_folio*
+do_small_swap_active_folio( uint32_t shard, binnumber_t bin, uint32_t dsbi_offset, per_folio* old, per_folio** madvise_us )
+// Effect: Release old (unless it is NULL), and take the fullest folio with a free slot off the dsbi lists to be the caller's
+//  active folio.  Return it, or NULL if there is none (in which case a chunk must be allocated).  Set *madvise_us to the folios
+//  the caller must madvise after releasing the lock.
+{
+    *madvise_us = small_bin_has_dirty_folios( shard, bin ) ? do_small_sync_folios( shard, bin, dsbi_offset ) : NULL;
+    if( old )
+    {
+        per_folio* madvise_me = do_small_release_active_folio( shard, bin, dsbi_offset, old );
+        if( madvise_me )
+        {
+            madvise_me->next = *madvise_us;
+            *madvise_us      = madvise_me;
+        }
+    }
+    uint32_t fullest = dsbi[shard].fullest_offset[bin];
+    if( fullest == 0 ) return NULL;
+    per_folio* pp = dsbi_unlink_fullest( shard, bin, dsbi_offset, fullest );
+    dsbi_find_fullest( shard, bin );
+    pp->free_count = folio_owned;
+    atomic_store( &pp->remote_frees, NULL );
+    return pp;
+}
+
+SM_DECLARE_ATOMIC_OPERATION( __small_swap_active_folio, do_small_swap_active_folio, per_folio*, uint32_t, binnumber_t, uint32_t,
+                             per_folio*, per_folio** );
+
+static void
+active_folio_release( binnumber_t bin, per_folio* pp )
+// Effect: Give back pp, which was this thread's active folio of bin, to the shard that owns it.
+{
+    uint32_t   shard      = small_chunk_shard( pp );
+    per_folio* madvise_us = SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_release_active_folio, shard, bin,
+                                                        dynamic_small_bin_offset( bin ), pp );
+    small_madvise_folios( madvise_us );
+}
+
+static void
+active_folios_release_all( void )
+// Effect: Give back all of this thread's active folios.
+{
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        per_folio* pp = active_folios[bin];
+        if( pp == NULL ) continue;
+        active_folios[bin] = NULL;
+        active_folio_release( bin, pp );
+    }
+}
+
+#if defined( __linux__ )
+static pthread_key_t active_folios_key;
+
+static void
+active_folios_destructor( void* arg )
+{
+    (void) arg;
+    // As in the thread cache, a malloc after this point registers the hook again.
+    active_folios_exit_hook_registered = false;
+    active_folios_release_all();
+}
+#elif defined( _WIN64 )
+static DWORD active_folios_fls_index = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI
+active_folios_destructor( PVOID arg )
+{
+    (void) arg;
+    active_folios_exit_hook_registered = false;
+    active_folios_release_all();
+}
+#endif
+
+static void
+active_folios_register_exit_hook( void )
+{
+#if defined( __linux__ )
+    pthread_setspecific( active_folios_key, active_folios );
+#elif defined( _WIN64 )
+    if( active_folios_fls_index != FLS_OUT_OF_INDEXES ) FlsSetValue( active_folios_fls_index, active_folios );
+#endif
+    active_folios_exit_hook_registered = true;
+}
+
+static void*
+active_folio_malloc( uint32_t shard, binnumber_t bin )
+// Effect: Replace this thread's active folio of bin with the fullest folio that has a free slot, and allocate from that.  Return
+//  NULL if there is no such folio, in which case the caller must add a chunk.
+{
+    if( !active_folios_exit_hook_registered ) active_folios_register_exit_hook();
+    per_folio* old = active_folios[bin];
+    if( old && small_chunk_shard( old ) != shard )
+    {
+        // The thread has moved to another shard since it took old, which goes back to the shard that owns it.
+        active_folios[bin] = NULL;
+        active_folio_release( bin, old );
+        old = NULL;
+    }
+    per_folio* madvise_us = NULL;
+    per_folio* pp = SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_swap_active_folio, shard, bin,
+                                                dynamic_small_bin_offset( bin ), old, &madvise_us );
+    active_folios[bin] = pp;
+    small_madvise_folios( madvise_us );
+    return pp ? active_folio_claim( bin, pp ) : NULL;
+}
+#endif
 
 //#define MICROTIMING
 
@@ -238,7 +1285,93 @@ __thread uint64_t clocks_spent_in_do_small_malloc        = 0;
 void
 init_small_malloc()
 {
-    initialize_lock_array( &small_locks[0], first_huge_bin_number );
+#if SM_SIMD_BITMAP_SEARCH
+    folio_search_level = detect_folio_search_level();
+#endif
+    for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+    {
+        initialize_lock_array( &small_locks[shard][0], first_large_bin_number );
+    }
+#if SM_SMALL_STASH
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        uint64_t n          = small_stash_bytecount_limit / static_bin_info[bin].object_size;
+        stash_capacity[bin] = n < ( 1u << ( 64 - stash_pointer_bits ) ) - 1 ? n : ( 1u << ( 64 - stash_pointer_bits ) ) - 1;
+    }
+#endif
+#if SM_ACTIVE_FOLIO
+#if defined( __linux__ )
+    pthread_key_create( &active_folios_key, active_folios_destructor );
+#elif defined( _WIN64 )
+    active_folios_fls_index = FlsAlloc( active_folios_destructor );
+#endif
+#endif
+}
+
+void
+small_malloc_prefork()
+{
+    for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+    {
+        for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ ) sm_lock_for_fork( &small_locks[shard][bin] );
+    }
+}
+
+void
+small_malloc_postfork_parent()
+{
+    for( uint32_t shard = SM_SMALL_SHARDS; shard > 0; shard-- )
+    {
+        for( binnumber_t bin = first_large_bin_number; bin > 0; bin-- ) sm_unlock( &small_locks[shard - 1][bin - 1] );
+    }
+}
+
+void
+small_malloc_postfork_child( bool fresh_heap )
+{
+    for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+    {
+        initialize_lock_array( &small_locks[shard][0], first_large_bin_number );
+    }
+    if( fresh_heap )
+    {
+        // Map fresh zero pages over dsbi rather than clearing it, so that we don't take a copy-on-write fault on every page of it.
+        _Static_assert( sizeof( dsbi ) % pagesize == 0, "dsbi must be whole pages" );
+#if defined( __linux__ )
+        mmap( &dsbi, sizeof( dsbi ), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 );
+#endif
+        for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+        {
+            for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ ) atomic_store( &dirty_folios[shard][bin].head, NULL );
+#if SM_SMALL_STASH
+            for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ ) atomic_store( &stash[shard][bin].head, 0 );
+#endif
+        }
+#if SM_ACTIVE_FOLIO
+        // Our active folios are in the parent's chunks.
+        for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ ) active_folios[bin] = NULL;
+#endif
+    }
+}
+
+static bool
+small_malloc_add_chunk( uint32_t shard, binnumber_t bin )
+// Effect: Allocate a chunk for bin and add its folios to shard's dsbi.  Return false if we are out of memory.
+{
+    SM_LOG_DEBUG( "Need a chunk\n" );
+    void* chunk = mmap_chunk_aligned_block( 1 );
+    if( chunk == NULL ) return false;
+    bin_and_size_t b_and_s = bin_and_size_to_bin_and_size( bin, 0 ) + ( shard << 8 );    // See small_chunk_shard().
+    SM_ASSERT( b_and_s != 0 );
+    chunknumber_t chunknum = address_2_chunknumber( chunk );
+    commit_ci_page_as_needed( chunknum );
+    chunk_infos[chunknum].bin_and_size = b_and_s;
+    set_chunk_generation( chunknum );
+
+    // The folio headers are initialized as the folios are needed (see dsbi_add_fresh_folio()).
+    SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], small_malloc_add_pages_from_new_chunk, shard, bin,
+                                dynamic_small_bin_offset( bin ), chunk );
+    return true;
 }
 
 void*
@@ -251,42 +1384,45 @@ small_malloc( binnumber_t bin )
     verify_small_invariants();
     //size_t usable_size = bin_2_size(bin);
     SM_ASSERT( bin < first_large_bin_number );
-    uint32_t            dsbi_offset      = dynamic_small_bin_offset( bin );
-    objects_per_folio_t o_per_folio      = static_bin_info[bin].objects_per_folio;
-    uint64_t            o_size           = static_bin_info[bin].object_size;
-    uint16_t            folios_per_chunk = static_bin_info[bin].folios_per_chunk;
+    uint32_t shard = small_thread_shard();
+#if SM_SMALL_STASH
+    void* stashed = stash_pop( shard, bin );
+    if( stashed ) return stashed;
+#endif
+#if SM_ACTIVE_FOLIO
+    if( active_folios[bin] )
+    {
+        void* result = active_folio_claim( bin, active_folios[bin] );
+        if( result ) return result;
+    }
+#endif
     while( 1 )
     {
         WHEN_MICROTIMING( uint64_t end_early_small_malloc = rdtsc();
                           clocks_spent_in_early_small_malloc += end_early_small_malloc - start_small_malloc );
-        uint32_t fullest = atomic_load( &dsbi.fullest_offset[bin] );    // Otherwise it looks racy.
-        SM_LOG_DEBUG( " bin=%d off=%d  fullest=%d\n", bin, dsbi_offset, fullest );
-        if( fullest == 0 )
+        uint32_t fullest = atomic_load( &dsbi[shard].fullest_offset[bin] );    // Otherwise it looks racy.
+        SM_LOG_DEBUG( " bin=%d off=%d  fullest=%d\n", bin, dynamic_small_bin_offset( bin ), fullest );
+        // If there are dirty folios, syncing them may turn up free slots, so don't allocate a chunk yet.
+        if( fullest == 0 && !small_bin_has_dirty_folios( shard, bin ) )
         {
-            SM_LOG_DEBUG( "Need a chunk\n" );
-            void* chunk = mmap_chunk_aligned_block( 1 );
-            if( chunk == NULL ) return NULL;
-            bin_and_size_t b_and_s = bin_and_size_to_bin_and_size( bin, 0 );
-            SM_ASSERT( b_and_s != 0 );
-            chunknumber_t chunknum = address_2_chunknumber( chunk );
-            commit_ci_page_as_needed( chunknum );
-            chunk_infos[chunknum].bin_and_size = b_and_s;
-
-            small_chunk_header* sch = (small_chunk_header*) chunk;
-            for( uint32_t i = 0; i < folios_per_chunk; i++ )
-            {
-                for( uint32_t w = 0; w < ceil32( o_per_folio, 64 ); w++ ) { sch->ll[i].inuse_bitmap[w] = 0; }
-                sch->ll[i].prev = ( i == 0 ) ? NULL : &sch->ll[i - 1];
-                sch->ll[i].next = ( i + 1 == folios_per_chunk ) ? NULL : &sch->ll[i + 1];
-            }
-            SM_INVOKE_ATOMIC_OPERATION( &small_locks[bin], small_malloc_add_pages_from_new_chunk, bin, dsbi_offset, sch );
+            if( !small_malloc_add_chunk( shard, bin ) ) return NULL;
         }
 
         verify_small_invariants();
 
         WHEN_MICROTIMING( uint64_t start_do_small_malloc = rdtsc();
                           clocks_spent_initializing_small_chunks += start_do_small_malloc - end_early_small_malloc );
-        void* result = SM_INVOKE_ATOMIC_OPERATION( &small_locks[bin], __small_malloc, bin, dsbi_offset, o_size );
+#if SM_ACTIVE_FOLIO
+        void* result = active_folio_malloc( shard, bin );
+#else
+        uint32_t   dsbi_offset = dynamic_small_bin_offset( bin );
+        uint64_t   o_size      = static_bin_info[bin].object_size;
+        void*      result      = NULL;
+        per_folio* madvise_us  = NULL;
+        SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_malloc_batch, shard, bin, dsbi_offset, o_size, &result, 1,
+                                    &madvise_us );
+        small_madvise_folios( madvise_us );
+#endif
 
         verify_small_invariants();
         WHEN_MICROTIMING( uint64_t end_do_small_malloc = rdtsc();
@@ -302,6 +1438,45 @@ small_malloc( binnumber_t bin )
     }
 }
 
+size_t
+small_malloc_batch( binnumber_t bin, void** out, size_t n )
+// Effect: Allocate n objects in bin into out[0..n).  As in small_malloc(), stashed objects come first and the rest come out
+//  of the fullest pages, but all of those are taken under one acquisition of the bin lock.  Returns the number allocated,
+//  which is less than n only if we ran out of memory.
+{
+    SM_ASSERT( bin < first_large_bin_number );
+    uint32_t dsbi_offset = dynamic_small_bin_offset( bin );
+    uint32_t o_size      = static_bin_info[bin].object_size;
+    uint32_t shard       = small_thread_shard();
+    size_t   got         = 0;
+#if SM_SMALL_STASH
+    while( got < n )
+    {
+        void* stashed = stash_pop( shard, bin );
+        if( stashed == NULL ) break;
+        out[got++] = stashed;
+    }
+#endif
+    while( got < n )
+    {
+        if( atomic_load( &dsbi[shard].fullest_offset[bin] ) == 0 && !small_bin_has_dirty_folios( shard, bin ) )
+        {
+            if( !small_malloc_add_chunk( shard, bin ) ) break;
+        }
+        uint32_t   want       = ( n - got < UINT32_MAX ) ? (uint32_t) ( n - got ) : UINT32_MAX;
+        per_folio* madvise_us = NULL;
+        got += SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_malloc_batch, shard, bin, dsbi_offset, o_size,
+                                           out + got, want, &madvise_us );
+        small_madvise_folios( madvise_us );
+    }
+    if( IS_TESTING )
+    {
+        for( size_t i = 0; i < got; i++ )
+            SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( out[i] )].bin_and_size ) == bin );
+    }
+    return got;
+}
+
 #ifndef NOCPPRUNTIME
 
 enum
@@ -358,129 +1533,114 @@ extern "C"
 }
 #endif    // !defined NOCPPRUNTIME
 
-static per_folio*
-do_small_free( binnumber_t bin, per_folio* pp, uint64_t objnum, uint32_t dsbi_offset )
-// Effect: Free the object specified by objnum and pp (that is the
-// objnum'th object in the folio corresponding to pp).  Returns NULL
-// or else a pointer to a folio that should be freed.
+static bool
+small_release_object( binnumber_t bin, void* p )
+// Effect: Clear p's bit in its folio's bitmap, without the bin lock, and mark the folio dirty (or, if the folio is some thread's
+//  active folio, hand p to that thread).  Return true if the folio now looks empty, in which case the caller should sync the dirty
+//  folios so that it can be madvised.
 {
-    uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
-    uint32_t old_count   = 0;
-    uint32_t imax        = ceil32( static_bin_info[bin].objects_per_folio, 64 );
-    for( uint32_t i = 0; i < imax; i++ ) old_count += SM_BUILTIN_POPCOUNT64( pp->inuse_bitmap[i] );
-    // clear the bit.
-    uint64_t old_bits = pp->inuse_bitmap[objnum / 64];
-    SM_ASSERT( old_bits & ( 1ull << ( objnum % 64 ) ) );
-    pp->inuse_bitmap[objnum / 64] = old_bits & ~( 1ull << ( objnum % 64 ) );
-    if( IS_TESTING ) SM_ASSERT( old_count > 0 && old_count <= o_per_folio );
-
-    uint32_t old_offset_within = o_per_folio - old_count;
-    uint32_t new_offset_within = old_offset_within + 1;
-    uint32_t old_offset_dsbi   = dsbi_offset + old_offset_within;
-    uint32_t new_offset        = old_offset_dsbi + 1;
-
-    // remove from old list
-    per_folio* pp_next = pp->next;
-    per_folio* pp_prev = pp->prev;
-    if( pp_prev == NULL )
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( p, bin, &objnum );
+#if SM_ACTIVE_FOLIO
+    if( pp == active_folios[bin] )
     {
-        SM_ASSERT( dsbi.lists.b[old_offset_dsbi] == pp );
-        dsbi.lists.b[old_offset_dsbi] = pp_next;
+        // Our own active folio, whose alloc_count only we write.
+        folio_clear_inuse_bit( pp, objnum );
+        atomic_store_explicit( &pp->alloc_count, atomic_load_explicit( &pp->alloc_count, memory_order_relaxed ) - 1,
+                               memory_order_relaxed );
+        return false;
     }
-    else { pp_prev->next = pp_next; }
-    if( pp_next != NULL ) { pp_next->prev = pp_prev; }
-    // Fix up the old_count
-    if( old_offset_within == 0 ) { dsbi.fullest_offset[bin] = new_offset_within; }
-    else if( pp_next == NULL && dsbi.fullest_offset[bin] == old_offset_within ) { dsbi.fullest_offset[bin] = new_offset_within; }
-    // Add to new list
-    SM_ASSERT( new_offset < dsbi_offset + o_per_folio + 1 );
-    if( new_offset != dsbi_offset + o_per_folio || dsbi.lists.b[new_offset] == NULL )
-    {
-        // Don't madvise the folio, since either it's not empty or there are no folios in the empty slot.
-        // Even if the folio is empty, we want to keep one folio around without madvising() it
-        //  in order to have some hysteresis in the madvise()/commit cycle.
-        per_folio* new_next = dsbi.lists.b[new_offset];
-        pp->prev            = NULL;
-        pp->next            = new_next;
-        if( new_next ) { new_next->prev = pp; }
-        dsbi.lists.b[new_offset] = pp;
-        return NULL;
+    if( remote_free_push( pp, p ) ) return false;
+#endif
+    folio_clear_inuse_bit( pp, objnum );
+    uint64_t old_state = atomic_fetch_add_explicit( &pp->free_state, 1ull << 32, memory_order_acq_rel );
+    uint32_t old_count = folio_objects_in_use( pp, old_state );
+    SM_ASSERT( old_count > 0 );
+    if( !folio_state_dirty( old_state ) ) push_dirty_folio( small_chunk_shard( pp ), bin, pp );
+    return old_count == 1;
+}
+
+static void
+small_sync_folios( uint32_t shard, binnumber_t bin )
+// Effect: Sync the dirty folios in bin and madvise the ones that became empty.
+{
+    per_folio* madvise_us =
+        SM_INVOKE_ATOMIC_OPERATION( &small_locks[shard][bin], __small_sync_folios, shard, bin, dynamic_small_bin_offset( bin ) );
+    small_madvise_folios( madvise_us );
+}
+
+static void
+small_free_list( binnumber_t bin, void* list )
+// Effect: Free every object on list (which is linked through stash links).  We take the bin lock only if some folio became
+//  empty, and then only in the shards that own those folios.
+{
+    uint64_t sync_shards = 0;
+    while( list )
+    {
+        void* next = (void*) ( *(uint64_t*) list & stash_pointer_mask );
+        if( small_release_object( bin, list ) ) sync_shards |= 1ull << small_chunk_shard( list );
+        list = next;
     }
-    else
+    while( sync_shards )
     {
-        // Ask the caller madvise the folio (by returning the pp) and add
-        // it to the slot later.
-        //
-        // The fullest_offset is still correct, because we do this only if
-        // there is something in the new_offset.
-        return pp;
+        uint32_t shard = (uint32_t) sm_ctz64( sync_shards );
+        sync_shards &= sync_shards - 1;
+        small_sync_folios( shard, bin );
     }
 }
 
-SM_DECLARE_ATOMIC_OPERATION( __small_free, do_small_free, per_folio*, binnumber_t, per_folio*, uint64_t, uint32_t );
-
-bool
-small_free_post_madvise( per_folio* pp, uint32_t total_dsbi_offset )
-// Effect: After calling madvise to clear a folio, put the folio into the free list.
-//  The pp is a per-folio linked-list element stored at the beginning of the chunk.
-//  The total_dsbi_offset is the offset that corresponds to the list of completely
-//  free folios.
+void
+small_free_batch( binnumber_t bin, void* list, uint64_t n )
+// Effect: Free the n objects on list, all of which are in bin.  The list is linked through the first word of each object.
+//  If they all fit in the stash they go there in one step, and otherwise we free them all and take the bin lock at most once.
 {
-    per_folio* new_next = dsbi.lists.b[total_dsbi_offset];
-    pp->prev            = NULL;
-    pp->next            = new_next;
-    if( new_next ) { new_next->prev = pp; }
-    dsbi.lists.b[total_dsbi_offset] = pp;
-    return true;    // cannot return void from a templated function.
+    if( IS_TESTING )
+    {
+        uint64_t count = 0;
+        for( void* p = list; p; p = (void*) ( *(uint64_t*) p & stash_pointer_mask ) )
+        {
+            SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size ) == bin );
+            count++;
+        }
+        SM_ASSERT( count == n );
+    }
+#if SM_SMALL_STASH
+    if( stash_push_list( small_thread_shard(), bin, list, n ) ) return;
+#endif
+    small_free_list( bin, list );
 }
 
-SM_DECLARE_ATOMIC_OPERATION( __small_free_post_madvise, small_free_post_madvise, bool, per_folio*, uint32_t );
-
 void
 small_free( void* p )
 {
-    verify_small_invariants();
-    void*               chunk     = address_2_chunkaddress( p );
-    small_chunk_header* sch       = chunk;
-    chunknumber_t       chunk_num = address_2_chunknumber( p );
-    bin_and_size_t      b_and_s   = chunk_infos[chunk_num].bin_and_size;
+    bin_and_size_t b_and_s = chunk_infos[address_2_chunknumber( p )].bin_and_size;
     SM_ASSERT( b_and_s != 0 );
-    binnumber_t bin           = bin_from_bin_and_size( b_and_s );
-    uint64_t    wasted_offset = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
-    uint64_t    useful_offset = offset_in_chunk( p ) - wasted_offset;
-    SM_ASSERT( (uint64_t) p >= wasted_offset );
-    uint32_t   folio_num  = divide_offset_by_foliosize( (uint32_t) useful_offset, bin );
-    per_folio* pp         = &sch->ll[folio_num];
-    uint32_t   folio_size = (uint32_t) static_bin_info[bin].folio_size;
-    SM_ASSERT( useful_offset <= UINT32_MAX );
-    uint32_t offset_in_folio = (uint32_t) useful_offset - folio_num * folio_size;
-    uint64_t objnum          = divide_offset_by_objsize( offset_in_folio, bin );
+    small_free_in_bin( p, bin_from_bin_and_size( b_and_s ) );
+}
+
+void
+small_free_in_bin( void* p, binnumber_t bin )
+// Effect: Like small_free(p), for callers that already know p's bin.
+{
+    verify_small_invariants();
+    if( IS_TESTING ) SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size ) == bin );
+    if( chunk_belongs_to_parent( address_2_chunknumber( p ) ) ) return;
+#if SM_SMALL_STASH
     if( IS_TESTING )
     {
-        uint64_t o_size  = static_bin_info[bin].object_size;
-        uint64_t objnum2 = offset_in_folio / o_size;
-        SM_ASSERT( objnum == objnum2 );
-    }
-    if( IS_TESTING ) SM_ASSERT( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 );
-    uint32_t dsbi_offset = dynamic_small_bin_offset( bin );
-
-    per_folio* madvise_me = SM_INVOKE_ATOMIC_OPERATION( &small_locks[bin], __small_free, bin, pp, objnum, dsbi_offset );
-    if( madvise_me )
-    {
-        // We are the only one that holds this page (it is empty, so no
-        // other thread could free an object into it, and we kept it out
-        // of the dsbi lists, so no other thread can try to allocate out
-        // of it.)
-        SM_ASSERT( madvise_me == pp );
-        uint64_t madvise_address = ( chunk_num * chunksize ) + wasted_offset + folio_num * folio_size;
-        madvise( (void*) madvise_address, folio_size, MADV_DONTNEED );
-        // Now put it back into the list.
-        // Doing this will not change the fullest offset, since this is fully empty.
-        // Cannot quite do this with a compare-and-swap since we have to update dsbi.lists[new_offset] as well as the prev pointer
-        // in whatever is there.
-        SM_INVOKE_ATOMIC_OPERATION( &small_locks[bin], __small_free_post_madvise, pp,
-                                    dsbi_offset + static_bin_info[bin].objects_per_folio + 1 );
+        uint64_t   objnum;
+        per_folio* pp = small_object_folio( p, bin, &objnum );
+        SM_ASSERT( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 );
     }
+    uint32_t shard = small_thread_shard();
+    if( stash_push( shard, bin, p ) ) return;
+    // The stash is full: free everything in it, and p, taking the lock at most once.
+    void* list = stash_take_all( shard, bin );
+    atomic_store_explicit( (_Atomic uint64_t*) p, (uint64_t) list, memory_order_relaxed );
+    small_free_list( bin, p );
+#else
+    if( small_release_object( bin, p ) ) small_sync_folios( small_chunk_shard( p ), bin );
+#endif
     verify_small_invariants();
 }
 
@@ -490,6 +1650,52 @@ enum
 };
 
 #ifdef TESTING
+static uint32_t
+folio_inuse_count( binnumber_t bin, per_folio* pp )
+{
+    uint32_t count = 0;
+    uint32_t imax  = ceil32( static_bin_info[bin].objects_per_folio, 64 );
+    for( uint32_t i = 0; i < imax; i++ ) count += SM_BUILTIN_POPCOUNT64( pp->inuse_bitmap[i] );
+    return count;
+}
+
+static uint32_t
+small_test_shard( void )
+// Effect: Return this thread's shard, and keep the thread in it, so that a test's mallocs and frees all use the same shard.
+{
+    uint32_t shard = small_thread_shard();
+#if SM_SMALL_SHARDS > 1
+    thread_shard.countdown = UINT32_MAX;
+#endif
+    return shard;
+}
+
+#if SM_SMALL_STASH
+static void
+small_stash_flush( uint32_t shard, binnumber_t bin )
+{
+    small_free_list( bin, stash_take_all( shard, bin ) );
+}
+#endif
+
+static void
+verify_small_inuse_counts( uint32_t shard, binnumber_t bin )
+// Effect: Like verify_small_invariants(), but check only that each folio of bin on a dsbi list has an in-use count that
+//  matches its bitmap.  Requires that no other thread is using bin.
+{
+    sm_lock( &small_locks[shard][bin] );
+    uint32_t start       = dynamic_small_bin_offset( bin );
+    uint32_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    for( uint32_t i = 0; i < o_per_folio + 2; i++ )
+    {
+        for( per_folio* pp = dsbi[shard].lists.b[start + i]; pp; pp = pp->next )
+        {
+            SM_ASSERT( folio_objects_in_use( pp, atomic_load( &pp->free_state ) ) == folio_inuse_count( bin, pp ) );
+        }
+    }
+    sm_unlock( &small_locks[shard][bin] );
+}
+
 static void
 test_bin_27()
 {
@@ -508,8 +1714,7 @@ test_bin_27()
             folio_numbers[objnum] = useful_offset / static_bin_info[bin].folio_size;
             object_numbers_in_folio[objnum] =
                 ( useful_offset - folio_numbers[objnum] * static_bin_info[bin].folio_size ) / static_bin_info[bin].object_size;
-            small_chunk_header* sch = address_2_chunkaddress( allocated[objnum] );
-            pps[objnum]             = &sch->ll[folio_numbers[objnum]];
+            pps[objnum] = small_chunk_folio( address_2_chunkaddress( allocated[objnum] ), bin, folio_numbers[objnum] );
             SM_ASSERT( object_numbers_in_folio[objnum] < 64 );
             SM_ASSERT( 1 == ( ( pps[objnum]->inuse_bitmap[0] >> object_numbers_in_folio[objnum] ) & 1 ) );
         }
@@ -523,6 +1728,9 @@ test_bin_27()
                     SM_ASSERT( 1 == ( ( pps[k]->inuse_bitmap[0] >> object_numbers_in_folio[k] ) & 1 ) );
             }
             small_free( allocated[objnum] );
+#if SM_SMALL_STASH
+            small_stash_flush( small_test_shard(), 27 );
+#endif
             for( int k = 0; k < n_objects; k++ )
             {
                 if( k <= objnum )
@@ -534,6 +1742,592 @@ test_bin_27()
     }
 }
 
+#if SM_SMALL_STASH
+static void
+test_stash()
+{
+    const binnumber_t bin   = 3;
+    uint32_t          shard = small_test_shard();
+    small_stash_flush( shard, bin );
+
+    // LIFO, and a stashed object stays marked in use.
+    void* x = small_malloc( bin );
+    void* y = small_malloc( bin );
+    small_free( x );
+    small_free( y );
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( x, bin, &objnum );
+    SM_ASSERT( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 );
+    SM_ASSERT( small_malloc( bin ) == y );
+    SM_ASSERT( small_malloc( bin ) == x );
+
+    // Filling the stash past its capacity frees the whole batch.
+    uint64_t n       = stash_capacity[bin] + 1;
+    void**   objects = malloc( n * sizeof( void* ) );
+    for( uint64_t i = 0; i < n; i++ ) objects[i] = small_malloc( bin );
+    small_free( x );
+    small_free( y );
+    for( uint64_t i = 0; i + 3 < n; i++ ) small_free( objects[i] );    // now the stash is full
+    SM_ASSERT( ( *(uint64_t*) objects[n - 4] >> stash_pointer_bits ) == stash_capacity[bin] );
+    small_free( objects[n - 3] );
+    SM_ASSERT( ( atomic_load( &stash[shard][bin].head ) & stash_pointer_mask ) == 0 );
+    for( uint64_t i = 0; i + 2 < n; i++ )
+    {
+        pp = small_object_folio( objects[i], bin, &objnum );
+        SM_ASSERT( ( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 ) == 0 );
+    }
+    small_free( objects[n - 2] );
+    small_free( objects[n - 1] );
+    small_stash_flush( shard, bin );
+    free( objects );
+}
+#endif
+
+static void
+test_small_batch()
+{
+    const binnumber_t   bin         = 5;
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+#if SM_SMALL_STASH
+    uint32_t shard = small_test_shard();
+    small_stash_flush( shard, bin );
+    uint64_t n = stash_capacity[bin] + 2 * o_per_folio;    // too many for the stash
+#else
+    uint64_t n = 3 * o_per_folio;
+#endif
+    void** objects = malloc( n * sizeof( void* ) );
+    SM_ASSERT( small_malloc_batch( bin, objects, n ) == n );
+    for( uint64_t i = 0; i < n; i++ )
+    {
+        uint64_t   objnum;
+        per_folio* pp = small_object_folio( objects[i], bin, &objnum );
+        SM_ASSERT( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 );
+        if( i > 0 ) SM_ASSERT( objects[i] != objects[i - 1] );
+    }
+
+    // Free them in one list, in allocation order, so that runs of objects share a folio.
+    for( uint64_t i = 0; i < n; i++ ) *(uint64_t*) objects[i] = ( i + 1 < n ) ? (uint64_t) objects[i + 1] : 0;
+    small_free_batch( bin, objects[0], n );
+    for( uint64_t i = 0; i < n; i++ )
+    {
+        uint64_t   objnum;
+        per_folio* pp = small_object_folio( objects[i], bin, &objnum );
+        SM_ASSERT( ( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 ) == 0 );
+    }
+
+    // A few objects fit in the stash, and come back from it first.
+    SM_ASSERT( small_malloc_batch( bin, objects, 3 ) == 3 );
+    *(uint64_t*) objects[0] = (uint64_t) objects[1];
+    *(uint64_t*) objects[1] = (uint64_t) objects[2];
+    *(uint64_t*) objects[2] = 0;
+    small_free_batch( bin, objects[0], 3 );
+#if SM_SMALL_STASH
+    SM_ASSERT( ( atomic_load( &stash[shard][bin].head ) & stash_pointer_mask ) == (uint64_t) objects[0] );
+    SM_ASSERT( ( *(uint64_t*) objects[0] >> stash_pointer_bits ) == 3 );
+    void* again[3];
+    SM_ASSERT( small_malloc_batch( bin, again, 3 ) == 3 );
+    SM_ASSERT( again[0] == objects[0] && again[1] == objects[1] && again[2] == objects[2] );
+    for( int i = 0; i < 3; i++ ) small_free( again[i] );
+    small_stash_flush( shard, bin );
+#endif
+    free( objects );
+}
+
+static void
+test_lockfree_release()
+{
+    const binnumber_t   bin         = 7;
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+#if SM_SMALL_STASH
+    uint32_t shard = small_test_shard();
+    small_stash_flush( shard, bin );
+#endif
+    void* x = small_malloc( bin );
+    void* y = small_malloc( bin );
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( x, bin, &objnum );
+    SM_ASSERT( small_object_folio( y, bin, &objnum ) == pp );
+#if SM_ACTIVE_FOLIO
+    // Let go of pp, so that frees into it go to the bitmap.
+    active_folios_release_all();
+#endif
+
+    // Releasing clears the bit and marks the folio dirty, but leaves it on its dsbi list until someone takes the lock.
+    uint16_t free_count = pp->free_count;
+    SM_ASSERT( !small_release_object( bin, y ) );
+    SM_ASSERT( ( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 ) == 0 );
+    SM_ASSERT( folio_state_dirty( atomic_load( &pp->free_state ) ) && pp->free_count == free_count );
+    SM_ASSERT( folio_objects_in_use( pp, atomic_load( &pp->free_state ) ) == folio_inuse_count( bin, pp ) );
+
+#if SM_ACTIVE_FOLIO
+    // The next malloc would make some folio (maybe pp) its active folio, so sync explicitly.
+    small_sync_folios( small_chunk_shard( pp ), bin );
+    SM_ASSERT( !folio_state_dirty( atomic_load( &pp->free_state ) ) );
+    SM_ASSERT( pp->free_count == o_per_folio - folio_inuse_count( bin, pp ) );
+#else
+    // The next malloc syncs it.
+    void* z = small_malloc( bin );
+    SM_ASSERT( !folio_state_dirty( atomic_load( &pp->free_state ) ) );
+    SM_ASSERT( pp->free_count == o_per_folio - folio_inuse_count( bin, pp ) );
+    small_free( z );
+#endif
+    small_free( x );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+}
+
+static void
+check_dsbi_nonempty( uint32_t shard, binnumber_t bin )
+// Effect: Check that the nonempty bitmap of bin matches its lists, and that the fullest offset is the first nonempty list.
+{
+    sm_lock( &small_locks[shard][bin] );
+    uint32_t start       = dynamic_small_bin_offset( bin );
+    uint32_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint32_t first       = UINT32_MAX;
+    for( uint32_t i = 0; i < o_per_folio + 2; i++ )
+    {
+        bool nonempty = dsbi[shard].lists.b[start + i] != NULL;
+        SM_ASSERT( ( ( dsbi[shard].nonempty[bin].words[i / 64] >> ( i % 64 ) ) & 1 ) == nonempty );
+        SM_ASSERT( ( ( dsbi[shard].nonempty[bin].summary >> ( i / 64 ) ) & 1 )
+                   == ( dsbi[shard].nonempty[bin].words[i / 64] != 0 ) );
+        if( nonempty && i > 0 && first == UINT32_MAX ) first = i;
+        SM_ASSERT( dsbi_first_nonempty_list( shard, bin, i )
+                   == ( nonempty ? i : dsbi_first_nonempty_list( shard, bin, i + 1 ) ) );
+    }
+    SM_ASSERT( dsbi_first_nonempty_list( shard, bin, 1 ) == first );
+    uint32_t   n_retained = 0;
+    per_folio* oldest     = NULL;
+    for( per_folio* pp = dsbi[shard].lists.b[start + o_per_folio]; pp; pp = pp->next, n_retained++ ) oldest = pp;
+    SM_ASSERT( dsbi[shard].retained[bin].n == n_retained && dsbi[shard].retained[bin].oldest == oldest );
+    uint32_t fullest = dsbi[shard].fullest_offset[bin];
+    if( first == UINT32_MAX ) SM_ASSERT( fullest == 0 );
+    else
+        SM_ASSERT( fullest == ( first == o_per_folio + 1 ? o_per_folio : first ) );
+    sm_unlock( &small_locks[shard][bin] );
+}
+
+static uint64_t
+test_random( uint64_t* state )
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+enum
+{
+    test_n_folios = 4096
+};
+static SM_ALIGNED( 64 ) char test_folios[test_n_folios * 384];
+
+static per_folio*
+test_fill_folio( uint32_t f, uint32_t n_words )
+// Effect: Return the fth of the folio headers in test_folios, which are laid out as for a bin with n_words bitmap words.
+{
+    uint32_t header_size = cacheline_size * ceil32( offsetof( per_folio, inuse_bitmap ) + n_words * 8, cacheline_size );
+    SM_ASSERT( f < test_n_folios && header_size <= sizeof( test_folios ) / test_n_folios );
+    return (per_folio*) ( test_folios + f * header_size );
+}
+
+static void
+test_fill_folios( uint32_t n_folios, uint32_t n_words, uint32_t percent_full, bool in_order, uint64_t* state )
+// Effect: Set up n_folios folio headers in test_folios whose bitmaps of n_words words have percent_full percent of their bits
+//  set: the first ones, as in a folio that mallocs are filling, or (if !in_order) about that many at random, as in one that
+//  has had random frees.
+{
+    for( uint32_t f = 0; f < n_folios; f++ )
+    {
+        per_folio* pp     = test_fill_folio( f, n_words );
+        uint32_t   n_full = n_words * 64 * percent_full / 100;
+        for( uint32_t w = 0; w < n_words; w++ )
+        {
+            uint64_t bits = 0;
+            for( uint32_t b = 0; b < 64; b++ )
+            {
+                bool set = in_order ? w * 64 + b < n_full : test_random( state ) % 100 < percent_full;
+                bits |= (uint64_t) set << b;
+            }
+            pp->inuse_bitmap[w] = bits;
+        }
+    }
+}
+
+static void
+test_folio_search()
+{
+    uint8_t  level = folio_search_level;
+    uint64_t state = 42;
+    for( uint32_t percent_full = 90; percent_full <= 100; percent_full += 5 )
+    {
+        // Every search agrees with the scalar loop, for each start and each level the CPU has.
+        const uint32_t n_words = 32;
+        test_fill_folios( 1, n_words, percent_full, percent_full == 95, &state );
+        per_folio* pp = test_fill_folio( 0, n_words );
+        for( uint32_t search = folio_search_scalar; search <= level; search++ )
+        {
+            folio_search_level = search;
+            for( uint32_t w_max = 0; w_max <= n_words; w_max++ )
+            {
+                for( uint32_t w = 0; w <= w_max; w++ )
+                {
+                    SM_ASSERT( folio_next_free_word( pp, w, w_max ) == folio_next_free_word_scalar( pp, w, w_max ) );
+                }
+            }
+        }
+        folio_search_level = level;
+    }
+}
+
+static void
+test_folio_headers()
+{
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        // Each header is whole cache lines with room for the bitmap, and they all fit before the first folio.
+        uint32_t header_size      = static_bin_info[bin].folio_header_size;
+        uint32_t folios_per_chunk = static_bin_info[bin].folios_per_chunk;
+        SM_ASSERT( header_size % cacheline_size == 0 );
+        SM_ASSERT( header_size >= offsetof( per_folio, inuse_bitmap ) + ceil32( static_bin_info[bin].objects_per_folio, 64 ) * 8 );
+        SM_ASSERT( folios_per_chunk * header_size <= static_bin_info[bin].overhead_pages_per_chunk * pagesize );
+        uint64_t objnum;
+        void*    chunk = (void*) chunksize;
+        void*    last  = (char*) chunk + static_bin_info[bin].overhead_pages_per_chunk * pagesize
+                     + folios_per_chunk * static_bin_info[bin].folio_size - 1;
+        per_folio* pp = small_object_folio( last, bin, &objnum );
+        SM_ASSERT( pp == small_chunk_folio( chunk, bin, folios_per_chunk - 1 ) );
+        SM_ASSERT( small_folio_number( bin, pp ) == folios_per_chunk - 1 );
+    }
+}
+
+static void
+test_lazy_chunk_init()
+{
+    const binnumber_t   bin              = 33;    // 8 folios per chunk
+    uint32_t            shard            = small_test_shard();
+    objects_per_folio_t o_per_folio      = static_bin_info[bin].objects_per_folio;
+    folios_per_chunk_t  folios_per_chunk = static_bin_info[bin].folios_per_chunk;
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    // A new chunk starts with only its first folio header initialized.
+    SM_ASSERT( small_malloc_add_chunk( shard, bin ) );
+    per_folio* folios = dsbi[shard].fresh[bin].folios;
+    SM_ASSERT( dsbi[shard].fresh[bin].n_initialized == 1 );
+    SM_ASSERT( dsbi[shard].lists.b[dynamic_small_bin_offset( bin ) + o_per_folio + 1] == folios );
+    check_dsbi_nonempty( shard, bin );
+
+    // The others are initialized as the mallocs get to them.
+    uint32_t n_max   = 4 * folios_per_chunk * o_per_folio;
+    void**   objects = malloc( n_max * sizeof( *objects ) );
+    uint32_t n       = 0;
+    while( true )
+    {
+        SM_ASSERT( n < n_max );
+        void*    p = objects[n++] = small_malloc( bin );
+        uint64_t objnum;
+        per_folio* pp = small_object_folio( p, bin, &objnum );
+        if( address_2_chunkaddress( p ) != address_2_chunkaddress( folios ) ) continue;
+        SM_ASSERT( small_folio_number( bin, pp ) < dsbi[shard].fresh[bin].n_initialized );
+        if( small_folio_number( bin, pp ) == folios_per_chunk - 1u ) break;
+    }
+    SM_ASSERT( dsbi[shard].fresh[bin].n_initialized == folios_per_chunk );
+    check_dsbi_nonempty( shard, bin );
+    verify_small_inuse_counts( shard, bin );
+    for( uint32_t i = 0; i < n; i++ ) small_free( objects[i] );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    free( objects );
+}
+
+#if SM_ACTIVE_FOLIO
+static void
+test_active_folio()
+{
+    const binnumber_t   bin         = 5;
+    uint32_t            shard       = small_test_shard();
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint32_t            dsbi_offset = dynamic_small_bin_offset( bin );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    void*      first = small_malloc( bin );
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( first, bin, &objnum );
+    SM_ASSERT( active_folios[bin] == pp && pp->free_count == folio_owned );
+
+    // Fill pp.  Each malloc comes out of pp without going near the lists.
+    uint32_t n       = o_per_folio - folio_inuse_count( bin, pp );
+    void**   objects = malloc( ( n + 2 ) * sizeof( *objects ) );
+    objects[0]       = first;
+    for( uint32_t i = 1; i <= n + 1; i++ )
+    {
+        objects[i] = small_malloc( bin );
+        SM_ASSERT( i > n || small_object_folio( objects[i], bin, &objnum ) == pp );
+    }
+    // The last one needed a new active folio, and pp went back on the list for full folios.
+    SM_ASSERT( active_folios[bin] != pp && small_object_folio( objects[n + 1], bin, &objnum ) == active_folios[bin] );
+    SM_ASSERT( pp->free_count == 0 );
+    bool found = false;
+    for( per_folio* p = dsbi[shard].lists.b[dsbi_offset]; p; p = p->next ) found |= ( p == pp );
+    SM_ASSERT( found );
+
+    for( uint32_t i = 0; i <= n + 1; i++ ) small_free( objects[i] );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    // Giving back the active folios (as a thread does when it exits) leaves the lists consistent.
+    active_folios_release_all();
+    SM_ASSERT( active_folios[bin] == NULL );
+    check_dsbi_nonempty( shard, bin );
+    verify_small_inuse_counts( shard, bin );
+    free( objects );
+}
+
+#if defined( __linux__ )
+static void*
+test_remote_free_worker( void* p )
+// Effect: Free p from another thread.  With the stash on, flush this thread's stash too, so that p goes the way a stash overflow
+//  would send it (through small_free_list() and small_release_object()).
+{
+    small_free( p );
+#if SM_SMALL_STASH
+    small_stash_flush( small_test_shard(), bin_from_bin_and_size( chunk_infos[address_2_chunknumber( p )].bin_and_size ) );
+#endif
+    return NULL;
+}
+#endif
+
+static void
+test_remote_free()
+{
+    const binnumber_t   bin         = 6;
+    uint32_t            shard       = small_test_shard();
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    void*      x = small_malloc( bin );
+    void*      y = small_malloc( bin );
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( x, bin, &objnum );
+    SM_ASSERT( active_folios[bin] == pp && small_object_folio( y, bin, &objnum ) == pp );
+    uint64_t free_state = atomic_load( &pp->free_state );
+
+#if defined( __linux__ )
+    // Another thread's free goes on pp's remote list, leaving the bitmap and free_state alone.
+    pthread_t thread;
+    SM_ASSERT( pthread_create( &thread, NULL, test_remote_free_worker, y ) == 0 );
+    pthread_join( thread, NULL );
+#else
+    // Call it as another thread would.
+    SM_ASSERT( remote_free_push( pp, y ) );
+#endif
+    SM_ASSERT( atomic_load( &pp->remote_frees ) == y );
+    SM_ASSERT( ( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 ) == 1 );
+    SM_ASSERT( atomic_load( &pp->free_state ) == free_state );
+
+    // When pp fills up, we get y's slot back.
+    uint32_t n       = o_per_folio - folio_inuse_count( bin, pp ) + 1;
+    void**   objects = malloc( n * sizeof( *objects ) );
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        objects[i] = small_malloc( bin );
+        SM_ASSERT( small_object_folio( objects[i], bin, &objnum ) == pp );
+    }
+    SM_ASSERT( atomic_load( &pp->remote_frees ) == NULL );
+    SM_ASSERT( folio_inuse_count( bin, pp ) == o_per_folio );
+
+    // Letting go of pp closes its list, and frees after that go to the bitmap.
+    SM_ASSERT( remote_free_push( pp, objects[0] ) );
+    active_folios_release_all();
+    SM_ASSERT( atomic_load( &pp->remote_frees ) == folio_remote_frees_closed );
+    SM_ASSERT( !remote_free_push( pp, objects[1] ) );
+    SM_ASSERT( folio_objects_in_use( pp, atomic_load( &pp->free_state ) ) == folio_inuse_count( bin, pp ) );
+    SM_ASSERT( pp->free_count == 1 );
+    for( uint32_t i = 1; i < n; i++ ) small_free( objects[i] );
+    small_free( x );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+    check_dsbi_nonempty( shard, bin );
+    verify_small_inuse_counts( shard, bin );
+    free( objects );
+}
+#endif
+
+static bool
+folio_is_madvised( uint32_t shard, binnumber_t bin, per_folio* pp )
+{
+    sm_lock( &small_locks[shard][bin] );
+    per_folio* p = dsbi[shard].lists.b[dynamic_small_bin_offset( bin ) + static_bin_info[bin].objects_per_folio + 1];
+    while( p && p != pp ) p = p->next;
+    sm_unlock( &small_locks[shard][bin] );
+    return p != NULL;
+}
+
+void
+small_test_purge( void )
+// Effect: Empty a few folios while a purge thread is running, and check that they end up in the madvised slot.
+{
+    const binnumber_t   bin         = 33;
+    uint32_t            shard       = small_test_shard();
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint32_t            n           = 4 * o_per_folio;
+    void**              objects     = malloc( n * sizeof( *objects ) );
+    for( uint32_t i = 0; i < n; i++ ) objects[i] = small_malloc( bin );
+    for( uint32_t i = 0; i < n; i++ ) small_free( objects[i] );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+#if SM_ACTIVE_FOLIO
+    active_folios_release_all();
+#endif
+    small_sync_folios( shard, bin );
+    purge_wait_until_idle();
+    // Every folio we used is empty, and all but the one we keep committed have been purged.
+    uint32_t n_folios = 0, n_madvised = 0;
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        uint64_t   objnum;
+        per_folio* pp    = small_object_folio( objects[i], bin, &objnum );
+        bool       first = true;
+        for( uint32_t j = 0; j < i; j++ ) first &= small_object_folio( objects[j], bin, &objnum ) != pp;
+        if( !first ) continue;
+        n_folios++;
+        n_madvised += folio_is_madvised( shard, bin, pp );
+    }
+    SM_ASSERT( n_folios >= 4 && n_madvised >= n_folios - 1 );
+    check_dsbi_nonempty( shard, bin );
+    verify_small_inuse_counts( shard, bin );
+    free( objects );
+}
+
+void
+small_test_purge_decay( void )
+// Effect: With decay (and a half-life too long for a pass to come due by itself), empty a few folios, and check that they
+//  stay committed until we run decay passes, and that the counters add up.
+{
+    const binnumber_t   bin         = 33;
+    uint32_t            shard       = small_test_shard();
+    objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+    uint64_t            folio_pages = static_bin_info[bin].folio_size / pagesize;
+    uint32_t            n           = 4 * o_per_folio;
+    void**              objects     = malloc( n * sizeof( *objects ) );
+    for( uint32_t i = 0; i < n; i++ ) objects[i] = small_malloc( bin );
+    for( uint32_t i = 0; i < n; i++ ) small_free( objects[i] );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+#if SM_ACTIVE_FOLIO
+    active_folios_release_all();
+#endif
+    small_sync_folios( shard, bin );
+    check_dsbi_nonempty( shard, bin );
+    uint32_t n_folios = 0;
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        uint64_t   objnum;
+        per_folio* pp    = small_object_folio( objects[i], bin, &objnum );
+        bool       first = true;
+        for( uint32_t j = 0; j < i; j++ ) first &= small_object_folio( objects[j], bin, &objnum ) != pp;
+        if( !first ) continue;
+        n_folios++;
+        SM_ASSERT( !folio_is_madvised( shard, bin, pp ) );
+    }
+    uint32_t n_retained = dsbi[shard].retained[bin].n;
+    SM_ASSERT( n_folios >= 4 && n_retained >= n_folios );
+
+    // Half of them are purged after a half-life, give or take the fraction of a folio carried over.
+    sm_purge_stats before, after;
+    sm_get_purge_stats( &before );
+    small_decay_folios( 32768 );
+    sm_get_purge_stats( &after );
+    uint32_t n_kept = dsbi[shard].retained[bin].n;
+    SM_ASSERT( 2 * n_kept <= n_retained + 1 && 2 * n_kept + 2 >= n_retained );
+    SM_ASSERT( after.purged_pages - before.purged_pages >= ( n_retained - n_kept ) * folio_pages );
+    check_dsbi_nonempty( shard, bin );
+
+    // The rest are purged when nothing is to be kept, and the first folio we allocate out of again counts as refaulted.
+    small_decay_folios( 0 );
+    SM_ASSERT( dsbi[shard].retained[bin].n == 0 );
+    for( uint32_t i = 0; i < n; i++ )
+    {
+        uint64_t objnum;
+        SM_ASSERT( folio_is_madvised( shard, bin, small_object_folio( objects[i], bin, &objnum ) ) );
+    }
+    check_dsbi_nonempty( shard, bin );
+    sm_get_purge_stats( &before );
+    for( uint32_t i = 0; i < o_per_folio; i++ ) objects[i] = small_malloc( bin );
+    sm_get_purge_stats( &after );
+    SM_ASSERT( after.refaulted_pages - before.refaulted_pages >= folio_pages );
+    for( uint32_t i = 0; i < o_per_folio; i++ ) small_free( objects[i] );
+#if SM_SMALL_STASH
+    small_stash_flush( shard, bin );
+#endif
+#if SM_ACTIVE_FOLIO
+    active_folios_release_all();
+#endif
+    small_sync_folios( shard, bin );
+    check_dsbi_nonempty( shard, bin );
+    verify_small_inuse_counts( shard, bin );
+    free( objects );
+}
+
+#if SM_SMALL_SHARDS > 1
+static void
+test_small_shards()
+{
+    const binnumber_t bin = 9;
+    uint32_t          s0  = small_test_shard();
+    uint32_t          s1  = ( s0 + 1 ) % SM_SMALL_SHARDS;
+#if SM_SMALL_STASH
+    small_stash_flush( s0, bin );
+    small_stash_flush( s1, bin );
+#endif
+    void* x = small_malloc( bin );
+    SM_ASSERT( small_chunk_shard( x ) == s0 );
+#if SM_ACTIVE_FOLIO
+    active_folios_release_all();
+#endif
+
+    // After the thread moves to another shard, it allocates out of that shard's chunks.
+    thread_shard.shard = s1;
+    void* y            = small_malloc( bin );
+    SM_ASSERT( small_chunk_shard( y ) == s1 && address_2_chunkaddress( y ) != address_2_chunkaddress( x ) );
+
+    // x goes into this thread's stash, but its folio is synced in the shard that owns it.
+    uint64_t   objnum;
+    per_folio* pp = small_object_folio( x, bin, &objnum );
+    small_free( x );
+#if SM_SMALL_STASH
+    SM_ASSERT( ( atomic_load( &stash[s1][bin].head ) & stash_pointer_mask ) == (uint64_t) x );
+    small_stash_flush( s1, bin );
+#endif
+    SM_ASSERT( ( ( pp->inuse_bitmap[objnum / 64] >> ( objnum % 64 ) ) & 1 ) == 0 );
+    small_sync_folios( s0, bin );
+    SM_ASSERT( !folio_state_dirty( atomic_load( &pp->free_state ) ) );
+    SM_ASSERT( !small_bin_has_dirty_folios( s1, bin ) );
+
+    small_free( y );
+#if SM_SMALL_STASH
+    small_stash_flush( s1, bin );
+#endif
+#if SM_ACTIVE_FOLIO
+    active_folios_release_all();
+#endif
+    thread_shard.shard = s0;
+    for( uint32_t shard = 0; shard < SM_SMALL_SHARDS; shard++ )
+    {
+        check_dsbi_nonempty( shard, bin );
+        verify_small_inuse_counts( shard, bin );
+    }
+}
+#endif
+
 #ifdef TESTING
 enum
 {
@@ -547,12 +2341,33 @@ static void* data16[n16];
 void
 test_small_malloc( void )
 {
+    uint32_t shard = small_test_shard();
     // test that the dsbi offsets look reasonable.
-    SM_ASSERT( &dsbi.lists.b0[0] == &dsbi.lists.b[dynamic_small_bin_offset( 0 )] );
-    SM_ASSERT( &dsbi.lists.b1[0] == &dsbi.lists.b[dynamic_small_bin_offset( 1 )] );
-    SM_ASSERT( &dsbi.lists.b2[0] == &dsbi.lists.b[dynamic_small_bin_offset( 2 )] );
+    SM_ASSERT( &dsbi[shard].lists.b0[0] == &dsbi[shard].lists.b[dynamic_small_bin_offset( 0 )] );
+    SM_ASSERT( &dsbi[shard].lists.b1[0] == &dsbi[shard].lists.b[dynamic_small_bin_offset( 1 )] );
+    SM_ASSERT( &dsbi[shard].lists.b2[0] == &dsbi[shard].lists.b[dynamic_small_bin_offset( 2 )] );
 
     test_bin_27();
+#if SM_SMALL_STASH
+    test_stash();
+#endif
+    test_small_batch();
+    test_lockfree_release();
+    test_folio_headers();
+    test_folio_search();
+    test_lazy_chunk_init();
+#if SM_ACTIVE_FOLIO
+    test_active_folio();
+    test_remote_free();
+#endif
+#if SM_SMALL_SHARDS > 1
+    test_small_shards();
+#endif
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        check_dsbi_nonempty( shard, bin );
+        verify_small_inuse_counts( shard, bin );
+    }
 
     for( int i = 0; i < n8; i++ ) { data8[i] = small_malloc( 8 ); }
     printf( "%p ", data8[0] );
@@ -576,10 +2391,52 @@ test_small_malloc( void )
     printf( "z (2k)=%p\n", z );
     SM_ASSERT( bin_from_bin_and_size( chunk_infos[address_2_chunknumber( z )].bin_and_size ) == size_2_bin( 2048 ) );
 
+    for( binnumber_t bin = 0; bin < first_large_bin_number; bin++ )
+    {
+        check_dsbi_nonempty( shard, bin );
+        verify_small_inuse_counts( shard, bin );
+    }
     for( int i = 0; i < n8; i++ ) { small_free( data8[i] ); }
     for( int i = 0; i < n16; i++ ) { small_free( data16[i] ); }
     small_free( x );
     small_free( y );
     small_free( z );
 }
+
+void
+time_folio_search( void )
+// Effect: Measure how long it takes to find the first word with a free slot in nearly full folios, with each search the CPU
+//  has.
+{
+    static const char* const names[]    = { "scalar", "sse4.1", "avx2" };
+    static const uint32_t    percents[] = { 90, 95, 99 };
+    const uint32_t           n_rounds   = 200;
+    uint8_t                  level      = folio_search_level;
+    uint64_t                 state      = 1;
+    for( uint32_t n_words = 8; n_words <= 32; n_words *= 4 )
+    {
+        for( uint32_t i = 0; i < 2 * sizeof( percents ) / sizeof( percents[0] ); i++ )
+        {
+            uint32_t percent_full = percents[i / 2];
+            bool     in_order     = i % 2 == 0;
+            test_fill_folios( test_n_folios, n_words, percent_full, in_order, &state );
+            for( uint32_t search = folio_search_scalar; search <= level; search++ )
+            {
+                folio_search_level = search;
+                uint64_t        sum = 0;
+                struct timespec start, end;
+                clock_gettime( CLOCK_MONOTONIC, &start );
+                for( uint32_t r = 0; r < n_rounds; r++ )
+                {
+                    for( uint32_t f = 0; f < test_n_folios; f++ ) sum += folio_next_free_word( test_fill_folio( f, n_words ), 0, n_words );
+                }
+                clock_gettime( CLOCK_MONOTONIC, &end );
+                printf( "%fns/folio search (%u words, %u%% full %s, %s, mean word %.1f)\n",
+                        tdiff( &start, &end ) * 1e9 / ( n_rounds * test_n_folios ), n_words, percent_full,
+                        in_order ? "in order" : "at random", names[search], sum / (double) ( n_rounds * test_n_folios ) );
+            }
+        }
+    }
+    folio_search_level = level;
+}
 #endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>    // size_t definition
+#include <stdint.h>
 
 #if defined( __cplusplus )
 extern "C"
@@ -18,6 +19,112 @@ void* sm_realloc( void* p, size_t size );
 // non-standard API
 size_t sm_malloc_usable_size( const void* ptr );
 
+// Free ptr, which sm_malloc(), sm_calloc() or sm_realloc() returned for
+// size bytes.  Cheaper than sm_free() for small sizes.  Not for
+// pointers from the aligned allocation functions.
+void sm_free_sized( void* ptr, size_t size );
+
+// Allocate n objects of size bytes each into out[0..n), returning how
+// many were allocated (fewer than n only if memory ran out).  Faster
+// than n calls to sm_malloc() for small sizes.
+size_t sm_malloc_batch( size_t size, size_t n, void** out );
+
+// Free ptrs[0..n) (NULL entries are skipped).  Faster than n calls to
+// sm_free() when many of the objects are small and the same size.
+void sm_free_batch( void** ptrs, size_t n );
+
+// Turn cold bin merging on or off (it is off by default).  While it is
+// on, a size class that hasn't been used much yet borrows objects from
+// a somewhat bigger class instead of taking memory of its own, until
+// it has been used enough to be worth its own memory.  That lowers the
+// baseline memory use of processes that allocate many different sizes
+// a little, at the price of some wasted space in the objects handed out
+// meanwhile.  sm_free_sized() gets slightly slower once this has been
+// turned on.
+void sm_set_merge_cold_bins( int enable );
+
+// What a child process does with the heap after fork() (Linux only).
+//  SM_FORK_INHERIT_HEAP: the child keeps allocating from the parent's
+//   chunks, just as if it were the parent.  This is the default.
+//  SM_FORK_FRESH_HEAP: the child starts with empty allocator metadata
+//   and takes new chunks for everything it allocates.  Small and large
+//   objects inherited from the parent can still be used and freed, but
+//   freeing them doesn't make their memory reusable.  In exchange, the
+//   parent's data pages and metadata stay shared with the child, which
+//   saves copy-on-write faults in prefork servers.
+// The mode applies to every later fork() of the calling process.
+typedef enum sm_fork_mode
+{
+    SM_FORK_INHERIT_HEAP = 0,
+    SM_FORK_FRESH_HEAP   = 1
+} sm_fork_mode;
+
+void sm_set_fork_mode( sm_fork_mode mode );
+
+// Who gives the memory of empty small folios and of freed large
+// objects back to the kernel (with madvise(), Linux only).
+//  SM_PURGE_INLINE: the free() that released the memory does it.
+//   This is the default.
+//  SM_PURGE_BACKGROUND_THREAD: free() queues the memory, and a thread
+//   the allocator starts purges it.
+//  SM_PURGE_USER_THREAD: free() queues the memory, and a thread the
+//   application starts purges it by calling sm_purge_thread_run().
+//   While no such thread runs, free() purges inline.
+// Memory that is queued can't be reused until it has been purged.
+typedef enum sm_purge_mode
+{
+    SM_PURGE_INLINE            = 0,
+    SM_PURGE_BACKGROUND_THREAD = 1,
+    SM_PURGE_USER_THREAD       = 2
+} sm_purge_mode;
+
+void sm_set_purge_mode( sm_purge_mode mode );
+
+// In SM_PURGE_USER_THREAD mode, purge queued memory on the calling
+// thread until sm_purge_thread_stop() is called.  Returns right away
+// in the other modes, or if another purge thread is running.
+void sm_purge_thread_run( void );
+
+// Make sm_purge_thread_run() return, and wait until it has.  Whatever
+// it left queued has been purged when this returns.
+void sm_purge_thread_stop( void );
+
+// Keep empty folios and freed large objects committed, and purge them
+// gradually: of what stays unused, half is purged every half_life_ms
+// milliseconds, oldest first.  This saves the madvise() and the page
+// faults when a burst of frees is followed by a burst of mallocs of the
+// same sizes.  The purge thread does the purging, or while none runs,
+// free().  0 (the default) turns decay off and purges what is retained:
+// then all but one empty folio per size class are purged right away.
+void sm_set_purge_decay( uint64_t half_life_ms );
+
+// Keep up to bytes of freed large objects (from about 14 KiB to half
+// a chunk, 1 MiB by default) committed, where the next malloc() of the
+// same size finds them without page faults.  Once more is retained,
+// the oldest of them are purged in a batch, down to half of bytes.
+// The default is SM_LARGE_RETAINED_BYTES (32 MiB); 0 purges every
+// large object when it is freed (unless there is decay).  Where the
+// kernel has MADV_FREE, purged large objects are only taken back when
+// it runs short of memory.
+void sm_set_large_retained_bytes( size_t bytes );
+
+// Counters for tuning the purge policy.  purges counts the madvise()
+// calls, and purged_pages the pages they gave back.  refaulted_pages
+// counts the purged pages that malloc() has handed out again, which
+// the program faults back in when it touches them (with MADV_FREE,
+// only if the kernel took them in the meantime).  saved_pages counts
+// the pages of retained large objects that malloc() has handed out
+// again: the page faults that retaining them saved.
+typedef struct sm_purge_stats
+{
+    uint64_t purges;
+    uint64_t purged_pages;
+    uint64_t refaulted_pages;
+    uint64_t saved_pages;
+} sm_purge_stats;
+
+void sm_get_purge_stats( sm_purge_stats* stats );
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,17 +7,28 @@ run_tests()
 
     //>test_platform();
     //>test_cache_early();
+    test_locks();
     test_hyperceil();
     test_size_2_bin();
     test_makechunk();
     test_huge_malloc();
     test_large_malloc();
+    test_page_runs();
     test_small_malloc();
+    test_cached_malloc();
+    test_cpu_cache();
+    test_fork();
+    test_purge();
     test_realloc();
+    test_free_sized();
+    test_malloc_batch();
+    test_cold_bin_merging();
     test_malloc_usable_size();
     test_object_base();
 
     time_small_malloc();
+    time_folio_search();
+    time_cached_malloc();
 }
 
 int
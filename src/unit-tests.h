@@ -9,16 +9,27 @@ extern "C"
 void initialize_malloc( void );
 //void test_platform( void );
 //void test_cache_early( void );
+void test_locks( void );
 void test_hyperceil( void );
 void test_size_2_bin( void );
 void test_makechunk( void );
 void test_huge_malloc( void );
 void test_large_malloc( void );
+void test_page_runs( void );
 void test_small_malloc( void );
+void test_cached_malloc( void );
+void test_cpu_cache( void );
+void test_fork( void );
+void test_purge( void );
 void test_realloc( void );
+void test_free_sized( void );
+void test_malloc_batch( void );
+void test_cold_bin_merging( void );
 void test_malloc_usable_size( void );
 void test_object_base( void );
 void time_small_malloc( void );
+void time_cached_malloc( void );
+void time_folio_search( void );
 
 #ifdef __cplusplus
 }